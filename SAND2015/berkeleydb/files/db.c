@@ -520,6 +520,10 @@ __env_setup(dbp, txn, fname, dname, id, flags)
 //          printf("Calling liblock_lock_init() for lock #%d\n", lock_id);
             liblock_lock_init(liblock_lock_name, liblock_server_cores[lock_id],
                               (liblock_lock_t *)(&mutexp->u.m.lmutex), NULL);
+
+            char lock_name[32];
+            sprintf(lock_name, "bdb-%d", lock_id);
+            liblock_placement_register((liblock_lock_t *)(&mutexp->u.m.lmutex), lock_name);
         }
     }
 /** -EDIT */
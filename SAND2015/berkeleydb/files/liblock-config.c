@@ -110,6 +110,15 @@ __attribute__ ((constructor (103))) static void liblock_init() {
     liblock_server_cores[10] = topology->nodes[0].cores[1];
 #endif
 
+    /* a placement computed by a profiling run (LIBLOCK_PLACEMENT) overrides the hand-tuned one */
+    for (i = 0; i < NUM_LOCKS; i++)
+    {
+        char name[32];
+
+        sprintf(name, "bdb-%d", i);
+        liblock_server_cores[i] = liblock_placement_core(name, liblock_server_cores[i]);
+    }
+
 	liblock_lock_name = getenv("LIBLOCK_LOCK_NAME");
 	if(!liblock_lock_name)
 		liblock_lock_name = "rcl";
@@ -144,14 +153,8 @@ __attribute__ ((constructor (103))) static void liblock_init() {
 	if(is_rcl) {
 		go = 0;
 
-        liblock_reserve_core_for(topology->nodes[0].cores[0], liblock_lock_name);
-#ifndef ONE_SERVER
-        liblock_reserve_core_for(topology->nodes[0].cores[1], liblock_lock_name);
-#endif
-/*
         for (i = 0; i < NUM_LOCKS; i++)
-	      liblock_reserve_core_for(liblock_server_cores[i], liblock_lock_name);
-*/
+            liblock_reserve_core_for(liblock_server_cores[i], liblock_lock_name);
       
         /* launch the liblock threads */
 		liblock_lookup(liblock_lock_name)->run(do_go); 
@@ -1,6 +1,6 @@
 RCL="rcl"
 
-benchs="$RCL mcs spinlock flat posix saml cohort"
+benchs="$RCL mcs spinlock flat posix saml cohort ccsynch dsmsynch hsynch ffwd cna shfl"
 #benchs="mcsmit mcs" 
 
 RUNS=30
@@ -23,6 +23,10 @@ bench_definitions=(
     'ccsynch'           'CCSYNCH'            '[ccsynch] liblock: '             'gl_ccsynch'   'lc rgb "#4a0000" lt 1 pt 13 pointsize 1.3' 'lc rgb "#ff9494" lt 1 pt 6' '-F ccsynch'
     'fccsynch'           'FCCSYNCH'            '[ccsynch] liblock: '             'gl_ccsynch'   'lc rgb "#000000" lt 1 pt 13 pointsize 1.3' 'lc rgb "#000000" lt 1 pt 6' '-F fccsynch'
     'dsmsynch'           'DSMSYNCH'            '[dsmsynch] liblock: '             'gl_dsmsynch'   'lc rgb "#4a0000" lt 1 pt 14 pointsize 1.3' 'lc rgb "#ff94ff" lt 1 pt 6' '-F dsmsynch'
+    'hsynch'           'HSYNCH'            '[hsynch] liblock: '             'gl_hsynch'   'lc rgb "#4a0000" lt 1 pt 15 pointsize 1.3' 'lc rgb "#ff94ff" lt 1 pt 6' '-F hsynch'
+    'ffwd'           'FFWD'            '[ffwd] liblock: '             'gl_ffwd'   'lc rgb "#4a0000" lt 1 pt 5 pointsize 1.3' 'lc rgb "#ff9494" lt 1 pt 6' '-F ffwd'
+    'cna'           'CNA'            '[cna] liblock: '             'gl_cna'   'lc rgb "#006575" lt 1 pt 7 pointsize 1.3' 'lc rgb "#82ffff" lt 1 pt 6' '-F cna'
+    'shfl'           'SHFL'            '[shfl] liblock: '             'gl_shfl'   'lc rgb "#006575" lt 1 pt 9 pointsize 1.3' 'lc rgb "#82ff82" lt 1 pt 6' '-F shfl'
 )
 
 on_bench() {
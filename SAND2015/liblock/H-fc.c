@@ -17,29 +17,19 @@
 #include <stdint.h>
 #include "liblock.h"
 #include "liblock-fatal.h"
-
-#define MAX_LOCKS 65536
+#include "flatcombining.h"
+#include "park.h"
+#include "clock.h"
 
 #define CLEANUP_FREQUENCY     100
 #define CLEANUP_OLD_THRESHOLD 10
 
-#define NODE_NUM			  8
-
 /*
  * For the Hflat combining algorithm, see
  * [1] Danny Hendler, Itai Incze, Nir Shavit, Moran Tzafrir:
  *     Hflat combining and the synchronization-parallelism tradeoff.
  *     SPAA 2010: 355-364
  */
-struct request {
-	struct request* volatile next;
-	unsigned int volatile active;
-	void* (* volatile pending)(void*);
-	unsigned int volatile age;
-	void* volatile val;
-	unsigned int thread_id;
-};
-
 struct fc_liblock_impl {
 	unsigned int volatile lock;
 	unsigned int volatile count;
@@ -48,48 +38,47 @@ struct fc_liblock_impl {
 };
 
 struct liblock_impl {
-	struct fc_liblock_impl fc_locks[NODE_NUM];
-	unsigned int lock_id;
+	struct fc_liblock_impl* fc_locks; /* one per node */
 	unsigned int volatile lock;
+	struct request* volatile cur; /* request executed by the combiner */
 	liblock_lock_t* liblock_lock;
-	char pad[pad_to_cache_line(
-			NODE_NUM * sizeof(struct fc_liblock_impl) + 2 * sizeof(unsigned int) + sizeof(void*))];
+	char pad[pad_to_cache_line(sizeof(unsigned int) + 3 * sizeof(void*))];
 };
 
-static unsigned int cur_lock_number = 0;
-
-static __thread struct request __attribute__((aligned (CACHE_LINE_SIZE))) *_local_requests =
-		0;
-
 static struct liblock_impl* do_liblock_init_lock(Hflat)(liblock_lock_t* lock,
 		struct core* core, pthread_mutexattr_t* attr) {
 	int i = 0;
-	struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
 
 	impl->lock = 0;
+	impl->cur = 0;
+	lock->r0 = 0;
+	impl->fc_locks = liblock_allocate(
+			topology->nb_nodes * sizeof(struct fc_liblock_impl));
 
-	for (i = 0; i < NODE_NUM; i++) {
+	for (i = 0; i < topology->nb_nodes; i++) {
 		impl->fc_locks[i].lock = 0;
 		impl->fc_locks[i].count = 0;
 		impl->fc_locks[i].head = 0;
 	}
 
-	impl->lock_id = __sync_fetch_and_add(&cur_lock_number, 1);
-
-	if (cur_lock_number > MAX_LOCKS)
-		fatal("too many Hflat lock");
-
 	return impl;
 }
 
 static int do_liblock_destroy_lock(Hflat)(liblock_lock_t* lock) {
+	int i;
+
+	for (i = 0; i < topology->nb_nodes; i++)
+		fc_retire_all(lock->impl->fc_locks[i].head);
+
+	free(lock->impl->fc_locks);
 	return 0;
 }
 
-static void enqueue_request(struct fc_liblock_impl* impl, unsigned int lock_id) {
-	struct request* request = &_local_requests[lock_id];
+static void enqueue_request(struct fc_liblock_impl* impl,
+		struct request* request) {
 	struct request* supposed;
-	request->active = 1;
+	request->active = FC_ACTIVE;
 
 	do {
 		supposed = impl->head;
@@ -98,71 +87,115 @@ static void enqueue_request(struct fc_liblock_impl* impl, unsigned int lock_id)
 			!= supposed);
 }
 
-static void build_request() {
-	_local_requests = mmap(0, sizeof(struct request) * MAX_LOCKS,
-	PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+/* executes the requests published on the node and releases the lock */
+static void combine(struct liblock_impl* himpl, struct fc_liblock_impl* impl) {
+	unsigned int count = ++impl->count;
+	struct request* cur;
+	void* (*pending)(void*);
+	int released;
+
+	for (cur = impl->head; cur; cur = cur->next) {
+		pending = cur->pending;
+		if (fc_executable(pending) && fc_claim(cur, pending)) {
+			pending = liblock_timed_untag(pending);
+			himpl->cur = cur;
+			cur->val = pending(cur->val);
+			released = cur->pending == FC_RELEASED;
+			cur->pending = 0;
+			cur->age = count;
+			if (released)
+				break;
+		}
+	}
+
+	if (!(count % CLEANUP_FREQUENCY)) {
+		struct request* prev = impl->head;
+		if (!prev)
+			fatal("zarbi");
+		while ((cur = prev->next)) {
+			if ((cur->age + CLEANUP_OLD_THRESHOLD) < count) {
+				prev->next = cur->next;
+				fc_retire(cur);
+			} else
+				prev = cur;
+		}
+	}
+
+	himpl->lock = 0;
 }
 
-static void* do_liblock_execute_operation(Hflat)(liblock_lock_t* lock,
+static void* execute_operation(liblock_lock_t* lock,
 		void* (*pending)(void*), void* val) {
-	int node_id = self.running_core->node->node_id;
+	int node_id = self.running_core ? self.running_core->node->node_id : 0;
 
 	struct liblock_impl* himpl = lock->impl;
 	struct fc_liblock_impl* impl = &himpl->fc_locks[node_id];
-	struct request* request;
-
-	if (!_local_requests)
-		build_request();
+	struct request* request = fc_record(himpl);
 
-	//printf("lock %d\n", impl->lock_id);
-	request = &_local_requests[himpl->lock_id];
 	request->val = val;
 	request->pending = pending;
 	request->thread_id = self.id;
 
 	while (1) {
 		if (!request->active)
-			enqueue_request(impl, himpl->lock_id);
+			enqueue_request(impl, request);
 
 		while (impl->lock && request->pending && request->active)
 			PAUSE();
 
 		if (!request->pending)
 			return request->val;
-		else if (!__sync_val_compare_and_swap(&himpl->lock, 0, 1))
-			break;
+		else if (!__sync_val_compare_and_swap(&himpl->lock, 0, 1)) {
+			if (!request->active)
+				enqueue_request(impl, request);
+			/* the request may still be pending after a critical section that released the lock */
+			combine(himpl, impl);
+		}
 	}
+}
 
-	if (!request->active)
-		enqueue_request(impl, himpl->lock_id);
+/* the request is withdrawn at the deadline if no combiner has claimed it */
+static int execute_timed(liblock_lock_t* lock,
+		void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	int node_id = self.running_core ? self.running_core->node->node_id : 0;
 
-	unsigned int count = ++impl->count;
-	struct request* cur;
+	struct liblock_impl* himpl = lock->impl;
+	struct fc_liblock_impl* impl = &himpl->fc_locks[node_id];
+	struct request* request = fc_record(himpl);
 
-	for (cur = impl->head; cur; cur = cur->next) {
-		if (cur->pending) {
-			cur->val = cur->pending(cur->val);
-			cur->pending = 0;
-			cur->age = count;
-		}
-	}
+	request->val = val;
+	request->pending = pending = liblock_timed_tag(pending);
+	request->thread_id = self.id;
 
-	if (!(count % CLEANUP_FREQUENCY)) {
-		struct request* prev = impl->head;
-		if (!prev)
-			fatal("zarbi");
-		while ((cur = prev->next)) {
-			if ((cur->age + CLEANUP_OLD_THRESHOLD) < count) {
-				prev->next = cur->next;
-				cur->active = 0;
-			} else
-				prev = cur;
-		}
+	while (request->pending) {
+		if (!request->active)
+			enqueue_request(impl, request);
+
+		if (!himpl->lock && !__sync_val_compare_and_swap(&himpl->lock, 0, 1)) {
+			if (!request->active)
+				enqueue_request(impl, request);
+			combine(himpl, impl);
+		} else if (liblock_clock_expired(deadline) && fc_withdraw(request, pending))
+			return EBUSY;
+		else
+			PAUSE();
 	}
 
-	himpl->lock = 0;
+	*res = request->val;
+
+	return 0;
+}
+
+/* the critical sections are parked once one of them waited or released the lock, see park.h */
+static void* do_liblock_execute_operation(Hflat)(liblock_lock_t* lock,
+		void* (*pending)(void*), void* val) {
+	return liblock_park_exec(lock, execute_operation, pending, val);
+}
 
-	return request->val;
+static int do_liblock_execute_timed(Hflat)(liblock_lock_t* lock,
+		void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	return liblock_park_timed(lock, execute_operation, execute_timed, pending,
+			val, res, deadline);
 }
 
 static void do_liblock_init_library(Hflat)() {
@@ -180,46 +213,50 @@ static void do_liblock_run(Hflat)(void (*callback)()) {
 }
 
 static int do_liblock_cond_init(Hflat)(liblock_cond_t* cond) {
-	fatal("implement me");
+	return liblock_park_cond_init(cond);
 }
 
 static int do_liblock_cond_wait(Hflat)(liblock_cond_t* cond,
 		liblock_lock_t* lock) {
-	fatal("implement me");
+	return liblock_park_cond_timedwait(cond, lock, 0);
 }
 
 static int do_liblock_cond_timedwait(Hflat)(liblock_cond_t* cond,
 		liblock_lock_t* lock, const struct timespec* ts) {
-	fatal("implement me");
+	return liblock_park_cond_timedwait(cond, lock, ts);
 }
 
 static int do_liblock_cond_signal(Hflat)(liblock_cond_t* cond) {
-	fatal("implement me");
+	return liblock_park_cond_signal(cond);
 }
 
 static int do_liblock_cond_broadcast(Hflat)(liblock_cond_t* cond) {
-	fatal("implement me");
+	return liblock_park_cond_broadcast(cond);
 }
 
 static int do_liblock_cond_destroy(Hflat)(liblock_cond_t* cond) {
-	fatal("implement me");
+	return liblock_park_cond_destroy(cond);
 }
 
 static void do_liblock_on_thread_exit(Hflat)(struct thread_descriptor* desc) {
+	fc_release_records();
 }
 
 static void do_liblock_on_thread_start(Hflat)(struct thread_descriptor* desc) {
 }
 
 static void do_liblock_unlock_in_cs(Hflat)(liblock_lock_t* lock) {
-	fatal("not implemented");
+	if (!liblock_park_unlock_in_cs(lock))
+		fc_release(&lock->impl->lock, &lock->impl->cur);
 }
 
 static void do_liblock_relock_in_cs(Hflat)(liblock_lock_t* lock) {
-	fatal("not implemented");
+	if (!liblock_park_relock_in_cs(lock))
+		fc_reacquire(&lock->impl->lock, &lock->impl->cur);
 }
 
 static void do_liblock_declare_server(Hflat)(struct core* core) {
 }
 
-liblock_declare(Hflat);
+liblock_declare(Hflat,
+		._execute_timed = do_liblock_execute_timed(Hflat));
@@ -0,0 +1,144 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "liblock.h"
+#include "liblock-fatal.h"
+#include "synch.h"
+#include "park.h"
+#include "clock.h"
+
+/*
+ * CC-Synch: the threads swap a dummy node in a queue, the thread that finds a node not completed by a combiner
+ * becomes the combiner and executes the requests that follow its node. No core is dedicated to the lock.
+ */
+struct liblock_impl {
+	struct synch_queue         queue;
+	struct synch_node* volatile cur;              /* node executed by the combiner */
+	char                       pad[pad_to_cache_line(sizeof(void*))];
+};
+
+static struct liblock_impl* do_liblock_init_lock(ccsynch)(liblock_lock_t* lock, struct core* core, pthread_mutexattr_t* attr) {
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
+
+	synch_queue_init(&impl->queue);
+	impl->cur = 0;
+	lock->r0 = 0;
+
+	return impl;
+}
+
+static int do_liblock_destroy_lock(ccsynch)(liblock_lock_t* lock) {
+	synch_queue_destroy(&lock->impl->queue);
+	return 0;
+}
+
+static void* execute_operation(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	struct liblock_impl* impl = lock->impl;
+	struct synch_node*   node = synch_queue_enqueue(&impl->queue, pending, val);
+	void*                res;
+
+	if(!node->completed)
+		synch_queue_combine(&impl->cur, node);
+
+	res = node->val;
+	synch_node_put(node);
+
+	return res;
+}
+
+static int execute_timed(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+	struct synch_node*   node;
+
+	while(!(node = synch_queue_try_enqueue(&impl->queue, pending, val))) {
+		if(liblock_clock_expired(deadline))
+			return EBUSY;
+		PAUSE();
+	}
+
+	if(!node->completed)
+		synch_queue_combine(&impl->cur, node);
+
+	*res = node->val;
+	synch_node_put(node);
+
+	return 0;
+}
+
+/* the critical sections run on parking contexts once one of them waited or released the lock */
+static void* do_liblock_execute_operation(ccsynch)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	return liblock_park_exec(lock, execute_operation, pending, val);
+}
+
+static int do_liblock_execute_timed(ccsynch)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	return liblock_park_timed(lock, execute_operation, execute_timed, pending, val, res, deadline);
+}
+
+static void do_liblock_unlock_in_cs(ccsynch)(liblock_lock_t* lock) {
+	if(!liblock_park_unlock_in_cs(lock))
+		synch_queue_release(&lock->impl->cur);
+}
+
+static void do_liblock_relock_in_cs(ccsynch)(liblock_lock_t* lock) {
+	if(!liblock_park_relock_in_cs(lock))
+		lock->impl->cur = synch_queue_acquire(&lock->impl->queue);
+}
+
+static void do_liblock_init_library(ccsynch)() {
+}
+
+static void do_liblock_kill_library(ccsynch)() {
+}
+
+static void do_liblock_run(ccsynch)(void (*callback)()) {
+	if(__sync_val_compare_and_swap(&liblock_start_server_threads_by_hand, 1, 0) != 1)
+		fatal("servers are not managed by hand");
+	if(callback)
+		callback();
+}
+
+static int do_liblock_cond_init(ccsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_init(cond);
+}
+
+static int do_liblock_cond_timedwait(ccsynch)(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) {
+	return liblock_park_cond_timedwait(cond, lock, ts);
+}
+
+static int do_liblock_cond_wait(ccsynch)(liblock_cond_t* cond, liblock_lock_t* lock) {
+	return liblock_park_cond_timedwait(cond, lock, 0);
+}
+
+static int do_liblock_cond_signal(ccsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_signal(cond);
+}
+
+static int do_liblock_cond_broadcast(ccsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_broadcast(cond);
+}
+
+static int do_liblock_cond_destroy(ccsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_destroy(cond);
+}
+
+static void do_liblock_on_thread_start(ccsynch)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_on_thread_exit(ccsynch)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_declare_server(ccsynch)(struct core* core) {
+}
+
+liblock_declare(ccsynch,
+		._execute_timed = do_liblock_execute_timed(ccsynch));
@@ -0,0 +1,63 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdint.h>
+#include <time.h>
+#include <cpuid.h>
+#include "liblock.h"
+#include "clock.h"
+
+#define CALIBRATION_NS   200000               /* duration of the calibration loop */
+
+int    liblock_clock_tsc = 0;
+double liblock_clock_cycles_per_ns = 1;
+
+/* cpuid 0x80000007, edx bit 8: the TSC runs at a constant rate in every P-, C- and T-state */
+static int has_invariant_tsc() {
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+		return 0;
+
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+
+	if(!(edx & (1 << 8)))
+		return 0;
+
+	/* rdtscp, used at the end of the intervals */
+	__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+
+	return (edx & (1 << 27)) != 0;
+}
+
+void liblock_clock_init() {
+	uint64_t ns0, ns1, c0, c1;
+	float    mhz = 0;
+	int      i;
+
+	if(has_invariant_tsc()) {
+		ns0 = liblock_clock_monotonic_ns();
+		c0 = liblock_rdtsc();
+		do
+			ns1 = liblock_clock_monotonic_ns();
+		while(ns1 - ns0 < CALIBRATION_NS);
+		c1 = liblock_rdtscp();
+
+		liblock_clock_cycles_per_ns = (double)(c1 - c0) / (double)(ns1 - ns0);
+		liblock_clock_tsc = 1;
+		return;
+	}
+
+	for(i=0; i<topology->nb_cores; i++)
+		if(topology->cores[i].frequency > mhz)
+			mhz = topology->cores[i].frequency;
+
+	liblock_clock_cycles_per_ns = mhz ? mhz / 1000 : 1;
+}
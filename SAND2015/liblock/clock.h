@@ -0,0 +1,81 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#ifndef _LIBLOCK_CLOCK_H_
+#define _LIBLOCK_CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Timing of the lock paths. With an invariant TSC, the cycles are read with rdtsc (rdtscp at the end of a measured
+ * interval, it waits for the previous instructions) and converted with the ratio calibrated against CLOCK_MONOTONIC
+ * by liblock_clock_init. Otherwise, the cycles are derived from CLOCK_MONOTONIC with the same ratio, taken from the
+ * frequency of the cpu.
+ */
+extern int    liblock_clock_tsc;             /* 1 => the cycles come from an invariant TSC */
+extern double liblock_clock_cycles_per_ns;
+
+extern void   liblock_clock_init();          /* called by the liblock constructor */
+
+static inline uint64_t liblock_clock_monotonic_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t liblock_rdtsc() {
+	uint32_t lo, hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t liblock_rdtscp() {
+	uint32_t lo, hi;
+
+	asm volatile("rdtscp" : "=a"(lo), "=d"(hi) :: "rcx");
+
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* start of a measured interval */
+static inline uint64_t liblock_clock_cycles() {
+	if(liblock_clock_tsc)
+		return liblock_rdtsc();
+	return liblock_clock_monotonic_ns() * liblock_clock_cycles_per_ns;
+}
+
+/* end of a measured interval */
+static inline uint64_t liblock_clock_cycles_end() {
+	if(liblock_clock_tsc)
+		return liblock_rdtscp();
+	return liblock_clock_monotonic_ns() * liblock_clock_cycles_per_ns;
+}
+
+static inline uint64_t liblock_clock_ns() {
+	if(liblock_clock_tsc)
+		return liblock_rdtsc() / liblock_clock_cycles_per_ns;
+	return liblock_clock_monotonic_ns();
+}
+
+static inline uint64_t liblock_clock_us() {
+	return liblock_clock_ns() / 1000;
+}
+
+/* deadline of a timed execution in liblock_clock_ns time, 0 => a single attempt */
+static inline int liblock_clock_expired(uint64_t deadline) {
+	return !deadline || liblock_clock_ns() >= deadline;
+}
+
+#endif
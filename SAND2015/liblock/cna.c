@@ -0,0 +1,271 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "liblock.h"
+#include "liblock-fatal.h"
+#include "numa_lock.h"
+#include "clock.h"
+
+/*
+ * Compact NUMA-aware lock, see
+ * [1] Dave Dice, Alex Kogan:
+ *     Compact NUMA-aware locks.
+ *     EuroSys 2019: 12:1-12:15
+ *
+ * An MCS lock whose only shared state is the tail of the queue. At release, the owner looks in the queue for a waiter
+ * of its node and moves the waiters it skips to a secondary queue. The secondary queue is passed with the lock, in
+ * the spin word of the new owner, and is put back in front of the main queue when no waiter of the node is left or,
+ * from time to time, to bound the starvation of the other nodes.
+ */
+#define CNA_GRANTED     ((uintptr_t)1)        /* spin word of an owner without secondary queue */
+#define CNA_FLUSH_MASK  0xffff                /* the secondary queue is flushed once every CNA_FLUSH_MASK+1 releases */
+
+struct cna_node {
+	uintptr_t volatile        spin;             /* 0 => wait, CNA_GRANTED or head of the secondary queue => owner */
+	struct cna_node* volatile next;
+	struct cna_node*          sec_tail;         /* valid in the head of a secondary queue */
+	int                       node_id;
+	struct cna_node*          prev_held;        /* locks held by the thread */
+	struct liblock_impl*      impl;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct liblock_impl {
+	struct cna_node* volatile tail;
+};
+
+static __thread struct cna_node* held = 0;
+
+static struct cna_node* find_held(struct liblock_impl* impl) {
+	struct cna_node* node;
+
+	for(node=held; node; node=node->prev_held)
+		if(node->impl == impl)
+			return node;
+
+	fatal("lock released outside of a critical section");
+}
+
+static void lock_cna(struct liblock_impl* impl, struct cna_node* me) {
+	struct cna_node* tail;
+
+	me->next = 0;
+	me->spin = 0;
+	me->node_id = numa_lock_node_id();
+
+	tail = __sync_lock_test_and_set(&impl->tail, me);
+
+	if(!tail) {
+		me->spin = CNA_GRANTED;
+		return;
+	}
+
+	tail->next = me;
+
+	while(!me->spin)
+		PAUSE();
+}
+
+/* enters only an empty queue */
+static int trylock_cna(struct liblock_impl* impl, struct cna_node* me) {
+	me->next = 0;
+	me->spin = CNA_GRANTED;
+	me->node_id = numa_lock_node_id();
+
+	return !impl->tail && !__sync_val_compare_and_swap(&impl->tail, 0, me) ? 0 : EBUSY;
+}
+
+/* next waiter of the node of me, the waiters skipped are appended to the secondary queue of me */
+static struct cna_node* find_successor(struct cna_node* me) {
+	struct cna_node *next = me->next, *sec_head = next, *sec_tail = next, *cur;
+
+	if(next->node_id == me->node_id)
+		return next;
+
+	for(cur=next->next; cur; sec_tail=cur, cur=cur->next) {
+		if(cur->node_id == me->node_id) {
+			if(me->spin > CNA_GRANTED)
+				((struct cna_node*)me->spin)->sec_tail->next = sec_head;
+			else
+				me->spin = (uintptr_t)sec_head;
+			sec_tail->next = 0;
+			((struct cna_node*)me->spin)->sec_tail = sec_tail;
+			return cur;
+		}
+	}
+
+	return 0;
+}
+
+static void unlock_cna(struct liblock_impl* impl, struct cna_node* me) {
+	struct cna_node* succ;
+
+	if(!me->next) {
+		if(me->spin == CNA_GRANTED) {
+			if(__sync_val_compare_and_swap(&impl->tail, me, 0) == me)
+				return;
+		} else {
+			/* the secondary queue becomes the main queue */
+			struct cna_node* sec_head = (struct cna_node*)me->spin;
+			if(__sync_val_compare_and_swap(&impl->tail, me, sec_head->sec_tail) == me) {
+				sec_head->spin = CNA_GRANTED;
+				return;
+			}
+		}
+
+		while(!me->next)
+			PAUSE();
+	}
+
+	if((numa_lock_random() & CNA_FLUSH_MASK) && (succ = find_successor(me))) {
+		succ->spin = me->spin;
+	} else if(me->spin > CNA_GRANTED) {
+		succ = (struct cna_node*)me->spin;
+		succ->sec_tail->next = me->next;
+		succ->spin = CNA_GRANTED;
+	} else
+		me->next->spin = CNA_GRANTED;
+}
+
+static struct liblock_impl* do_liblock_init_lock(cna)(liblock_lock_t* lock, struct core* core, pthread_mutexattr_t* attr) {
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
+
+	impl->tail = 0;
+
+	return impl;
+}
+
+static int do_liblock_destroy_lock(cna)(liblock_lock_t* lock) {
+	return 0;
+}
+
+static void* do_liblock_execute_operation(cna)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	struct liblock_impl* impl = lock->impl;
+	struct cna_node      me;
+	void*                res;
+
+	lock_cna(impl, &me);
+
+	me.impl = impl;
+	me.prev_held = held;
+	held = &me;
+
+	res = pending(val);
+
+	held = me.prev_held;
+
+	unlock_cna(impl, &me);
+
+	return res;
+}
+
+static int do_liblock_execute_timed(cna)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+	struct cna_node      me;
+
+	while(trylock_cna(impl, &me)) {
+		if(liblock_clock_expired(deadline))
+			return EBUSY;
+		PAUSE();
+	}
+
+	me.impl = impl;
+	me.prev_held = held;
+	held = &me;
+
+	*res = pending(val);
+
+	held = me.prev_held;
+
+	unlock_cna(impl, &me);
+
+	return 0;
+}
+
+static void do_liblock_init_library(cna)() {
+}
+
+static void do_liblock_kill_library(cna)() {
+}
+
+static void do_liblock_run(cna)(void (*callback)()) {
+	if(__sync_val_compare_and_swap(&liblock_start_server_threads_by_hand, 1, 0) != 1)
+		fatal("servers are not managed by hand");
+	if(callback)
+		callback();
+}
+
+static int do_liblock_cond_init(cna)(liblock_cond_t* cond) {
+	return cond->has_attr ?
+		pthread_cond_init(&cond->impl.posix_cond, &cond->attr) :
+		pthread_cond_init(&cond->impl.posix_cond, 0);
+}
+
+static int cond_timedwait(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) {
+	struct liblock_impl* impl = lock->impl;
+	struct cna_node*     me = find_held(impl);
+	pthread_mutex_t*     stripe = numa_lock_cond_stripe(cond);
+	int res;
+
+	pthread_mutex_lock(stripe);
+
+	unlock_cna(impl, me);
+	if(ts)
+		res = pthread_cond_timedwait(&cond->impl.posix_cond, stripe, ts);
+	else
+		res = pthread_cond_wait(&cond->impl.posix_cond, stripe);
+	pthread_mutex_unlock(stripe);
+
+	lock_cna(impl, me);
+
+	return res;
+}
+
+static int do_liblock_cond_timedwait(cna)(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) {
+	return cond_timedwait(cond, lock, ts);
+}
+
+static int do_liblock_cond_wait(cna)(liblock_cond_t* cond, liblock_lock_t* lock) {
+	return cond_timedwait(cond, lock, 0);
+}
+
+static int do_liblock_cond_signal(cna)(liblock_cond_t* cond) {
+	return numa_lock_cond_wake(cond, pthread_cond_signal);
+}
+
+static int do_liblock_cond_broadcast(cna)(liblock_cond_t* cond) {
+	return numa_lock_cond_wake(cond, pthread_cond_broadcast);
+}
+
+static int do_liblock_cond_destroy(cna)(liblock_cond_t* cond) {
+	return pthread_cond_destroy(&cond->impl.posix_cond);
+}
+
+static void do_liblock_on_thread_start(cna)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_on_thread_exit(cna)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_unlock_in_cs(cna)(liblock_lock_t* lock) {
+	unlock_cna(lock->impl, find_held(lock->impl));
+}
+
+static void do_liblock_relock_in_cs(cna)(liblock_lock_t* lock) {
+	lock_cna(lock->impl, find_held(lock->impl));
+}
+
+static void do_liblock_declare_server(cna)(struct core* core) {
+}
+
+liblock_declare(cna,
+		._execute_timed = do_liblock_execute_timed(cna));
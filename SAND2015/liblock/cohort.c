@@ -6,33 +6,228 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/mman.h>
 #include "ticket_lock.h"
 #include "liblock.h"
-#include "mcs_lock2.h"
 #include "liblock-fatal.h"
+#include "clock.h"
 
-#define NODE_NUM		4
+/*
+ * Lock cohorting, see
+ * [1] David Dice, Virendra J. Marathe, Nir Shavit:
+ *     Lock cohorting: a general technique for designing NUMA locks.
+ *     PPoPP 2012: 247-256
+ *
+ * One MCS lock per cluster at each level of the topology (SMT siblings, LLC, node) and a global ticket lock. A thread
+ * takes the locks of its clusters from the closest level to the farthest, and stops as soon as a lock is passed to
+ * it with the upper levels. At release, the lock of a level is passed with the upper levels to a waiter of the
+ * cluster at most bounds[level] times in a row. The levels that do not group cores more than the previous one are
+ * skipped. LIBLOCK_COHORT_BOUNDS=smt,llc,node overrides the default bounds.
+ *
+ * A thread queues its own node at the first level only. At the next levels, the queued node is the one of the cluster
+ * below, used by the holder of the cluster lock: it stays valid when the lock of the cluster is passed on with the
+ * upper levels and the thread that queued it returns.
+ */
+#define DEFAULT_BOUND   64
+
+#define MCS_WAIT        0
+#define MCS_ACQUIRE     1                 /* the lock is passed, the upper levels must be acquired */
+#define MCS_INHERIT     2                 /* the lock is passed with the upper levels */
+
+struct cohort_node {
+	struct cohort_node* volatile next;
+	int volatile                 spin;
+	int                          count;       /* number of local handoffs of the lock */
+	char                         pad[pad_to_cache_line(sizeof(void*) + 2*sizeof(int))];
+};
+
+struct cohort_level {
+	struct cohort_node* volatile tail;
+	char                         pad[pad_to_cache_line(sizeof(void*))];
+	struct cohort_node           up;          /* node of the cluster in the lock of the next level */
+};
 
 struct liblock_impl {
-	pthread_mutex_t posix_lock;
-	ticketlock glock;
-	mcs_lock llock[NODE_NUM];
-	char pad[pad_to_cache_line(
-			sizeof(pthread_mutex_t) + sizeof(ticketlock) + sizeof(mcs_lock) * 4)];
+	pthread_mutex_t       posix_lock;
+	ticketlock            glock;
+	struct cohort_level*  levels[LIBLOCK_NB_LEVELS];   /* one MCS lock per cluster of each used level */
+	char                  pad[pad_to_cache_line(sizeof(pthread_mutex_t) + sizeof(ticketlock) +
+																							LIBLOCK_NB_LEVELS*sizeof(void*))];
+};
+
+/* a thread holding the lock */
+struct cohort_frame {
+	struct liblock_impl*  impl;
+	struct cohort_frame*  prev;
+	struct cohort_node    node;        /* in the lock of the first used level */
 };
 
+static int                         nb_levels = 0;              /* number of used levels */
+static int                         levels[LIBLOCK_NB_LEVELS];  /* used levels, from the closest to the farthest */
+static int                         bounds[LIBLOCK_NB_LEVELS];  /* indexed by the topology level */
+static pthread_once_t              levels_once = PTHREAD_ONCE_INIT;
+static __thread struct cohort_frame* frames = 0;
+
+static struct cohort_frame* find_frame(struct liblock_impl* impl) {
+	struct cohort_frame* frame;
+
+	for(frame=frames; frame; frame=frame->prev)
+		if(frame->impl == impl)
+			return frame;
+
+	fatal("lock released outside of a critical section");
+}
+
+static inline struct cohort_level* level_lock(struct liblock_impl* impl, int l) {
+	int level = levels[l];
+	return &impl->levels[level][self.running_core ? self.running_core->clusters[level] : 0];
+}
+
+static inline struct cohort_node* level_node(struct liblock_impl* impl, struct cohort_frame* frame, int l) {
+	return l ? &level_lock(impl, l - 1)->up : &frame->node;
+}
+
+static void lock_cohort(struct liblock_impl* impl, struct cohort_frame* frame) {
+	int l;
+
+	for(l=0; l<nb_levels; l++) {
+		struct cohort_level* lock = level_lock(impl, l);
+		struct cohort_node*  me = level_node(impl, frame, l), *tail;
+
+		me->next = 0;
+		me->spin = MCS_WAIT;
+
+		tail = __sync_lock_test_and_set(&lock->tail, me);
+
+		if(tail) {
+			tail->next = me;
+			while(me->spin == MCS_WAIT)
+				PAUSE();
+			if(me->spin == MCS_INHERIT)
+				return;
+		} else
+			me->count = 0;
+	}
+
+	ticket_lock(&impl->glock);
+}
+
+/* releases the levels below l after a failed trylock, their waiters must acquire the upper levels */
+static void release_levels(struct liblock_impl* impl, struct cohort_frame* frame, int l) {
+	while(l--) {
+		struct cohort_level* lock = level_lock(impl, l);
+		struct cohort_node*  me = level_node(impl, frame, l);
+
+		if(!me->next) {
+			if(__sync_val_compare_and_swap(&lock->tail, me, 0) == me)
+				continue;
+			while(!me->next)
+				PAUSE();
+		}
+
+		me->next->count = 0;
+		me->next->spin = MCS_ACQUIRE;
+	}
+}
+
+/* enters only empty queues */
+static int trylock_cohort(struct liblock_impl* impl, struct cohort_frame* frame) {
+	int l;
+
+	for(l=0; l<nb_levels; l++) {
+		struct cohort_level* lock = level_lock(impl, l);
+		struct cohort_node*  me = level_node(impl, frame, l);
+
+		me->next = 0;
+		me->spin = MCS_WAIT;
+		me->count = 0;
+
+		if(lock->tail || __sync_val_compare_and_swap(&lock->tail, 0, me)) {
+			release_levels(impl, frame, l);
+			return EBUSY;
+		}
+	}
+
+	if(ticket_trylock(&impl->glock)) {
+		release_levels(impl, frame, nb_levels);
+		return EBUSY;
+	}
+
+	return 0;
+}
+
+static void unlock_level(struct liblock_impl* impl, struct cohort_frame* frame, int l) {
+	struct cohort_level* lock;
+	struct cohort_node*  me;
+
+	if(l == nb_levels) {
+		ticket_unlock(&impl->glock);
+		return;
+	}
+
+	lock = level_lock(impl, l);
+	me = level_node(impl, frame, l);
+
+	if(me->next && me->count < bounds[levels[l]]) {
+		me->next->count = me->count + 1;
+		me->next->spin = MCS_INHERIT;
+		return;
+	}
+
+	unlock_level(impl, frame, l + 1);
+
+	if(!me->next) {
+		if(__sync_val_compare_and_swap(&lock->tail, me, 0) == me)
+			return;
+		while(!me->next)
+			PAUSE();
+	}
+
+	me->next->count = 0;
+	me->next->spin = MCS_ACQUIRE;
+}
+
+static void unlock_cohort(struct liblock_impl* impl, struct cohort_frame* frame) {
+	unlock_level(impl, frame, 0);
+}
+
+/* the levels and their bounds are chosen with the first lock, from the topology at that time */
+static void init_levels() {
+	const char* env = getenv("LIBLOCK_COHORT_BOUNDS");
+	int         level, prev = topology->nb_cores;
+
+	for(level=0; level<LIBLOCK_NB_LEVELS; level++) {
+		bounds[level] = DEFAULT_BOUND;
+		if(env && *env) {
+			bounds[level] = strtol(env, (char**)&env, 10);
+			if(*env == ',')
+				env++;
+		}
+
+		if(topology->nb_clusters[level] > 1 && topology->nb_clusters[level] < prev) {
+			levels[nb_levels++] = level;
+			prev = topology->nb_clusters[level];
+		}
+	}
+}
+
 static struct liblock_impl* do_liblock_init_lock(cohort)(liblock_lock_t* lock,
 		struct core* server, pthread_mutexattr_t* attr) {
-	int i;
-	struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), server);
+	int l, i;
+
+	pthread_once(&levels_once, init_levels);
 
 	impl->glock.u = 0;
 
-	for (i = 0; i < NODE_NUM; i++) {
-		impl->llock[i] = NULL;
+	for(l=0; l<nb_levels; l++) {
+		int level = levels[l];
+		impl->levels[level] = liblock_allocate(topology->nb_clusters[level]*sizeof(struct cohort_level));
+		for(i=0; i<topology->nb_clusters[level]; i++)
+			impl->levels[level][i].tail = 0;
 	}
 
 	pthread_mutex_init(&impl->posix_lock, 0);
@@ -41,38 +236,60 @@ static struct liblock_impl* do_liblock_init_lock(cohort)(liblock_lock_t* lock,
 }
 
 static int do_liblock_destroy_lock(cohort)(liblock_lock_t* lock) {
+	int l;
+
+	for(l=0; l<nb_levels; l++)
+		free(lock->impl->levels[levels[l]]);
+
 	pthread_mutex_destroy(&lock->impl->posix_lock);
 	return 0;
 }
 
-__thread mcs_lock_t my_node_c;
-
 static void* do_liblock_execute_operation(cohort)(liblock_lock_t* lock,
 		void* (*pending)(void*), void* val) {
 	struct liblock_impl* impl = lock->impl;
+	struct cohort_frame  frame;
 	void* res;
 
-	int node_id = self.running_core->node->node_id;
+	lock_cohort(impl, &frame);
 
-	if (!lock_mcs(&impl->llock[node_id], &my_node_c)) {
-		ticket_lock(&impl->glock);
+	frame.impl = impl;
+	frame.prev = frames;
+	frames = &frame;
 
-		res = pending(val);
+	res = pending(val);
 
-		if (!unlock_mcs(&impl->llock[node_id], &my_node_c)) {
-			ticket_unlock(&impl->glock);
-		}
-	} else {
-		res = pending(val);
+	frames = frame.prev;
 
-		if (!unlock_mcs(&impl->llock[node_id], &my_node_c)) {
-			ticket_unlock(&impl->glock);
-		}
-	}
+	unlock_cohort(impl, &frame);
 
 	return res;
 }
 
+static int do_liblock_execute_timed(cohort)(liblock_lock_t* lock,
+		void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+	struct cohort_frame  frame;
+
+	while(trylock_cohort(impl, &frame)) {
+		if(liblock_clock_expired(deadline))
+			return EBUSY;
+		PAUSE();
+	}
+
+	frame.impl = impl;
+	frame.prev = frames;
+	frames = &frame;
+
+	*res = pending(val);
+
+	frames = frame.prev;
+
+	unlock_cohort(impl, &frame);
+
+	return 0;
+}
+
 static void do_liblock_init_library(cohort)() {
 }
 
@@ -96,10 +313,11 @@ static int do_liblock_cond_init(cohort)(liblock_cond_t* cond) {
 static int cond_timedwait(liblock_cond_t* cond, liblock_lock_t* lock,
 		const struct timespec* ts) {
 	struct liblock_impl* impl = lock->impl;
+	struct cohort_frame* frame = find_frame(impl);
 	int res;
 
 	pthread_mutex_lock(&impl->posix_lock);
-	ticket_unlock(&impl->glock);
+	unlock_cohort(impl, frame);
 	if (ts)
 		res = pthread_cond_timedwait(&cond->impl.posix_cond, &impl->posix_lock,
 				ts);
@@ -107,7 +325,7 @@ static int cond_timedwait(liblock_cond_t* cond, liblock_lock_t* lock,
 		res = pthread_cond_wait(&cond->impl.posix_cond, &impl->posix_lock);
 	pthread_mutex_unlock(&impl->posix_lock);
 
-	ticket_lock(&impl->glock);
+	lock_cohort(impl, frame);
 
 	return res;
 }
@@ -141,15 +359,15 @@ static void do_liblock_on_thread_start(cohort)(struct thread_descriptor* desc) {
 }
 
 static void do_liblock_unlock_in_cs(cohort)(liblock_lock_t* lock) {
-	struct liblock_impl* impl = lock->impl;
-	ticket_unlock(&impl->glock);
+	unlock_cohort(lock->impl, find_frame(lock->impl));
 }
 
 static void do_liblock_relock_in_cs(cohort)(liblock_lock_t* lock) {
+	lock_cohort(lock->impl, find_frame(lock->impl));
 }
 
 static void do_liblock_declare_server(cohort)(struct core* core) {
 }
 
-liblock_declare(cohort);
-
+liblock_declare(cohort,
+		._execute_timed = do_liblock_execute_timed(cohort));
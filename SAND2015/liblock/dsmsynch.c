@@ -0,0 +1,251 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "liblock.h"
+#include "liblock-fatal.h"
+#include "synch.h"
+#include "park.h"
+#include "clock.h"
+
+/*
+ * DSM-Synch: as CC-Synch, but the nodes stay with their thread and each thread spins on its own node. The combiner
+ * completes a node only once it knows its successor or has reset the tail, a completed node is thus never read again
+ * and can be reused as soon as its owner returns.
+ */
+struct liblock_impl {
+	struct synch_node* volatile tail;
+	struct synch_node* volatile cur;               /* node executed by the combiner */
+	char                       pad[pad_to_cache_line(2*sizeof(void*))];
+};
+
+static struct liblock_impl* do_liblock_init_lock(dsmsynch)(liblock_lock_t* lock, struct core* core, pthread_mutexattr_t* attr) {
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
+
+	impl->tail = 0;
+	impl->cur = 0;
+	lock->r0 = 0;
+
+	return impl;
+}
+
+static int do_liblock_destroy_lock(dsmsynch)(liblock_lock_t* lock) {
+	return 0;
+}
+
+/* returns the node of the request once it is completed or once the thread is the combiner */
+static struct synch_node* enqueue(struct liblock_impl* impl, void* (*pending)(void*), void* val) {
+	struct synch_node* node = synch_node_get(), *pred;
+
+	node->pending = pending;
+	node->val = val;
+	node->next = 0;
+	node->wait = 1;
+	node->completed = 0;
+
+	pred = __sync_lock_test_and_set(&impl->tail, node);
+
+	if(pred) {
+		pred->next = node;
+		while(node->wait)
+			PAUSE();
+	}
+
+	return node;
+}
+
+/* enqueues the request only in an empty queue, the thread is then the combiner */
+static struct synch_node* try_enqueue(struct liblock_impl* impl, void* (*pending)(void*), void* val) {
+	struct synch_node* node;
+
+	if(impl->tail)
+		return 0;
+
+	node = synch_node_get();
+
+	node->pending = pending;
+	node->val = val;
+	node->next = 0;
+	node->wait = 0;
+	node->completed = 0;
+
+	if(!__sync_bool_compare_and_swap(&impl->tail, 0, node)) {
+		synch_node_put(node);
+		return 0;
+	}
+
+	return node;
+}
+
+/* successor of node, null if the lock is free */
+static struct synch_node* successor(struct liblock_impl* impl, struct synch_node* node) {
+	if(!node->next && __sync_bool_compare_and_swap(&impl->tail, node, 0))
+		return 0;
+
+	while(!node->next)
+		PAUSE();
+
+	return node->next;
+}
+
+/* a lock node is never executed, its owner becomes the combiner, see synch.h */
+static void combine(struct liblock_impl* impl, struct synch_node* tmp) {
+	struct synch_node*  next;
+	void*               val;
+	int                 counter = 0;
+
+	while(1) {
+		impl->cur = tmp;
+		val = tmp->pending(tmp->val);
+
+		if(impl->cur != tmp) {
+			/* tmp left the queue when its critical section released the lock, the combiner goes on after its lock node */
+			tmp->val = val;
+			tmp->completed = 1;
+			tmp->wait = 0;
+
+			tmp = impl->cur;
+			next = successor(impl, tmp);
+			synch_node_put(tmp);
+		} else {
+			tmp->val = val;
+
+			next = successor(impl, tmp);
+
+			tmp->completed = 1;
+			tmp->wait = 0;
+		}
+
+		if(!next)
+			break;
+
+		if(++counter >= SYNCH_MAX_COMBINE || next->pending == SYNCH_LOCK_REQUEST) {
+			next->wait = 0;
+			break;
+		}
+
+		tmp = next;
+	}
+}
+
+/* unlock_in_cs in place, the node being executed stays pending and its successor becomes the combiner */
+static void release(struct liblock_impl* impl) {
+	struct synch_node* node = impl->cur, *next;
+
+	impl->cur = 0;
+	next = successor(impl, node);
+
+	if(node->pending == SYNCH_LOCK_REQUEST)
+		synch_node_put(node);
+
+	if(next)
+		next->wait = 0;
+}
+
+static void* execute_operation(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	struct liblock_impl* impl = lock->impl;
+	struct synch_node*   node = enqueue(impl, pending, val);
+	void*                res;
+
+	if(!node->completed)
+		combine(impl, node);
+
+	res = node->val;
+	synch_node_put(node);
+
+	return res;
+}
+
+static int execute_timed(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+	struct synch_node*   node;
+
+	while(!(node = try_enqueue(impl, pending, val))) {
+		if(liblock_clock_expired(deadline))
+			return EBUSY;
+		PAUSE();
+	}
+
+	combine(impl, node);
+
+	*res = node->val;
+	synch_node_put(node);
+
+	return 0;
+}
+
+static void* do_liblock_execute_operation(dsmsynch)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	return liblock_park_exec(lock, execute_operation, pending, val);
+}
+
+static int do_liblock_execute_timed(dsmsynch)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	return liblock_park_timed(lock, execute_operation, execute_timed, pending, val, res, deadline);
+}
+
+static void do_liblock_unlock_in_cs(dsmsynch)(liblock_lock_t* lock) {
+	if(!liblock_park_unlock_in_cs(lock))
+		release(lock->impl);
+}
+
+static void do_liblock_relock_in_cs(dsmsynch)(liblock_lock_t* lock) {
+	if(!liblock_park_relock_in_cs(lock))
+		lock->impl->cur = enqueue(lock->impl, SYNCH_LOCK_REQUEST, 0);
+}
+
+static void do_liblock_init_library(dsmsynch)() {
+}
+
+static void do_liblock_kill_library(dsmsynch)() {
+}
+
+static void do_liblock_run(dsmsynch)(void (*callback)()) {
+	if(__sync_val_compare_and_swap(&liblock_start_server_threads_by_hand, 1, 0) != 1)
+		fatal("servers are not managed by hand");
+	if(callback)
+		callback();
+}
+
+static int do_liblock_cond_init(dsmsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_init(cond);
+}
+
+static int do_liblock_cond_timedwait(dsmsynch)(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) {
+	return liblock_park_cond_timedwait(cond, lock, ts);
+}
+
+static int do_liblock_cond_wait(dsmsynch)(liblock_cond_t* cond, liblock_lock_t* lock) {
+	return liblock_park_cond_timedwait(cond, lock, 0);
+}
+
+static int do_liblock_cond_signal(dsmsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_signal(cond);
+}
+
+static int do_liblock_cond_broadcast(dsmsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_broadcast(cond);
+}
+
+static int do_liblock_cond_destroy(dsmsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_destroy(cond);
+}
+
+static void do_liblock_on_thread_start(dsmsynch)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_on_thread_exit(dsmsynch)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_declare_server(dsmsynch)(struct core* core) {
+}
+
+liblock_declare(dsmsynch,
+		._execute_timed = do_liblock_execute_timed(dsmsynch));
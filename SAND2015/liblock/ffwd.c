@@ -0,0 +1,397 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "liblock.h"
+#include "liblock-fatal.h"
+#include "park.h"
+#include "clock.h"
+
+/*
+ * ffwd-style delegation: as with RCL, the critical sections of the locks of a server core are executed by a dedicated
+ * server thread, but the server does not answer in the request line of each client. The clients are grouped by
+ * FFWD_GROUP consecutive thread ids and the server answers a whole group with a single response line that holds the
+ * results of the group and one toggle bit per client. A client posts a request by flipping the toggle of its request
+ * line and the request is completed once the server has flipped the bit of the client in the response line. The
+ * server buffers the answers of a group and writes them back once the group is scanned, a response line thus costs
+ * one transfer for up to FFWD_GROUP clients.
+ *
+ * The server only scans the request lines of the live threads, in the order of liblock_active_ids: the answers of
+ * consecutive clients of a group are written back together, which is the common case since the ids are given in
+ * order. The server executes the critical sections in place and never blocks: a critical section that waits on a
+ * condition or releases its lock is parked (see park.h) and resumed by a later request of its client, the server loop
+ * then goes on from its scan on a new stack.
+ *
+ * A timed request (liblock_try_exec, liblock_timed_exec) is tagged (LIBLOCK_TIMED_TAG) and claimed by the server with
+ * a CAS on its pending field before the argument is read. The client withdraws an unclaimed request with a CAS and flips its toggle back.
+ */
+#define SERVER_DOWN     0
+#define SERVER_UP       1
+
+#define FFWD_CLAIMED    ((void* (*)(void*))1)
+
+#define FFWD_GROUP      ((CACHE_LINE_SIZE - sizeof(uint64_t))/sizeof(void*))  /* clients per response line */
+
+/*
+ *  structures
+ */
+struct request {                              /* one line per thread, written by the client */
+	void*                (*volatile pending)(void*); /* written after val, tagged if the client may withdraw it */
+	void* volatile                  val;
+	uint64_t volatile               toggle;   /* flipped by the client to post a request */
+	char                            pad[pad_to_cache_line(2*sizeof(void*) + sizeof(uint64_t))];
+};
+
+struct response {                             /* one line per group of clients, written by the server */
+	uint64_t volatile               toggles;  /* bit i is the toggle of the last request of the client i answered */
+	void* volatile                  vals[FFWD_GROUP];
+};
+
+struct scan {                                 /* pass of the server over the request lines */
+	unsigned int*                   ids;
+	unsigned int                    nb_ids;
+	unsigned int                    k;        /* next client */
+	struct response*                response; /* of the group being answered */
+	uint64_t                        toggles;
+	uint64_t                        answered;
+	void*                           vals[FFWD_GROUP];
+};
+
+struct server {
+	int volatile                    state;             /* SERVER_DOWN or SERVER_UP */
+	char                            pad0[pad_to_cache_line(sizeof(int))];
+
+	/* read by the clients */
+	struct core*                    core;              /* core of the server */
+	struct request*                 requests;          /* one per thread id */
+	struct response*                responses;         /* one per group of thread ids */
+	char                            pad1[pad_to_cache_line(3*sizeof(void*))];
+
+	/* not intensive shared accesses */
+	pthread_t                       tid;               /* server thread */
+	int volatile                    nb_attached_locks; /* number of locks attached to this server */
+	pthread_mutex_t                 lock_state;        /* lock for state transition */
+	struct scan*                    scan;              /* of the running loop, continued if a critical section parks */
+};
+
+struct liblock_impl {
+	struct server*                  server;
+	char                            pad[pad_to_cache_line(sizeof(struct server*))];
+};
+
+static struct server**                servers = 0;  /* one per core, allocated with the first lock of the core */
+static pthread_mutex_t                servers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct server*        me = 0;       /* server of the server thread */
+
+/*
+ *  server side
+ */
+/* the results before the toggles */
+static void answer(struct response* response, uint64_t toggles, uint64_t answered, void** vals) {
+	unsigned int i;
+
+	if(answered) {
+		for(i=0; i<FFWD_GROUP; i++)
+			if((answered >> i) & 1)
+				response->vals[i] = vals[i];
+		response->toggles = toggles ^ answered;
+	}
+}
+
+static void scan_requests(struct server* server, struct scan* scan) {
+	while(scan->k < scan->nb_ids) {
+		unsigned int    id = scan->ids[scan->k++], i = id % FFWD_GROUP;
+		struct request* request = &server->requests[id];
+
+		/* end of a run of clients of the same group */
+		if(&server->responses[id / FFWD_GROUP] != scan->response) {
+			if(scan->response)
+				answer(scan->response, scan->toggles, scan->answered, scan->vals);
+			scan->response = &server->responses[id / FFWD_GROUP];
+			scan->toggles = scan->response->toggles;
+			scan->answered = 0;
+		}
+
+		/* a thread exit moves the last id of liblock_active_ids, a client may thus be seen twice in a pass */
+		if(((scan->toggles >> i) & 1) != request->toggle && !((scan->answered >> i) & 1)) {
+			void* (*pending)(void*) = request->pending;
+
+			/* a withdrawn request may have been replaced by a new one, which is then executed */
+			if(pending && pending != FFWD_CLAIMED
+				 && (!liblock_is_timed(pending) || __sync_bool_compare_and_swap(&request->pending, pending, FFWD_CLAIMED))) {
+				/* the request is answered if its critical section parks, the answer is then the call */
+				scan->answered |= (uint64_t)1 << i;
+				scan->vals[i] = request->val;
+				scan->vals[i] = liblock_timed_untag(pending)(scan->vals[i]);
+			}
+		}
+	}
+
+	if(scan->response)
+		answer(scan->response, scan->toggles, scan->answered, scan->vals);
+}
+
+static void serve(void* arg) {
+	struct server* server = arg;
+	struct scan    scan;
+
+	/* the previous loop left its stack to a parked critical section, its pass is completed first */
+	if(server->scan) {
+		scan = *server->scan;
+		server->scan = &scan;
+		scan_requests(server, &scan);
+	} else
+		server->scan = &scan;
+
+	while(server->state == SERVER_UP) {
+		scan.ids = liblock_active_ids.ids;
+		scan.nb_ids = liblock_active_ids.nb;
+		scan.k = 0;
+		scan.response = 0;
+		scan.toggles = scan.answered = 0;
+
+		scan_requests(server, &scan);
+
+		PAUSE();
+	}
+
+	server->scan = 0;
+}
+
+static void* servicing_thread(void* arg) {
+	struct server* server = arg;
+
+	me = server;
+
+	liblock_on_server_thread_start("ffwd", self.id);
+
+	liblock_park_serve(serve, server);
+
+	liblock_on_server_thread_end("ffwd", self.id);
+
+	return 0;
+}
+
+static void launch_server(struct server* server) {
+	pthread_mutex_lock(&server->lock_state);
+
+	if(server->state == SERVER_DOWN) {
+		server->state = SERVER_UP;
+		liblock_thread_create_and_bind(server->core, "ffwd", &server->tid, 0, servicing_thread, server);
+	}
+
+	pthread_mutex_unlock(&server->lock_state);
+}
+
+static void destroy_server(struct server* server) {
+	pthread_mutex_lock(&server->lock_state);
+
+	if(server->state == SERVER_UP) {
+		server->state = SERVER_DOWN;
+		pthread_join(server->tid, 0);
+	}
+
+	pthread_mutex_unlock(&server->lock_state);
+}
+
+/* the request and response lines are placed on the node of the server */
+static struct server* get_server(struct core* core) {
+	struct server* server;
+
+	pthread_mutex_lock(&servers_lock);
+
+	if(!(server = servers[core->core_id])) {
+		size_t requests_size = r_align(sizeof(struct request)*id_manager.last, PAGE_SIZE);
+		size_t responses_size = r_align(sizeof(struct response)*(id_manager.last/FFWD_GROUP + 1), PAGE_SIZE);
+
+		server = liblock_allocate(sizeof(struct server));
+		server->core = core;
+		server->state = SERVER_DOWN;
+		server->nb_attached_locks = 0;
+		server->scan = 0;
+		pthread_mutex_init(&server->lock_state, 0);
+
+		server->requests = anon_mmap(requests_size);
+		liblock_bind_mem(server->requests, requests_size, core->node);
+
+		server->responses = anon_mmap(responses_size);
+		liblock_bind_mem(server->responses, responses_size, core->node);
+
+		servers[core->core_id] = server;
+	}
+
+	pthread_mutex_unlock(&servers_lock);
+
+	return server;
+}
+
+/*
+ *  client side
+ */
+static void* execute_operation(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	struct server*   server = lock->impl->server;
+	struct request*  request;
+	struct response* response;
+	unsigned int     index = self.id % FFWD_GROUP;
+	uint64_t         toggle;
+
+	request = &server->requests[self.id];
+	response = &server->responses[self.id / FFWD_GROUP];
+
+	request->val = val;
+	request->pending = pending;
+	toggle = !request->toggle;
+	request->toggle = toggle;
+
+	while(((response->toggles >> index) & 1) != toggle)
+		PAUSE();
+
+	return response->vals[index];
+}
+
+static int execute_timed(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct server*   server = lock->impl->server;
+	struct request*  request = &server->requests[self.id];
+	struct response* response = &server->responses[self.id / FFWD_GROUP];
+	unsigned int     index = self.id % FFWD_GROUP;
+	uint64_t         toggle;
+
+	request->val = val;
+	request->pending = pending = liblock_timed_tag(pending);
+	toggle = !request->toggle;
+	request->toggle = toggle;
+
+	while(((response->toggles >> index) & 1) != toggle) {
+		if(liblock_clock_expired(deadline) && __sync_bool_compare_and_swap(&request->pending, pending, 0)) {
+			request->toggle = !toggle;
+			return EBUSY;
+		}
+		PAUSE();
+	}
+
+	*res = response->vals[index];
+
+	return 0;
+}
+
+static void* do_liblock_execute_operation(ffwd)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	/* nested critical section of a lock of the same server, it can not be parked */
+	if(me == lock->impl->server)
+		return pending(val);
+
+	return liblock_park_submit(lock, execute_operation, pending, val);
+}
+
+static int do_liblock_execute_timed(ffwd)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	if(me == lock->impl->server) {
+		*res = pending(val);
+		return 0;
+	}
+
+	return liblock_park_submit_timed(lock, execute_operation, execute_timed, pending, val, res, deadline);
+}
+
+static struct liblock_impl* do_liblock_init_lock(ffwd)(liblock_lock_t* lock, struct core* core, pthread_mutexattr_t* attr) {
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
+	struct server*       server = get_server(core);
+
+	impl->server = server;
+	__sync_fetch_and_add(&server->nb_attached_locks, 1);
+
+	liblock_reserve_core_for(core, "ffwd");
+
+	/* the server may have been stopped with the last lock of the core */
+	if(!liblock_start_server_threads_by_hand)
+		launch_server(server);
+
+	return impl;
+}
+
+static int do_liblock_destroy_lock(ffwd)(liblock_lock_t* lock) {
+	struct server* server = lock->impl->server;
+
+	if(!__sync_sub_and_fetch(&server->nb_attached_locks, 1) && !liblock_servers_always_up)
+		destroy_server(server);
+
+	return 0;
+}
+
+static void do_liblock_init_library(ffwd)() {
+	servers = liblock_allocate(sizeof(struct server*)*topology->nb_cores);
+	memset(servers, 0, sizeof(struct server*)*topology->nb_cores);
+}
+
+static void do_liblock_kill_library(ffwd)() {
+}
+
+static void do_liblock_run(ffwd)(void (*callback)()) {
+	int i;
+
+	if(__sync_val_compare_and_swap(&liblock_start_server_threads_by_hand, 1, 0) != 1)
+		fatal("servers are not managed by hand");
+
+	for(i=0; i<topology->nb_cores; i++)
+		if(topology->cores[i].server_type && !strcmp(topology->cores[i].server_type, "ffwd"))
+			launch_server(get_server(&topology->cores[i]));
+
+	if(callback)
+		callback();
+}
+
+static int do_liblock_cond_init(ffwd)(liblock_cond_t* cond) {
+	return liblock_park_cond_init(cond);
+}
+
+static int do_liblock_cond_wait(ffwd)(liblock_cond_t* cond, liblock_lock_t* lock) {
+	return liblock_park_cond_timedwait(cond, lock, 0);
+}
+
+static int do_liblock_cond_timedwait(ffwd)(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) {
+	return liblock_park_cond_timedwait(cond, lock, ts);
+}
+
+static int do_liblock_cond_signal(ffwd)(liblock_cond_t* cond) {
+	return liblock_park_cond_signal(cond);
+}
+
+static int do_liblock_cond_broadcast(ffwd)(liblock_cond_t* cond) {
+	return liblock_park_cond_broadcast(cond);
+}
+
+static int do_liblock_cond_destroy(ffwd)(liblock_cond_t* cond) {
+	return liblock_park_cond_destroy(cond);
+}
+
+static void do_liblock_on_thread_exit(ffwd)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_on_thread_start(ffwd)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_unlock_in_cs(ffwd)(liblock_lock_t* lock) {
+	if(!liblock_park_unlock_in_cs(lock))
+		fatal("unlock_in_cs in a critical section executed in place");
+}
+
+static void do_liblock_relock_in_cs(ffwd)(liblock_lock_t* lock) {
+	if(!liblock_park_relock_in_cs(lock))
+		fatal("relock_in_cs in a critical section executed in place");
+}
+
+static void do_liblock_declare_server(ffwd)(struct core* core) {
+	if(!liblock_start_server_threads_by_hand)
+		launch_server(get_server(core));
+}
+
+liblock_declare(ffwd,
+		._execute_timed = do_liblock_execute_timed(ffwd));
@@ -17,8 +17,9 @@
 #include <stdint.h>
 #include "liblock.h"
 #include "liblock-fatal.h"
-
-#define MAX_LOCKS 65536
+#include "flatcombining.h"
+#include "park.h"
+#include "clock.h"
 
 #define CLEANUP_FREQUENCY     100
 #define CLEANUP_OLD_THRESHOLD 10
@@ -29,50 +30,35 @@
  *     Flat combining and the synchronization-parallelism tradeoff. 
  *     SPAA 2010: 355-364
  */
-struct request {
-	struct request*  volatile next;
-	unsigned int     volatile active;
-	void*          (*volatile pending)(void*);
-	unsigned int volatile     age;
-	void* volatile            val;
-	unsigned int              thread_id;
-};
-
 struct liblock_impl {
 	unsigned int volatile      lock;
 	unsigned int volatile      count;
 	struct request* volatile   head;
-	unsigned int               lock_id;
+	struct request* volatile   cur;               /* request executed by the combiner, null in a batch */
 	liblock_lock_t*            liblock_lock;
-	char                       pad[pad_to_cache_line(3*sizeof(unsigned int) + 2*sizeof(void*))];
+	char                       pad[pad_to_cache_line(2*sizeof(unsigned int) + 3*sizeof(void*))];
 };
 
-static unsigned int cur_lock_number = 0;
-
-static __thread struct request __attribute__((aligned (CACHE_LINE_SIZE))) *_local_requests = 0;
-
 static struct liblock_impl* do_liblock_init_lock(flat)(liblock_lock_t* lock, struct core* core, pthread_mutexattr_t* attr) {
-	struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
 
 	impl->lock = 0;
 	impl->count = 0;
 	impl->head = 0;
-	impl->lock_id = __sync_fetch_and_add(&cur_lock_number, 1);
-
-	if(cur_lock_number > MAX_LOCKS)
-		fatal("too many flat lock");
+	impl->cur = 0;
+	lock->r0 = 0;
 
 	return impl;
 }
 
 static int do_liblock_destroy_lock(flat)(liblock_lock_t* lock) {
+	fc_retire_all(lock->impl->head);
 	return 0;
 }
 
-static void enqueue_request(struct liblock_impl* impl) { 
-	struct request* request = &_local_requests[impl->lock_id];
+static void enqueue_request(struct liblock_impl* impl, struct request* request) {
 	struct request* supposed;
-	request->active = 1;
+	request->active = FC_ACTIVE;
 
 	do {
 		supposed = impl->head;
@@ -80,48 +66,59 @@ static void enqueue_request(struct liblock_impl* impl) {
 	} while(__sync_val_compare_and_swap(&impl->head, supposed, request) != supposed);
 }
 
-static void build_request() {
-	_local_requests = mmap(0, sizeof(struct request)*MAX_LOCKS, 
-												 PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
-}
-
-static void* do_liblock_execute_operation(flat)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
-	struct liblock_impl* impl = lock->impl;
-	struct request* request;
+/* the next requests of the same function in the publication list are executed with one call to the batch handler */
+__attribute__ ((noinline)) static void combine_batch(struct request* first, void* (*pending)(void*),
+																										 void (*handler)(void**, int), unsigned int count) {
+	struct request* batch[LIBLOCK_MAX_BATCH];
+	void*           vals[LIBLOCK_MAX_BATCH];
+	void*         (*function)(void*) = liblock_park_pending(pending, first->val);
+	struct request* cur;
+	int             n = 1, i;
 
-	if(!_local_requests)
-		build_request();
+	batch[0] = first;
+	vals[0] = *liblock_park_val(pending, &first->val);
 
-	//printf("lock %d\n", impl->lock_id);
-	request            = &_local_requests[impl->lock_id];
-	request->val       = val;
-    request->pending   = pending;
-	request->thread_id = self.id;
+	/* the function of a parking request is read before its claim, the timed ones are left to the combining loop */
+	for(cur=first->next; cur && n<LIBLOCK_MAX_BATCH; cur=cur->next) {
+		if(cur->pending == pending && liblock_park_pending(pending, cur->val) == function) {
+			batch[n] = cur;
+			vals[n++] = *liblock_park_val(pending, &cur->val);
+		}
+	}
 
-	while(1) {
-		if(!request->active)
-      enqueue_request(impl);
-    
-		while(impl->lock && request->pending && request->active)
-			PAUSE();
+	handler(vals, n);
 
-		if(!request->pending)
-			return request->val;
-		else if(!__sync_val_compare_and_swap(&impl->lock, 0, 1))
-			break;
+	for(i=0; i<n; i++) {
+		*liblock_park_val(pending, &batch[i]->val) = vals[i];
+		batch[i]->pending = 0;
+		batch[i]->age = count;
 	}
+}
 
-	if(!request->active)
-		enqueue_request(impl);
-
+/* executes the published requests and releases the lock */
+static void combine(struct liblock_impl* impl) {
 	unsigned int count = ++impl->count;
 	struct request* cur;
+	void* (*pending)(void*);
+	void (*handler)(void**, int);
+	int released;
 
 	for(cur=impl->head; cur; cur=cur->next) {
-		if(cur->pending) {
-			cur->val = cur->pending(cur->val);
-			cur->pending = 0;
-			cur->age = count;
+		pending = cur->pending;
+		if(fc_executable(pending) && fc_claim(cur, pending)) {
+			pending = liblock_timed_untag(pending);
+			if(liblock_nb_batch_handlers && (handler = liblock_batch_handler(liblock_park_pending(pending, cur->val)))) {
+				impl->cur = 0;
+				combine_batch(cur, pending, handler, count);
+			} else {
+				impl->cur = cur;
+				cur->val = pending(cur->val);
+				released = cur->pending == FC_RELEASED;
+				cur->pending = 0;
+				cur->age = count;
+				if(released)
+					break;
+			}
 		}
 	}
 
@@ -131,15 +128,76 @@ static void* do_liblock_execute_operation(flat)(liblock_lock_t* lock, void* (*pe
 		while((cur = prev->next)) {
 			if((cur->age + CLEANUP_OLD_THRESHOLD) < count) {
 				prev->next = cur->next;
-				cur->active = 0;
+				fc_retire(cur);
 			} else
 				prev = cur;
 		}
 	}
 
 	impl->lock = 0;
+}
+
+static void* execute_operation(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	struct liblock_impl* impl = lock->impl;
+	struct request* request = fc_record(impl);
+
+	request->val       = val;
+    request->pending   = pending;
+	request->thread_id = self.id;
+
+	while(1) {
+		if(!request->active)
+			enqueue_request(impl, request);
+    
+		while(impl->lock && request->pending && request->active)
+			PAUSE();
+
+		if(!request->pending)
+			return request->val;
+		else if(!__sync_val_compare_and_swap(&impl->lock, 0, 1)) {
+			if(!request->active)
+				enqueue_request(impl, request);
+			/* a combiner stops after a critical section that released the lock, the request may still be pending */
+			combine(impl);
+		}
+	}
+}
+
+/* the request is withdrawn at the deadline if no combiner has claimed it */
+static int execute_timed(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+	struct request* request = fc_record(impl);
+
+	request->val       = val;
+	request->pending   = pending = liblock_timed_tag(pending);
+	request->thread_id = self.id;
+
+	while(request->pending) {
+		if(!request->active)
+			enqueue_request(impl, request);
+
+		if(!impl->lock && !__sync_val_compare_and_swap(&impl->lock, 0, 1)) {
+			if(!request->active)
+				enqueue_request(impl, request);
+			combine(impl);
+		} else if(liblock_clock_expired(deadline) && fc_withdraw(request, pending))
+			return EBUSY;
+		else
+			PAUSE();
+	}
+
+	*res = request->val;
+
+	return 0;
+}
+
+/* the critical sections are parked once one of them waited or released the lock, see park.h */
+static void* do_liblock_execute_operation(flat)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	return liblock_park_exec(lock, execute_operation, pending, val);
+}
 
-	return request->val;
+static int do_liblock_execute_timed(flat)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	return liblock_park_timed(lock, execute_operation, execute_timed, pending, val, res, deadline);
 }
 
 static void do_liblock_init_library(flat)() {
@@ -156,44 +214,48 @@ static void do_liblock_run(flat)(void (*callback)()) {
 }
 
 static int do_liblock_cond_init(flat)(liblock_cond_t* cond) { 
-	fatal("implement me"); 
+	return liblock_park_cond_init(cond);
 }
 
 static int do_liblock_cond_wait(flat)(liblock_cond_t* cond, liblock_lock_t* lock) { 
-	fatal("implement me"); 
+	return liblock_park_cond_timedwait(cond, lock, 0);
 }
 
 static int do_liblock_cond_timedwait(flat)(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) { 
-	fatal("implement me"); 
+	return liblock_park_cond_timedwait(cond, lock, ts);
 }
 
 static int do_liblock_cond_signal(flat)(liblock_cond_t* cond) { 
-	fatal("implement me"); 
+	return liblock_park_cond_signal(cond);
 }
 
 static int do_liblock_cond_broadcast(flat)(liblock_cond_t* cond) { 
-	fatal("implement me"); 
+	return liblock_park_cond_broadcast(cond);
 }
 
 static int do_liblock_cond_destroy(flat)(liblock_cond_t* cond) { 
-	fatal("implement me"); 
+	return liblock_park_cond_destroy(cond);
 }
 
 static void do_liblock_on_thread_exit(flat)(struct thread_descriptor* desc) {
+	fc_release_records();
 }
 
 static void do_liblock_on_thread_start(flat)(struct thread_descriptor* desc) {
 }
 
 static void do_liblock_unlock_in_cs(flat)(liblock_lock_t* lock) {
-	fatal("not implemented");
+	if(!liblock_park_unlock_in_cs(lock))
+		fc_release(&lock->impl->lock, &lock->impl->cur);
 }
 
 static void do_liblock_relock_in_cs(flat)(liblock_lock_t* lock) {
-	fatal("not implemented");
+	if(!liblock_park_relock_in_cs(lock))
+		fc_reacquire(&lock->impl->lock, &lock->impl->cur);
 }
 
 static void do_liblock_declare_server(flat)(struct core* core) {
 }
 
-liblock_declare(flat);
+liblock_declare(flat,
+		._execute_timed = do_liblock_execute_timed(flat));
@@ -0,0 +1,188 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#ifndef _FLATCOMBINING_H_
+#define _FLATCOMBINING_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "liblock.h"
+#include "liblock-fatal.h"
+
+/*
+ * Publication records of the flat combining locks (flat and Hflat). A thread owns one record per lock it recently
+ * used, found by the address of the lock in a thread-local open addressing table and created at the first
+ * execution. Once the age-based cleanup of a combiner has removed a record from its publication list, the owner
+ * reuses it for the next lock it does not have a record for. The records still published when their thread exits
+ * become orphans and are freed by the cleanup, the other ones are freed at once.
+ *
+ * The pending field of a timed request (liblock_try_exec, liblock_timed_exec) is tagged (LIBLOCK_TIMED_TAG). Its owner
+ * withdraws it by clearing the field, the combiner claims it first by replacing the field with FC_CLAIMED. The other
+ * requests are not claimed.
+ *
+ * A critical section executed in place that waits or releases the lock (see park.h) leaves its request FC_RELEASED,
+ * the other combiners skip it and its owner waits for its end. The combiner takes the lock back, completes the request
+ * and stops combining: the publication list may have been cleaned up meanwhile.
+ */
+#define FC_INACTIVE       0
+#define FC_ACTIVE         1
+#define FC_ORPHAN         2                     /* active record of a thread that exited */
+
+#define FC_RECORDS_MIN    16                    /* initial size of the table of a thread */
+
+#define FC_CLAIMED        ((void* (*)(void*))1) /* pending field of a claimed request being executed */
+#define FC_RELEASED       ((void* (*)(void*))2) /* pending field of a request whose critical section released the lock */
+#define FC_RETAKEN        ((struct request*)1)  /* request of the combiner once the critical section took the lock back */
+
+struct request {
+	struct request*  volatile next;
+	unsigned int     volatile active;
+	void*          (*volatile pending)(void*);
+	unsigned int volatile     age;
+	void* volatile            val;
+	unsigned int              thread_id;
+	void*                     owner;              /* lock of the record */
+};
+
+struct fc_records {
+	unsigned int     size;                       /* power of 2 */
+	unsigned int     nb;                         /* used slots, at most size/2 */
+	struct request** slots;                      /* a record is never removed, only reused */
+};
+
+static __thread struct fc_records fc_records = { 0, 0, 0 };
+
+static inline unsigned int fc_hash(void* lock) {
+	return ((uintptr_t)lock / CACHE_LINE_SIZE) * 2654435761u;
+}
+
+static void fc_insert(struct fc_records* records, struct request* record) {
+	unsigned int h;
+
+	for(h=fc_hash(record->owner) & (records->size - 1); records->slots[h]; h=(h + 1) & (records->size - 1))
+		;
+
+	records->slots[h] = record;
+	records->nb++;
+}
+
+static void fc_grow(struct fc_records* records) {
+	struct fc_records grown = { records->size ? 2*records->size : FC_RECORDS_MIN, 0, 0 };
+	unsigned int      i;
+
+	grown.slots = liblock_allocate(grown.size*sizeof(struct request*));
+	memset(grown.slots, 0, grown.size*sizeof(struct request*));
+
+	for(i=0; i<records->size; i++)
+		if(records->slots[i])
+			fc_insert(&grown, records->slots[i]);
+
+	free(records->slots);
+	*records = grown;
+}
+
+/* record of the calling thread for lock */
+static struct request* fc_record(void* lock) {
+	struct fc_records* records = &fc_records;
+	struct request     *record, *reuse = 0;
+	unsigned int       h;
+
+	if(records->size) {
+		for(h=fc_hash(lock) & (records->size - 1); (record = records->slots[h]); h=(h + 1) & (records->size - 1)) {
+			if(record->owner == lock)
+				return record;
+			if(!reuse && record->active == FC_INACTIVE)
+				reuse = record;
+		}
+
+		if(reuse) {
+			reuse->owner = lock;
+			return reuse;
+		}
+	}
+
+	if(2*(records->nb + 1) > records->size)
+		fc_grow(records);
+
+	record = liblock_allocate(sizeof(struct request));
+	memset(record, 0, sizeof(struct request));
+	record->owner = lock;
+
+	fc_insert(records, record);
+
+	return record;
+}
+
+/* combiner side, 0 if the timed request was withdrawn, val must be read afterwards */
+static inline int fc_claim(struct request* record, void* (*pending)(void*)) {
+	return !liblock_is_timed(pending) || __sync_bool_compare_and_swap(&record->pending, pending, FC_CLAIMED);
+}
+
+/* owner side, 0 if the request is executed or being executed */
+static inline int fc_withdraw(struct request* record, void* (*pending)(void*)) {
+	return __sync_bool_compare_and_swap(&record->pending, pending, 0);
+}
+
+static inline int fc_executable(void* (*pending)(void*)) {
+	return pending && pending != FC_CLAIMED && pending != FC_RELEASED;
+}
+
+/* the critical section of the record cur executed by the combiner releases lock, null cur in a batch handler */
+static inline void fc_release(unsigned int volatile* lock, struct request* volatile* cur) {
+	struct request* record = *cur;
+
+	if(!record)
+		fatal("lock released by a batch handler");
+
+	if(record != FC_RETAKEN)
+		record->pending = FC_RELEASED;
+	*lock = 0;
+}
+
+static inline void fc_reacquire(unsigned int volatile* lock, struct request* volatile* cur) {
+	while(*lock || __sync_val_compare_and_swap(lock, 0, 1))
+		PAUSE();
+	*cur = FC_RETAKEN;
+}
+
+/* the record was removed from its publication list */
+static inline void fc_retire(struct request* record) {
+	if(__sync_lock_test_and_set(&record->active, FC_INACTIVE) == FC_ORPHAN)
+		free(record);
+}
+
+/* removes the records of a destroyed lock from a publication list */
+static inline void fc_retire_all(struct request* head) {
+	struct request* next;
+
+	for(; head; head=next) {
+		next = head->next;
+		fc_retire(head);
+	}
+}
+
+static void fc_release_records() {
+	struct fc_records* records = &fc_records;
+	unsigned int       i;
+
+	for(i=0; i<records->size; i++) {
+		struct request* record = records->slots[i];
+		if(record && __sync_val_compare_and_swap(&record->active, FC_ACTIVE, FC_ORPHAN) != FC_ACTIVE)
+			free(record);
+	}
+
+	free(records->slots);
+	records->size = 0;
+	records->nb = 0;
+	records->slots = 0;
+}
+
+#endif
@@ -73,7 +73,7 @@ static int fqueue_remove(struct fqueue* volatile* root, struct fqueue* node, voi
 	}
 }
 
-static void fqueue_ordered_insert(struct fqueue* volatile* root, struct fqueue* node, int lt(struct fqueue*, struct fqueue*)) {
+static inline void fqueue_ordered_insert(struct fqueue* volatile* root, struct fqueue* node, int lt(struct fqueue*, struct fqueue*)) {
 	uintptr_t volatile* pred;
 	struct fqueue* cur;
 
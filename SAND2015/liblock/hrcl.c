@@ -0,0 +1,442 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "liblock.h"
+#include "liblock-fatal.h"
+#include "clock.h"
+#include "park.h"
+
+/*
+ * Hierarchical RCL: the critical sections of the locks of a server core are executed by a single server thread, as
+ * with RCL, but the clients do not post their requests to the server. They post them in a request line that lives on
+ * their own NUMA node. On each node, the first waiting client becomes the proxy of the node: it gathers the pending
+ * requests of the node in a compact batch (four requests per cache line) placed on the node of the server, waits for
+ * the server to execute the whole batch and scatters the results. The server only polls one batch per node and a
+ * critical section costs a fraction of a line transfer between the nodes instead of a round-trip per client.
+ *
+ * The server executes the critical sections in place and never blocks: a critical section that waits on a condition or
+ * releases its lock is parked (see park.h) and resumed by a later request of its client, the server loop then goes on
+ * from its scan on a new stack. A nested critical section of a lock of the same server is executed directly and can
+ * not be parked.
+ *
+ * A proxy claims the requests it gathers by replacing their pending field with HRCL_CLAIMED. A timed request
+ * (liblock_try_exec, liblock_timed_exec) is tagged (LIBLOCK_TIMED_TAG) and claimed with a CAS, its client withdraws it
+ * unless it is claimed.
+ */
+#define SERVER_DOWN     0
+#define SERVER_UP       1
+
+#define HRCL_MAX_BATCH  LIBLOCK_MAX_BATCH
+#define HRCL_CLAIMED    ((void* (*)(void*))1)
+
+/*
+ *  structures
+ */
+struct request {                              /* one line per thread and per node, on the node */
+	void*                (*volatile pending)(void*); /* pending request or null if no pending request */
+	void* volatile                  val;      /* argument, then result of the request */
+	char                            pad[pad_to_cache_line(2*sizeof(void*))];
+};
+
+struct node_queue {                           /* requests of the clients of a node for a server, on the node */
+	int volatile                    proxy;    /* held by the client that gathers the batch of the node */
+	char                            pad[pad_to_cache_line(sizeof(int))];
+	struct request                  requests[];
+};
+
+struct entry {
+	void*                (*volatile pending)(void*);
+	void* volatile                  val;
+};
+
+struct batch {                                /* posted by the proxy of a node, on the node of the server */
+	int volatile                    nb;       /* number of entries, reset by the server once they are executed */
+	char                            pad[pad_to_cache_line(sizeof(int))];
+	struct entry                    entries[HRCL_MAX_BATCH];
+};
+
+struct scan {                                 /* position of the server in its pass over the batches */
+	int                             n;        /* node of the batch */
+	int                             i;        /* next entry of the batch */
+};
+
+struct server {
+	int volatile                    state;             /* SERVER_DOWN or SERVER_UP */
+	char                            pad0[pad_to_cache_line(sizeof(int))];
+
+	/* read by the clients */
+	struct core*                    core;              /* core of the server */
+	struct node_queue**             queues;            /* one per node */
+	struct batch*                   batches;           /* one per node */
+	char                            pad1[pad_to_cache_line(3*sizeof(void*))];
+
+	/* not intensive shared accesses */
+	pthread_t                       tid;               /* server thread */
+	int volatile                    nb_attached_locks; /* number of locks attached to this server */
+	pthread_mutex_t                 lock_state;        /* lock for state transition */
+	struct scan*                    scan;              /* of the running loop, continued if a critical section parks */
+};
+
+struct liblock_impl {
+	struct server*                  server;
+	char                            pad[pad_to_cache_line(sizeof(struct server*))];
+};
+
+static struct server**                servers = 0;  /* one per core, allocated with the first lock of the core */
+static pthread_mutex_t                servers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct server*        me = 0;       /* server of the server thread */
+
+/*
+ *  server side
+ */
+/* consecutive requests of a function with a batch handler are executed with one call */
+static void execute_batch(struct batch* batch, int nb, struct scan* scan) {
+	void (*handler)(void**, int);
+	void* vals[HRCL_MAX_BATCH];
+	int   i, j, k;
+
+	while((i = scan->i) < nb) {
+		void* (*pending)(void*) = batch->entries[i].pending;
+		void* (*function)(void*) = liblock_park_pending(pending, batch->entries[i].val);
+
+		if(liblock_nb_batch_handlers && (handler = liblock_batch_handler(function))) {
+			for(k=0, j=i; j<nb && batch->entries[j].pending == pending
+						&& liblock_park_pending(pending, batch->entries[j].val) == function; j++)
+				vals[k++] = *liblock_park_val(pending, &batch->entries[j].val);
+
+			handler(vals, k);
+
+			for(j=0; j<k; j++)
+				*liblock_park_val(pending, &batch->entries[i + j].val) = vals[j];
+
+			scan->i = i + k;
+		} else {
+			/* the entry is executed if its critical section parks, its value is then the call */
+			scan->i = i + 1;
+			batch->entries[i].val = pending(batch->entries[i].val);
+		}
+	}
+}
+
+static void scan_batches(struct server* server, struct scan* scan) {
+	int nb;
+
+	for(; scan->n<topology->nb_nodes; scan->n++) {
+		struct batch* batch = &server->batches[scan->n];
+
+		if((nb = batch->nb)) {
+			execute_batch(batch, nb, scan);
+			batch->nb = 0;
+			scan->i = 0;
+		}
+	}
+
+	scan->n = 0;
+}
+
+static void serve(void* arg) {
+	struct server* server = arg;
+	struct scan    scan = { 0, 0 };
+
+	/* the previous loop left its stack to a parked critical section, its pass is completed first */
+	if(server->scan) {
+		scan = *server->scan;
+		server->scan = &scan;
+		scan_batches(server, &scan);
+	} else
+		server->scan = &scan;
+
+	while(server->state == SERVER_UP) {
+		scan_batches(server, &scan);
+		PAUSE();
+	}
+
+	server->scan = 0;
+}
+
+static void* servicing_thread(void* arg) {
+	struct server* server = arg;
+
+	me = server;
+
+	liblock_on_server_thread_start("hrcl", self.id);
+
+	liblock_park_serve(serve, server);
+
+	liblock_on_server_thread_end("hrcl", self.id);
+
+	return 0;
+}
+
+static void launch_server(struct server* server) {
+	pthread_mutex_lock(&server->lock_state);
+
+	if(server->state == SERVER_DOWN) {
+		server->state = SERVER_UP;
+		liblock_thread_create_and_bind(server->core, "hrcl", &server->tid, 0, servicing_thread, server);
+	}
+
+	pthread_mutex_unlock(&server->lock_state);
+}
+
+static void destroy_server(struct server* server) {
+	pthread_mutex_lock(&server->lock_state);
+
+	if(server->state == SERVER_UP) {
+		server->state = SERVER_DOWN;
+		pthread_join(server->tid, 0);
+	}
+
+	pthread_mutex_unlock(&server->lock_state);
+}
+
+/* the request lines of a node are placed on the node, the batches on the node of the server */
+static struct server* get_server(struct core* core) {
+	struct server* server;
+	int            n;
+
+	pthread_mutex_lock(&servers_lock);
+
+	if(!(server = servers[core->core_id])) {
+		size_t queue_size = r_align(sizeof(struct node_queue) + sizeof(struct request)*id_manager.last, PAGE_SIZE);
+		size_t batch_size = r_align(sizeof(struct batch)*topology->nb_nodes, PAGE_SIZE);
+
+		server = liblock_allocate(sizeof(struct server));
+		server->core = core;
+		server->state = SERVER_DOWN;
+		server->nb_attached_locks = 0;
+		server->scan = 0;
+		pthread_mutex_init(&server->lock_state, 0);
+
+		server->queues = liblock_allocate(sizeof(struct node_queue*)*topology->nb_nodes);
+		for(n=0; n<topology->nb_nodes; n++) {
+			server->queues[n] = anon_mmap(queue_size);
+			liblock_bind_mem(server->queues[n], queue_size, &topology->nodes[n]);
+		}
+
+		server->batches = anon_mmap(batch_size);
+		liblock_bind_mem(server->batches, batch_size, core->node);
+
+		servers[core->core_id] = server;
+	}
+
+	pthread_mutex_unlock(&servers_lock);
+
+	return server;
+}
+
+/*
+ *  client side
+ */
+/* executed by the proxy of the node */
+static void gather(struct node_queue* queue, struct batch* batch) {
+	struct request* reqs[HRCL_MAX_BATCH];
+	unsigned int*   ids = liblock_active_ids.ids;
+	unsigned int    nb_ids = liblock_active_ids.nb, k;
+	int             n = 0, i;
+
+	for(k=0; k<nb_ids && n<HRCL_MAX_BATCH; k++) {
+		struct request* req = &queue->requests[ids[k]];
+		void*         (*pending)(void*) = req->pending;
+
+		/* claimed: after a thread exit moved the last id of liblock_active_ids, a client may be seen twice */
+		if(pending && pending != HRCL_CLAIMED
+			 && (!liblock_is_timed(pending) || __sync_bool_compare_and_swap(&req->pending, pending, HRCL_CLAIMED))) {
+			req->pending = HRCL_CLAIMED;
+			reqs[n] = req;
+			batch->entries[n].pending = liblock_timed_untag(pending);
+			batch->entries[n].val = req->val;
+			n++;
+		}
+	}
+
+	if(!n)
+		return;
+
+	batch->nb = n;
+
+	while(batch->nb)
+		PAUSE();
+
+	for(i=0; i<n; i++) {
+		reqs[i]->val = batch->entries[i].val;
+		reqs[i]->pending = 0;
+	}
+}
+
+static void* execute_operation(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	struct server*     server = lock->impl->server;
+	struct core_node*  node;
+	struct node_queue* queue;
+	struct request*    req;
+
+	node = self.running_core ? self.running_core->node : &topology->nodes[0];
+	queue = server->queues[node->node_id];
+	req = &queue->requests[self.id];
+
+	req->val = val;
+	req->pending = pending;
+
+	while(req->pending) {
+		if(!queue->proxy && !__sync_lock_test_and_set(&queue->proxy, 1)) {
+			if(req->pending)
+				gather(queue, &server->batches[node->node_id]);
+			__sync_lock_release(&queue->proxy);
+		} else
+			PAUSE();
+	}
+
+	return req->val;
+}
+
+static int execute_timed(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct server*     server = lock->impl->server;
+	struct core_node*  node;
+	struct node_queue* queue;
+	struct request*    req;
+
+	node = self.running_core ? self.running_core->node : &topology->nodes[0];
+	queue = server->queues[node->node_id];
+	req = &queue->requests[self.id];
+
+	req->val = val;
+	req->pending = pending = liblock_timed_tag(pending);
+
+	while(req->pending) {
+		if(!queue->proxy && !__sync_lock_test_and_set(&queue->proxy, 1)) {
+			if(req->pending)
+				gather(queue, &server->batches[node->node_id]);
+			__sync_lock_release(&queue->proxy);
+		} else if(liblock_clock_expired(deadline) && __sync_bool_compare_and_swap(&req->pending, pending, 0))
+			return EBUSY;
+		else
+			PAUSE();
+	}
+
+	*res = req->val;
+
+	return 0;
+}
+
+static void* do_liblock_execute_operation(hrcl)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	/* nested critical section of a lock of the same server */
+	if(me == lock->impl->server)
+		return pending(val);
+
+	return liblock_park_submit(lock, execute_operation, pending, val);
+}
+
+static int do_liblock_execute_timed(hrcl)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	if(me == lock->impl->server) {
+		*res = pending(val);
+		return 0;
+	}
+
+	return liblock_park_submit_timed(lock, execute_operation, execute_timed, pending, val, res, deadline);
+}
+
+static struct liblock_impl* do_liblock_init_lock(hrcl)(liblock_lock_t* lock, struct core* core, pthread_mutexattr_t* attr) {
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
+	struct server*       server = get_server(core);
+
+	impl->server = server;
+	__sync_fetch_and_add(&server->nb_attached_locks, 1);
+
+	liblock_reserve_core_for(core, "hrcl");
+
+	/* the server may have been stopped with the last lock of the core */
+	if(!liblock_start_server_threads_by_hand)
+		launch_server(server);
+
+	return impl;
+}
+
+static int do_liblock_destroy_lock(hrcl)(liblock_lock_t* lock) {
+	struct server* server = lock->impl->server;
+
+	if(!__sync_sub_and_fetch(&server->nb_attached_locks, 1) && !liblock_servers_always_up)
+		destroy_server(server);
+
+	return 0;
+}
+
+static void do_liblock_init_library(hrcl)() {
+	servers = liblock_allocate(sizeof(struct server*)*topology->nb_cores);
+	memset(servers, 0, sizeof(struct server*)*topology->nb_cores);
+}
+
+static void do_liblock_kill_library(hrcl)() {
+}
+
+static void do_liblock_run(hrcl)(void (*callback)()) {
+	int i;
+
+	if(__sync_val_compare_and_swap(&liblock_start_server_threads_by_hand, 1, 0) != 1)
+		fatal("servers are not managed by hand");
+
+	for(i=0; i<topology->nb_cores; i++)
+		if(topology->cores[i].server_type && !strcmp(topology->cores[i].server_type, "hrcl"))
+			launch_server(get_server(&topology->cores[i]));
+
+	if(callback)
+		callback();
+}
+
+static int do_liblock_cond_init(hrcl)(liblock_cond_t* cond) {
+	return liblock_park_cond_init(cond);
+}
+
+static int do_liblock_cond_wait(hrcl)(liblock_cond_t* cond, liblock_lock_t* lock) {
+	return liblock_park_cond_timedwait(cond, lock, 0);
+}
+
+static int do_liblock_cond_timedwait(hrcl)(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) {
+	return liblock_park_cond_timedwait(cond, lock, ts);
+}
+
+static int do_liblock_cond_signal(hrcl)(liblock_cond_t* cond) {
+	return liblock_park_cond_signal(cond);
+}
+
+static int do_liblock_cond_broadcast(hrcl)(liblock_cond_t* cond) {
+	return liblock_park_cond_broadcast(cond);
+}
+
+static int do_liblock_cond_destroy(hrcl)(liblock_cond_t* cond) {
+	return liblock_park_cond_destroy(cond);
+}
+
+static void do_liblock_on_thread_exit(hrcl)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_on_thread_start(hrcl)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_unlock_in_cs(hrcl)(liblock_lock_t* lock) {
+	if(!liblock_park_unlock_in_cs(lock))
+		fatal("unlock_in_cs in a critical section executed in place");
+}
+
+static void do_liblock_relock_in_cs(hrcl)(liblock_lock_t* lock) {
+	if(!liblock_park_relock_in_cs(lock))
+		fatal("relock_in_cs in a critical section executed in place");
+}
+
+static void do_liblock_declare_server(hrcl)(struct core* core) {
+	if(!liblock_start_server_threads_by_hand)
+		launch_server(get_server(core));
+}
+
+liblock_declare(hrcl,
+		._execute_timed = do_liblock_execute_timed(hrcl));
@@ -0,0 +1,180 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "ticket_lock.h"
+#include "liblock.h"
+#include "liblock-fatal.h"
+#include "synch.h"
+#include "park.h"
+#include "clock.h"
+
+/*
+ * H-Synch: one CC-Synch queue per NUMA node. The combiner of a node takes a global lock before executing the requests
+ * of its node, the requests of a node are thus executed in a batch with a single transfer of the global lock.
+ */
+struct liblock_impl {
+	ticketlock                 glock;
+	char                       pad0[pad_to_cache_line(sizeof(ticketlock))];
+	struct synch_queue*        queues;            /* one per node */
+	struct synch_node* volatile cur;              /* node executed by the holder of the global lock */
+	char                       pad1[pad_to_cache_line(2*sizeof(void*))];
+};
+
+static struct liblock_impl* do_liblock_init_lock(hsynch)(liblock_lock_t* lock, struct core* core, pthread_mutexattr_t* attr) {
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
+	int                  n;
+
+	impl->glock.u = 0;
+	impl->queues = liblock_allocate(sizeof(struct synch_queue)*topology->nb_nodes);
+	for(n=0; n<topology->nb_nodes; n++)
+		synch_queue_init(&impl->queues[n]);
+	impl->cur = 0;
+	lock->r0 = 0;
+
+	return impl;
+}
+
+static int do_liblock_destroy_lock(hsynch)(liblock_lock_t* lock) {
+	int n;
+
+	for(n=0; n<topology->nb_nodes; n++)
+		synch_queue_destroy(&lock->impl->queues[n]);
+	free(lock->impl->queues);
+
+	return 0;
+}
+
+static inline struct synch_queue* local_queue(struct liblock_impl* impl) {
+	return &impl->queues[self.running_core ? self.running_core->node->node_id : 0];
+}
+
+static void* execute_operation(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	struct liblock_impl* impl = lock->impl;
+	struct synch_node*   node = synch_queue_enqueue(local_queue(impl), pending, val);
+	void*                res;
+
+	if(!node->completed) {
+		ticket_lock(&impl->glock);
+		synch_queue_combine(&impl->cur, node);
+		ticket_unlock(&impl->glock);
+	}
+
+	res = node->val;
+	synch_node_put(node);
+
+	return res;
+}
+
+static int execute_timed(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+	struct synch_queue*  queue = local_queue(impl);
+	struct synch_node*   node;
+
+	while(!(node = synch_queue_try_enqueue(queue, pending, val))) {
+		if(liblock_clock_expired(deadline))
+			return EBUSY;
+		PAUSE();
+	}
+
+	if(!node->completed) {
+		/* combiner of the node, the role is passed on if the global lock is not acquired in time */
+		while(ticket_trylock(&impl->glock)) {
+			if(liblock_clock_expired(deadline)) {
+				synch_queue_withdraw(node);
+				return EBUSY;
+			}
+			PAUSE();
+		}
+
+		synch_queue_combine(&impl->cur, node);
+		ticket_unlock(&impl->glock);
+	}
+
+	*res = node->val;
+	synch_node_put(node);
+
+	return 0;
+}
+
+static void* do_liblock_execute_operation(hsynch)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	return liblock_park_exec(lock, execute_operation, pending, val);
+}
+
+static int do_liblock_execute_timed(hsynch)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	return liblock_park_timed(lock, execute_operation, execute_timed, pending, val, res, deadline);
+}
+
+/* in place, the combiner role of the queue and the global lock are released together */
+static void do_liblock_unlock_in_cs(hsynch)(liblock_lock_t* lock) {
+	if(!liblock_park_unlock_in_cs(lock)) {
+		synch_queue_release(&lock->impl->cur);
+		ticket_unlock(&lock->impl->glock);
+	}
+}
+
+static void do_liblock_relock_in_cs(hsynch)(liblock_lock_t* lock) {
+	if(!liblock_park_relock_in_cs(lock)) {
+		struct synch_node* node = synch_queue_acquire(local_queue(lock->impl));
+		ticket_lock(&lock->impl->glock);
+		lock->impl->cur = node;
+	}
+}
+
+static void do_liblock_init_library(hsynch)() {
+}
+
+static void do_liblock_kill_library(hsynch)() {
+}
+
+static void do_liblock_run(hsynch)(void (*callback)()) {
+	if(__sync_val_compare_and_swap(&liblock_start_server_threads_by_hand, 1, 0) != 1)
+		fatal("servers are not managed by hand");
+	if(callback)
+		callback();
+}
+
+static int do_liblock_cond_init(hsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_init(cond);
+}
+
+static int do_liblock_cond_timedwait(hsynch)(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) {
+	return liblock_park_cond_timedwait(cond, lock, ts);
+}
+
+static int do_liblock_cond_wait(hsynch)(liblock_cond_t* cond, liblock_lock_t* lock) {
+	return liblock_park_cond_timedwait(cond, lock, 0);
+}
+
+static int do_liblock_cond_signal(hsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_signal(cond);
+}
+
+static int do_liblock_cond_broadcast(hsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_broadcast(cond);
+}
+
+static int do_liblock_cond_destroy(hsynch)(liblock_cond_t* cond) {
+	return liblock_park_cond_destroy(cond);
+}
+
+static void do_liblock_on_thread_start(hsynch)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_on_thread_exit(hsynch)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_declare_server(hsynch)(struct core* core) {
+}
+
+liblock_declare(hsynch,
+		._execute_timed = do_liblock_execute_timed(hsynch));
@@ -13,6 +13,7 @@
 #include "k42.h"
 #include "liblock.h"
 #include "liblock-fatal.h"
+#include "clock.h"
 
 struct liblock_impl {
 	pthread_mutex_t       posix_lock;
@@ -21,7 +22,7 @@ struct liblock_impl {
 };
 
 static struct liblock_impl* do_liblock_init_lock(k42)(liblock_lock_t* lock, struct core* server, pthread_mutexattr_t* attr) {
-	struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), server);
 	impl->lock.next = NULL;
 	impl->lock.tail = NULL;
 	pthread_mutex_init(&impl->posix_lock, 0);
@@ -46,6 +47,22 @@ static void* do_liblock_execute_operation(k42)(liblock_lock_t* lock, void* (*pen
 	return res;
 }
 
+static int do_liblock_execute_timed(k42)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+
+	while(k42_trylock(&impl->lock)) {
+		if(liblock_clock_expired(deadline))
+			return EBUSY;
+		PAUSE();
+	}
+
+	*res = pending(val);
+
+	k42_unlock(&impl->lock);
+
+	return 0;
+}
+
 static void do_liblock_init_library(k42)() {
 }
 
@@ -119,5 +136,6 @@ static void do_liblock_relock_in_cs(k42)(liblock_lock_t* lock) {
 static void do_liblock_declare_server(k42)(struct core* core) {
 }
 
-liblock_declare(k42);
+liblock_declare(k42,
+		._execute_timed = do_liblock_execute_timed(k42));
 
@@ -83,5 +83,12 @@ static void k42_unlock(k42lock *l)
 
 }
 
+static int k42_trylock(k42lock *l)
+{
+	if (!cmpxchg_util(&l->tail, NULL, &l->next)) return 0;
+
+	return EBUSY;
+}
+
 #endif /* K42_H_ */
 
@@ -21,21 +21,21 @@
 #include <numaif.h>
 #include "liblock.h"
 #include "liblock-fatal.h"
+#include "clock.h"
+#include "park.h"
 
 #define MAX_NUMBER_OF_CORES   1024
+#define MAX_NUMBER_OF_NODES   256
 #define MAX_NUMBER_OF_THREADS 256*1024
+#define DEF_NUMBER_OF_THREADS 4096              /* default number of simultaneous thread ids, see LIBLOCK_MAX_THREADS */
 
-#define GET_NODES_CMD																										\
-	"NODES=/sys/devices/system/node;"																			\
-	"CPUS=/sys/devices/system/cpu;"																				\
-	"if [ -d $NODES ]; then"																							\
-  "  for F in `ls -d $NODES/node*`; do if [ $(cat $F/cpulist | grep '-') ]; then seq -s ' ' $(cat $F/cpulist | tr -s '-' ' '); else cat $F/cpulist | tr -s ',' ' '; fi; done;" \
-	"else"																																\
-	"  find $CPUS -maxdepth 1 -name \"cpu[0-9]*\" -exec basename {} \\; | sed -e 's/cpu\\(.*\\)/\\1/g' | tr -s '\n' ' ';" \
-	"fi"
+#define HUGE_PAGE_SIZE        (2*1024*1024)
 
-#define GET_FREQUENCIES_CMD																							\
-	"cat /proc/cpuinfo | grep \"cpu MHz\" | sed -e 's/cpu MHz\\t\\t://'"
+#define SLAB_CHUNK_SIZE       (256*1024)        /* chunks are aligned on their size */
+#define SLAB_MAX_LINES        8                 /* larger implementations get a chunk of their own */
+
+#define SYS_CPU               "/sys/devices/system/cpu"
+#define SYS_NODE              "/sys/devices/system/node"
 
 struct liblock_info {
 	struct liblock_info* next;
@@ -50,11 +50,30 @@ struct start_routine {
 	const char*  server_type;
 };
 
+/*
+ * per-node slabs of lock implementations: a chunk is bound to a node and cut in objects of a single size class (a
+ * number of cache lines). The first cache line of a chunk gives the slab of its objects.
+ */
+struct slab {
+	int volatile  lock;
+	void*         free;                   /* free objects, linked through their first word */
+	char*         cur;                    /* unused part of the last chunk */
+	char*         end;
+	char          pad[pad_to_cache_line(sizeof(int) + 3*sizeof(void*))];
+};
+
+struct slab_chunk {
+	struct slab*  slab;                   /* 0 for a chunk of its own */
+	size_t        size;
+};
+
 static struct liblock_info*       liblocks = 0;
+static struct slab*               slabs;  /* [node*SLAB_MAX_LINES + lines-1] */
 
 __thread struct thread_descriptor self = { 0, 0, 0, {0,0}, 0, 0};
 
 struct id_manager                 id_manager;
+struct id_list                    liblock_active_ids;
 struct topology                   real_topology;
 struct topology*                  topology = &real_topology;
 static cpu_set_t                  client_cpuset;
@@ -62,6 +81,9 @@ int                               liblock_start_server_threads_by_hand = 0;
 int                               liblock_servers_always_up = 1;
 unsigned int                      do_cycle_count = 1;
 unsigned int      				  lock_thread_num = 0;
+int volatile                      liblock_nb_batch_handlers = 0;
+struct liblock_batch              liblock_batch_handlers[LIBLOCK_BATCH_HASH];
+static pthread_mutex_t            batch_lock = PTHREAD_MUTEX_INITIALIZER;
 
 __attribute__ ((weak)) void liblock_auto_bind() {}
 __attribute__ ((weak)) void liblock_on_server_thread_start(const char* lib, unsigned int thread_id) {}
@@ -81,98 +103,332 @@ void* anon_mmap(size_t n) {
 	return res;
 }
 
+/* 2MB pages from the hugetlb pool if some are reserved, else a transparent huge page hint */
 void* anon_mmap_huge(size_t n) {
-	void* res = mmap(0, n, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE , 0, 0);
+	void* res;
+
+#ifdef MAP_HUGETLB
+	res = mmap(0, r_align(n, HUGE_PAGE_SIZE), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+	if(res != MAP_FAILED)
+		return res;
+#endif
+
+	res = mmap(0, n, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE , -1, 0);
 	if(res == MAP_FAILED)
 		fatal("mmap(huge)(%d): %s", (int)n, strerror(errno));
+
+#ifdef MADV_HUGEPAGE
+	if(n >= HUGE_PAGE_SIZE)
+		madvise(res, n, MADV_HUGEPAGE);
+#endif
+
 	return res;
 }
 
+/* must be called before the first access to area */
 void liblock_bind_mem(void* area, size_t n, struct core_node* node) {
-	unsigned long mask = 1 << node->node_id;
+	unsigned long mask = 1UL << node->numa_id;
 
 	if(topology->nb_nodes > 1)
-		if(mbind(area, n, MPOL_BIND, &mask, 1 + topology->nb_nodes, MPOL_MF_MOVE) < 0)
-			fatal("mbind: %s", strerror(errno));
-}
-
-static void extract_topology(const char* cmd_nodes, const char* cmd_frequencies) {
-	FILE *file;
-	char  text[1024], *p, *saveptr;
-	int   cores_per_nodes[1024];
-	int   i;
-	int   nb_nodes = 0;
-	int   nb_cores = 0;
-	const char* ld = getenv("LD_PRELOAD");
-
-	unsetenv("LD_PRELOAD");
-
-	/* We use UNIX commands to find the nodes. */
-	if(!(file = popen(cmd_nodes, "r")))
-		fatal("popen");
-
-	/* For each node... */
-	while(fgets(text, 1024, file)) {
-		for(i=0, p = strtok_r(text, " ", &saveptr); p; p = strtok_r(0, " ", &saveptr))
-			i++;
-		cores_per_nodes[nb_nodes] = i;
-		nb_nodes++;
-		nb_cores += i;
+		if(mbind(area, n, MPOL_BIND, &mask, 2 + node->numa_id, MPOL_MF_MOVE) < 0)
+			warning("mbind: %s", strerror(errno));
+}
+
+/* n bytes aligned on SLAB_CHUNK_SIZE */
+static struct slab_chunk* slab_map(size_t n, struct core_node* node) {
+	char* area = anon_mmap(n + SLAB_CHUNK_SIZE);
+	char* res = (char*)r_align((uintptr_t)area, SLAB_CHUNK_SIZE);
+
+	if(res > area)
+		munmap(area, res - area);
+	if(res < area + SLAB_CHUNK_SIZE)
+		munmap(res + n, area + SLAB_CHUNK_SIZE - res);
+
+	liblock_bind_mem(res, n, node);
+
+	return (struct slab_chunk*)res;
+}
+
+/* a zeroed and cache aligned implementation of n bytes on the node of core (of the caller if core is null) */
+void* liblock_allocate_impl(size_t n, struct core* core) {
+	struct core_node*  node = core ? core->node : self.running_core ? self.running_core->node : &topology->nodes[0];
+	unsigned int       lines = cache_align(n) / CACHE_LINE_SIZE;
+	struct slab_chunk* chunk;
+	struct slab*       slab;
+	void*              res;
+
+	if(lines > SLAB_MAX_LINES) {
+		chunk = slab_map(r_align(CACHE_LINE_SIZE + n, PAGE_SIZE), node);
+		chunk->slab = 0;
+		chunk->size = r_align(CACHE_LINE_SIZE + n, PAGE_SIZE);
+		return (char*)chunk + CACHE_LINE_SIZE;
 	}
 
-	if (pclose(file) < 0)
-		fatal("pclose");
+	slab = &slabs[node->node_id*SLAB_MAX_LINES + lines - 1];
+
+	while(__sync_lock_test_and_set(&slab->lock, 1))
+		PAUSE();
+
+	if((res = slab->free))
+		slab->free = *(void**)res;
+	else {
+		if(slab->cur + lines*CACHE_LINE_SIZE > slab->end) {
+			chunk = slab_map(SLAB_CHUNK_SIZE, node);
+			chunk->slab = slab;
+			chunk->size = SLAB_CHUNK_SIZE;
+			slab->cur = (char*)chunk + CACHE_LINE_SIZE;
+			slab->end = (char*)chunk + SLAB_CHUNK_SIZE;
+		}
+		res = slab->cur;
+		slab->cur += lines*CACHE_LINE_SIZE;
+	}
+
+	__sync_lock_release(&slab->lock);
+
+	memset(res, 0, lines*CACHE_LINE_SIZE);
+
+	return res;
+}
+
+void liblock_free_impl(void* impl) {
+	struct slab_chunk* chunk = (struct slab_chunk*)((uintptr_t)impl & -SLAB_CHUNK_SIZE);
+	struct slab*       slab = chunk->slab;
+
+	if(!slab) {
+		munmap(chunk, chunk->size);
+		return;
+	}
+
+	while(__sync_lock_test_and_set(&slab->lock, 1))
+		PAUSE();
+	*(void**)impl = slab->free;
+	slab->free = impl;
+	__sync_lock_release(&slab->lock);
+}
+
+static void liblock_init_slabs() {
+	slabs = liblock_allocate(topology->nb_nodes*SLAB_MAX_LINES*sizeof(struct slab));
+	memset(slabs, 0, topology->nb_nodes*SLAB_MAX_LINES*sizeof(struct slab));
+}
+
+/* reads a cpu or node list such as "0-3,8-11" in ids, returns the number of ids or -1 if the file is missing */
+static int read_list(const char* path, int* ids, int max) {
+	FILE* file = fopen(path, "r");
+	char  text[4096], *p = text;
+	int   n = 0, first, last;
+
+	if(!file)
+		return -1;
+
+	if(!fgets(text, sizeof(text), file))
+		text[0] = 0;
+	fclose(file);
+
+	while(*p >= '0' && *p <= '9') {
+		first = last = strtol(p, &p, 10);
+		if(*p == '-')
+			last = strtol(p + 1, &p, 10);
+		for(; first<=last && n<max; first++)
+			ids[n++] = first;
+		if(*p == ',')
+			p++;
+	}
+
+	return n;
+}
+
+/* "cpu MHz" of each processor, the cpufreq value when /proc/cpuinfo does not give it */
+static void extract_frequencies() {
+	FILE* file = fopen("/proc/cpuinfo", "r");
+	char  text[1024], path[256];
+	int   i, cpu = -1;
+	float mhz;
+
+	for(i=0; i<topology->nb_cores; i++)
+		topology->cores[i].frequency = 0;
+
+	if(file) {
+		while(fgets(text, sizeof(text), file)) {
+			if(sscanf(text, "processor : %d", &i) == 1)
+				cpu = i;
+			else if(sscanf(text, "cpu MHz : %f", &mhz) == 1 && cpu >= 0 && cpu < topology->nb_cores)
+				topology->cores[cpu].frequency = mhz;
+		}
+		fclose(file);
+	}
+
+	for(i=0; i<topology->nb_cores; i++) {
+		if(!topology->cores[i].frequency) {
+			snprintf(path, sizeof(path), SYS_CPU "/cpu%d/cpufreq/cpuinfo_max_freq", i);
+			if((file = fopen(path, "r"))) {
+				if(fscanf(file, "%f", &mhz) == 1)
+					topology->cores[i].frequency = mhz / 1000;
+				fclose(file);
+			}
+		}
+	}
+}
+
+/*
+ *  reads the online cpus, the nodes and their distances from sysfs. A core is indexed by its cpu number, the
+ *  offline cpus have a core that belongs to the first node and is never used. Without NUMA support in the kernel,
+ *  the machine is a single node.
+ */
+static void extract_topology() {
+	static int cpus[MAX_NUMBER_OF_CORES], nodes[MAX_NUMBER_OF_NODES], node_cpus[MAX_NUMBER_OF_CORES];
+	char path[256];
+	int  nb_cpus, nb_nodes, nb_cores = 0, i, j, n;
+
+	if((nb_cpus = read_list(SYS_CPU "/online", cpus, MAX_NUMBER_OF_CORES)) <= 0) {
+		nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		for(i=0; i<nb_cpus; i++)
+			cpus[i] = i;
+	}
+
+	for(i=0; i<nb_cpus; i++)
+		if(cpus[i] >= nb_cores)
+			nb_cores = cpus[i] + 1;
+
+	if((nb_nodes = read_list(SYS_NODE "/online", nodes, MAX_NUMBER_OF_NODES)) <= 0) {
+		nb_nodes = 1;
+		nodes[0] = -1;
+	}
 
 	topology->nodes = liblock_allocate(nb_nodes*sizeof(struct core_node));
 	topology->cores = liblock_allocate(nb_cores*sizeof(struct core));
+	topology->distances = liblock_allocate(nb_nodes*nb_nodes*sizeof(int));
 	topology->nb_nodes = nb_nodes;
 	topology->nb_cores = nb_cores;
 
 	for(i=0; i<nb_cores; i++) {
-		CPU_SET(i, &client_cpuset);
 		topology->cores[i].core_id = i;
 		topology->cores[i].server_type = 0;
+		topology->cores[i].online = 0;
+		topology->cores[i].node = &topology->nodes[0];
+	}
+
+	for(i=0; i<nb_cpus; i++) {
+		CPU_SET(cpus[i], &client_cpuset);
+		topology->cores[cpus[i]].online = 1;
 	}
 
-	/* We use UNIX commands to find the nodes. */
-	if(!(file = popen(cmd_nodes, "r")))
-		fatal("popen");
+	for(n=0; n<nb_nodes; n++) {
+		struct core_node* node = &topology->nodes[n];
+		int               nb;
 
-	nb_nodes = 0;
-	/* For each node... */
-	while(fgets(text, 1024, file)) {
-		struct core_node* node = &topology->nodes[nb_nodes];
+		node->node_id = n;
+		node->numa_id = nodes[n] < 0 ? 0 : nodes[n];
 
-		node->nb_cores          = cores_per_nodes[nb_nodes];
-		node->cores             = liblock_allocate(node->nb_cores*sizeof(struct core_node*));
-		node->node_id           = nb_nodes++;
+		if(nodes[n] < 0) {
+			memcpy(node_cpus, cpus, nb_cpus*sizeof(int));
+			nb = nb_cpus;
+		} else {
+			snprintf(path, sizeof(path), SYS_NODE "/node%d/cpulist", nodes[n]);
+			if((nb = read_list(path, node_cpus, MAX_NUMBER_OF_CORES)) < 0)
+				nb = 0;
+		}
 
-		for(i=0, p = strtok_r(text, " ", &saveptr); p; p = strtok_r(0, " ", &saveptr), i++) {
-			struct core* core = &topology->cores[atoi(p)];
-			node->cores[i] = core;
-			core->node = node;
+		node->cores = liblock_allocate((nb ? nb : 1)*sizeof(struct core*));
+		node->nb_cores = 0;
+		for(i=0; i<nb; i++) {
+			if(node_cpus[i] < nb_cores && topology->cores[node_cpus[i]].online) {
+				node->cores[node->nb_cores++] = &topology->cores[node_cpus[i]];
+				topology->cores[node_cpus[i]].node = node;
+			}
 		}
+
+		/* the distances are given for the online nodes, in order */
+		snprintf(path, sizeof(path), SYS_NODE "/node%d/distance", nodes[n]);
+		if(nodes[n] < 0 || read_list(path, &topology->distances[n*nb_nodes], nb_nodes) != nb_nodes)
+			for(j=0; j<nb_nodes; j++)
+				topology->distances[n*nb_nodes + j] = j == n ? 10 : 20;
 	}
 
-	if (pclose(file) < 0)
-		fatal("pclose");
+	extract_frequencies();
 
-	file = popen(cmd_frequencies, "r");
+	//print_topology();
+}
 
-	if (file == NULL)
-		fatal("popen");
+/* first cpu of a cpu list such as "0-3,8-11", -1 if the file is missing */
+static int read_first_cpu(const char* path) {
+	FILE* file = fopen(path, "r");
+	int   res;
 
-	nb_cores = 0;
-	while (fgets(text, 1024, file) != NULL)
-		topology->cores[nb_cores++].frequency = atof(text);
+	if(!file)
+		return -1;
 
-	if (pclose(file) < 0)
-		fatal("pclose");
+	if(fscanf(file, "%d", &res) != 1)
+		res = -1;
 
-	if(ld)
-		setenv("LD_PRELOAD", ld, 1);
+	fclose(file);
 
-	//print_topology();
+	return res;
+}
+
+/* sysfs path of the cpu list of the last level cache of cpu, 0 if the caches are not described */
+static const char* llc_cpu_list(int cpu, char* buf, size_t n) {
+	int   index, level, best = 0;
+	FILE* file;
+
+	for(index=0; ; index++) {
+		snprintf(buf, n, "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+		if(!(file = fopen(buf, "r")))
+			break;
+		if(fscanf(file, "%d", &level) == 1 && level >= best)
+			best = level;
+		fclose(file);
+	}
+
+	for(index--; index>=0; index--) {
+		snprintf(buf, n, "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+		if((file = fopen(buf, "r"))) {
+			int found = fscanf(file, "%d", &level) == 1 && level == best;
+			fclose(file);
+			if(found) {
+				snprintf(buf, n, "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+				return buf;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *  groups the cores by level: a cluster is named by the first cpu of its sysfs cpu list, then the names are
+ *  replaced by dense ids. Without sysfs, a core is alone in its SMT cluster and its LLC is its node.
+ */
+static void extract_levels() {
+	int  ids[LIBLOCK_NB_LEVELS][MAX_NUMBER_OF_CORES];
+	char path[256];
+	int  i, l, first;
+
+	memset(ids, -1, sizeof(ids));
+
+	for(i=0; i<topology->nb_cores; i++) {
+		struct core* core = &topology->cores[i];
+		const char*  llc;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", core->core_id);
+		first = read_first_cpu(path);
+		core->clusters[LIBLOCK_LEVEL_SMT] = first < 0 ? core->core_id : first;
+
+		llc = llc_cpu_list(core->core_id, path, sizeof(path));
+		first = llc ? read_first_cpu(llc) : -1;
+		core->clusters[LIBLOCK_LEVEL_LLC] = first < 0 ? MAX_NUMBER_OF_CORES - 1 - core->node->node_id : first;
+
+		core->clusters[LIBLOCK_LEVEL_NODE] = core->node->node_id;
+	}
+
+	for(l=0; l<LIBLOCK_NB_LEVELS; l++) {
+		topology->nb_clusters[l] = 0;
+		for(i=0; i<topology->nb_cores; i++) {
+			int* id = &ids[l][topology->cores[i].clusters[l]];
+			if(*id == -1)
+				*id = topology->nb_clusters[l]++;
+			topology->cores[i].clusters[l] = *id;
+		}
+	}
 }
 
 void print_topology() {
@@ -180,7 +436,8 @@ void print_topology() {
 
 	printf("-------------- Frequencies --------------\n");
 	for(i=0; i<topology->nb_cores; i++) {
-		printf("  * Core %d: %f MHz\n", topology->cores[i].core_id, topology->cores[i].frequency);
+		printf("  * Core %d: %f MHz%s\n", topology->cores[i].core_id, topology->cores[i].frequency,
+					 topology->cores[i].online ? "" : " (offline)");
 	}
 
 	printf("------------------ Nodes ----------------\n");
@@ -190,6 +447,20 @@ void print_topology() {
 			printf(" %d", topology->nodes[i].cores[j]->core_id);
 		printf("\n");
 	}
+
+	printf("--------------- Distances ---------------\n");
+	for(i=0; i<topology->nb_nodes; i++) {
+		printf("  * Node %d:", topology->nodes[i].node_id);
+		for(j=0; j<topology->nb_nodes; j++)
+			printf(" %d", liblock_node_distance(&topology->nodes[i], &topology->nodes[j]));
+		printf("\n");
+	}
+
+	printf("----------------- Levels ----------------\n");
+	for(i=0; i<topology->nb_cores; i++)
+		printf("  * Core %d: smt %d, llc %d, node %d\n", topology->cores[i].core_id,
+					 topology->cores[i].clusters[LIBLOCK_LEVEL_SMT], topology->cores[i].clusters[LIBLOCK_LEVEL_LLC],
+					 topology->cores[i].clusters[LIBLOCK_LEVEL_NODE]);
 }
 
 void  liblock_define_core(struct core* core) {
@@ -267,7 +538,7 @@ unsigned int liblock_find_id(struct id_manager* id_manager) {
 			return cur;
 	}
 
-	fatal("exhausted client ids...");
+	fatal("exhausted client ids (%u), raise LIBLOCK_MAX_THREADS", id_manager->last);
 	return 0;
 }
 
@@ -291,19 +562,120 @@ void liblock_release_id(struct id_manager* id_manager, unsigned int id) {
 }
 
 void liblock_init_id_manager(struct id_manager* id_manager) {
+	const char*  env = getenv("LIBLOCK_MAX_THREADS");
+	unsigned int last = env ? atoi(env) : DEF_NUMBER_OF_THREADS;
+
+	if(last < 1 || last > MAX_NUMBER_OF_THREADS)
+		fatal("LIBLOCK_MAX_THREADS should be between 1 and %d", MAX_NUMBER_OF_THREADS);
+
 	id_manager->first      = 0;
 	id_manager->first_free = 0;
 	id_manager->fragmented = 0;
-	id_manager->last       = MAX_NUMBER_OF_THREADS;
+	id_manager->last       = last;
 	id_manager->lock_num   = 0;
 	id_manager->fragmented_num = 0;
-	id_manager->bitmap     = anon_mmap(MAX_NUMBER_OF_THREADS + sizeof(unsigned char));
+	id_manager->bitmap     = anon_mmap(last + sizeof(unsigned char));
+}
+
+static void liblock_init_id_list(struct id_list* list) {
+	list->nb    = 0;
+	list->ids   = anon_mmap(id_manager.last*sizeof(unsigned int));
+	list->index = anon_mmap(id_manager.last*sizeof(unsigned int));
+
+	pthread_mutex_init(&list->lock, 0);
+}
+
+/* a server that reads the list during an update may see a stale id or miss a moved one for a single pass */
+static void liblock_id_list_add(struct id_list* list, unsigned int id) {
+	pthread_mutex_lock(&list->lock);
+	if(!list->index[id]) {
+		list->ids[list->nb] = id;
+		list->index[id] = list->nb + 1;
+		asm volatile("" ::: "memory");
+		list->nb++;
+	}
+	pthread_mutex_unlock(&list->lock);
+}
+
+static void liblock_id_list_remove(struct id_list* list, unsigned int id) {
+	unsigned int pos, last;
+
+	pthread_mutex_lock(&list->lock);
+	if((pos = list->index[id])) {
+		last = list->ids[list->nb - 1];
+		list->ids[pos - 1] = last;
+		list->index[last] = pos;
+		list->index[id] = 0;
+		asm volatile("" ::: "memory");
+		list->nb--;
+	}
+	pthread_mutex_unlock(&list->lock);
 }
 
 void* liblock_exec(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	if(liblock_placement_profiling)
+		return liblock_placement_exec(lock, pending, val);
 	return lock->lib->_execute_operation(lock, pending, val);
 }
 
+void* liblock_exec_inline(liblock_lock_t* lock, void* (*pending)(void*), void* ctx, size_t size) {
+	if(liblock_placement_profiling || !lock->lib->_execute_inline)
+		return liblock_exec(lock, pending, ctx);
+	return lock->lib->_execute_inline(lock, pending, ctx, size);
+}
+
+int liblock_exec_async(liblock_lock_t* lock, void* (*pending)(void*), void* val, liblock_future_t* future) {
+	future->lib = lock->lib;
+
+	if(lock->lib->_execute_async)
+		return lock->lib->_execute_async(lock, pending, val, future);
+
+	/* the library does not pipeline requests, execute it now */
+	future->slot = 0;
+	future->res  = lock->lib->_execute_operation(lock, pending, val);
+
+	return 0;
+}
+
+void* liblock_wait(liblock_future_t* future) {
+	if(future->slot)
+		return future->lib->_wait(future);
+	return future->res;
+}
+
+void liblock_post(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	if(lock->lib->_execute_async)
+		lock->lib->_execute_async(lock, pending, val, 0);
+	else
+		lock->lib->_execute_operation(lock, pending, val);
+}
+
+/* the library cannot withdraw a request, the critical section is executed whatever the deadline */
+static int execute_timed(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	if(lock->lib->_execute_timed)
+		return lock->lib->_execute_timed(lock, pending, val, res, deadline);
+
+	*res = lock->lib->_execute_operation(lock, pending, val);
+
+	return 0;
+}
+
+int liblock_try_exec(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res) {
+	return execute_timed(lock, pending, val, res, 0) ? EBUSY : 0;
+}
+
+int liblock_timed_exec(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res,
+											 const struct timespec* deadline) {
+	struct timespec now;
+	int64_t         left;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	left = (int64_t)(deadline->tv_sec - now.tv_sec)*1000000000LL + deadline->tv_nsec - now.tv_nsec;
+
+	/* a deadline in the past still gives one attempt */
+	return execute_timed(lock, pending, val, res, left > 0 ? liblock_clock_ns() + left : 0) ? ETIMEDOUT : 0;
+}
+
 static void cleanup_thread(void* arg) {
 	struct liblock_info* cur;
 
@@ -311,6 +683,9 @@ static void cleanup_thread(void* arg) {
 	for(cur=liblocks; cur!=0; cur=cur->next)
 		cur->liblock->on_thread_exit(&self);
 
+	liblock_park_release_stacks();
+
+	liblock_id_list_remove(&liblock_active_ids, self.id);
 	liblock_release_id(&id_manager, self.id);
 }
 
@@ -320,6 +695,7 @@ static void* my_start_routine(void* arg) {
 	void* res;
 
 	self.id = liblock_find_id(&id_manager);
+	liblock_id_list_add(&liblock_active_ids, self.id);
 	liblock_define_core(r->core);
 
 
@@ -483,9 +859,44 @@ int liblock_lock_init(const char* type, struct core* core, liblock_lock_t* lock,
 }
 
 int liblock_lock_destroy(liblock_lock_t* lock) {
+	int res;
+
 	if (id_manager.lock_num > 1)
 		id_manager.lock_num--;
-	return lock->lib->_destroy_lock(lock);
+
+	res = lock->lib->_destroy_lock(lock);
+	liblock_free_impl(lock->impl);
+	lock->impl = 0;
+
+	return res;
+}
+
+void liblock_register_batch(void* (*pending)(void*), void (*handler)(void** vals, int nb)) {
+	unsigned int i, h = ((uintptr_t)pending >> 4) % LIBLOCK_BATCH_HASH;
+
+	pthread_mutex_lock(&batch_lock);
+
+	for(i=0; i<LIBLOCK_BATCH_HASH; i++) {
+		struct liblock_batch* batch = &liblock_batch_handlers[(h + i) % LIBLOCK_BATCH_HASH];
+
+		if(!batch->pending || batch->pending == pending) {
+			/* registering pending again only replaces its handler */
+			if(!batch->pending)
+				liblock_nb_batch_handlers++;
+			batch->handler = handler;
+			batch->pending = pending;    /* published after the handler */
+			pthread_mutex_unlock(&batch_lock);
+			return;
+		}
+	}
+
+	fatal("too many batch handlers (%d)", LIBLOCK_BATCH_HASH);
+}
+
+int liblock_migrate(liblock_lock_t* lock, struct core* core) {
+	if(!lock->lib->_migrate)
+		return -1;
+	return lock->lib->_migrate(lock, core);
 }
 
 int liblock_cond_init(liblock_cond_t* cond, const pthread_condattr_t* attr) {
@@ -545,9 +956,14 @@ int liblock_cond_destroy(liblock_cond_t* cond) {
 
 __attribute__ ((constructor (101))) static void liblock_init_library() {
 	CPU_ZERO(&client_cpuset);
-	extract_topology(GET_NODES_CMD, GET_FREQUENCIES_CMD);
+	extract_topology();
+	extract_levels();
+	liblock_clock_init();
+	liblock_init_slabs();
 	liblock_init_id_manager(&id_manager);
+	liblock_init_id_list(&liblock_active_ids);
 	self.id = liblock_find_id(&id_manager);
+	liblock_id_list_add(&liblock_active_ids, self.id);
 }
 
 
@@ -28,16 +28,24 @@ struct timespec;
 /*
  *  topology description
  */
+#define LIBLOCK_LEVEL_SMT    0    /* hardware threads of a physical core */
+#define LIBLOCK_LEVEL_LLC    1    /* cores that share the last level cache */
+#define LIBLOCK_LEVEL_NODE   2    /* cores of a NUMA node */
+#define LIBLOCK_NB_LEVELS    3
+
 struct core {
 	struct core_node* node;
 	int               core_id;
 	float             frequency;
 	const char*       server_type; /* 0 => free, "client" => client, other => a server */
+	int               online;      /* 0 => the cpu is offline, the core must not be used */
+	int               clusters[LIBLOCK_NB_LEVELS]; /* dense id of the cluster of the core at each level */
 };
 
 struct core_node {
 	struct core** cores;
-	int           node_id;
+	int           node_id;     /* index in topology->nodes */
+	int           numa_id;     /* number of the node for the kernel */
 	int           nb_cores;
 };
 
@@ -46,8 +54,12 @@ struct topology {
 	struct core*      cores;   /* indexed by the virtual core id */
 	int               nb_nodes;
 	int               nb_cores;
+	int               nb_clusters[LIBLOCK_NB_LEVELS];
+	int*              distances; /* nb_nodes x nb_nodes, relative distances of the firmware (10 => local) */
 };
 
+#define liblock_node_distance(n1, n2) (topology->distances[(n1)->node_id*topology->nb_nodes + (n2)->node_id])
+
 /*
  *  thread description
  */
@@ -73,11 +85,22 @@ struct id_manager {
 	unsigned char* volatile bitmap; /* be careful, 0 means busy! */
 };
 
+/*
+ *  dense list of the live thread ids, iterated by the servers instead of the [first, first_free[ window
+ */
+struct id_list {
+	unsigned int   volatile nb;        /* number of live ids */
+	unsigned int*  volatile ids;       /* ids[0..nb[ are the live ids, in no particular order */
+	unsigned int*           index;     /* 1 + position of an id in ids, 0 if the id is not live */
+	pthread_mutex_t         lock;      /* serializes the registrations */
+};
+
 /*
  *  exported variables
  */
 struct id_manager                         id_manager;
 extern unsigned int      				  lock_thread_num;
+extern struct id_list                     liblock_active_ids;
 extern struct topology*                   topology;
 extern __thread struct thread_descriptor  self;
 extern int                                liblock_start_server_threads_by_hand; /* default: 0 */
@@ -98,6 +121,8 @@ typedef struct {
  *  internal functions to build a liblock instance
  */
 extern void* liblock_allocate(size_t n);
+extern void* liblock_allocate_impl(size_t n, struct core* core); /* from a slab of the node of core, see liblock_lock_destroy */
+extern void  liblock_free_impl(void* impl);
 extern void* anon_mmap(size_t n);
 extern void* anon_mmap_huge(size_t n);
 extern void  liblock_bind_mem(void* area, size_t n, struct core_node* node);
@@ -113,6 +138,15 @@ typedef struct liblock_cond {
 	} impl;
 } liblock_cond_t;
 
+/*
+ *  asynchronous execution: a future is allocated by the caller and filled by liblock_exec_async
+ */
+typedef struct liblock_future {
+	struct liblock_lib* lib;
+	void*               slot;      /* backend specific, 0 when the result is already in res */
+	void*               res;       /* result of the critical section once resolved */
+} liblock_future_t;
+
 struct liblock_lib {
 	const char* lib_name;
 	void      (*on_thread_start)(struct thread_descriptor*);                        /* private */
@@ -132,6 +166,12 @@ struct liblock_lib {
 	void      (*_unlock_in_cs)(liblock_lock_t* locl);                               /* public */
 	void      (*_relock_in_cs)(liblock_lock_t* lock);                               /* public */
 	int       (*_destroy_lock)(liblock_lock_t* lock);                               /* public */
+	/* optional entry points, filled with designated initializers in liblock_declare, 0 => generic fallback */
+	int       (*_execute_async)(liblock_lock_t* lock, void* (*pending)(void*), void* val, liblock_future_t* future); /* public */
+	void*     (*_wait)(liblock_future_t* future);                                   /* public */
+	int       (*_migrate)(liblock_lock_t* lock, struct core* core);                 /* public */
+	void*     (*_execute_inline)(liblock_lock_t* lock, void* (*pending)(void*), void* ctx, size_t size); /* public */
+	int       (*_execute_timed)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline); /* public */
 };
 
 int                        liblock_getmutex_type(pthread_mutexattr_t* attr);
@@ -157,6 +197,11 @@ extern void                liblock_on_server_thread_end(const char* lib, unsigne
 #define do_liblock_cond_destroy(name)      liblock_ ## name ## _cond_destroy
 #define do_liblock_unlock_in_cs(name)      liblock_ ## name ## _unlock_in_cs
 #define do_liblock_relock_in_cs(name)      liblock_ ## name ## _relock_in_cs
+#define do_liblock_execute_async(name)     liblock_ ## name ## _execute_async
+#define do_liblock_wait(name)              liblock_ ## name ## _wait
+#define do_liblock_migrate(name)           liblock_ ## name ## _migrate
+#define do_liblock_execute_inline(name)    liblock_ ## name ## _execute_inline
+#define do_liblock_execute_timed(name)     liblock_ ## name ## _execute_timed
 
 #define liblock_declare(name, ...)																			\
 	__attribute__ ((constructor (102))) static void name ## _constructor_222() { \
@@ -179,10 +224,58 @@ extern void                liblock_on_server_thread_end(const char* lib, unsigne
 			do_liblock_unlock_in_cs(name),																		\
 			do_liblock_relock_in_cs(name),																		\
 			do_liblock_destroy_lock(name),																		\
+			__VA_ARGS__																												\
 		};																																	\
 		liblock_register(#name, &lll);																			\
 	}
 	
+/*
+ *  batch handlers: a server that finds several pending requests of the same function on the same lock executes
+ *  them with one call to handler(vals, nb), vals[i] is the argument of the i-th request and receives its result
+ */
+#define LIBLOCK_MAX_BATCH   64
+#define LIBLOCK_BATCH_HASH  64
+
+struct liblock_batch {
+	void*      (*volatile pending)(void*);
+	void       (*handler)(void** vals, int nb);
+};
+
+extern int volatile           liblock_nb_batch_handlers;
+extern struct liblock_batch   liblock_batch_handlers[LIBLOCK_BATCH_HASH];
+
+static inline void (*liblock_batch_handler(void* (*pending)(void*)))(void**, int) {
+	unsigned int i, h = ((uintptr_t)pending >> 4) % LIBLOCK_BATCH_HASH;
+
+	for(i=0; i<LIBLOCK_BATCH_HASH; i++) {
+		struct liblock_batch* batch = &liblock_batch_handlers[(h + i) % LIBLOCK_BATCH_HASH];
+		if(batch->pending == pending)
+			return batch->handler;
+		if(!batch->pending)
+			return 0;
+	}
+
+	return 0;
+}
+
+/*
+ *  timed requests (liblock_try_exec, liblock_timed_exec): the pending field of a request that its client may withdraw
+ *  is tagged, a single CAS on the field thus claims the request (server or combiner) or withdraws it (client)
+ */
+#define LIBLOCK_TIMED_TAG   ((uintptr_t)1 << 63)
+
+static inline void* (*liblock_timed_tag(void* (*pending)(void*)))(void*) {
+	return (void* (*)(void*))((uintptr_t)pending | LIBLOCK_TIMED_TAG);
+}
+
+static inline void* (*liblock_timed_untag(void* (*pending)(void*)))(void*) {
+	return (void* (*)(void*))((uintptr_t)pending & ~LIBLOCK_TIMED_TAG);
+}
+
+static inline int liblock_is_timed(void* (*pending)(void*)) {
+	return ((uintptr_t)pending & LIBLOCK_TIMED_TAG) != 0;
+}
+
 #define PAUSE()  asm volatile("pause"::)
 #define MFENCE()  asm volatile("mfence"::)
 
@@ -207,8 +300,38 @@ extern int   liblock_thread_create_and_bind(struct core* core, const char* serve
  */
 extern void* liblock_exec(liblock_lock_t* lock, void* (*pending)(void*), void* val);
 
+/* the size bytes of ctx travel in the request line (size <= LIBLOCK_INLINE_SIZE), pending receives a copy that is
+   written back to ctx once the critical section is over. liblock_exec_ctx chooses at compile time */
+#define LIBLOCK_INLINE_SIZE 32
+extern void* liblock_exec_inline(liblock_lock_t* lock, void* (*pending)(void*), void* ctx, size_t size);
+#define liblock_exec_ctx(lock, pending, ctx)																		\
+	(sizeof(*(ctx)) <= LIBLOCK_INLINE_SIZE ?																				\
+	 liblock_exec_inline(lock, pending, ctx, sizeof(*(ctx))) : liblock_exec(lock, pending, ctx))
+
+/* start a critical section without waiting for it, liblock_wait returns its result. Requests posted
+   asynchronously by a thread are not ordered with respect to each other or to its synchronous requests. The
+   critical section is executed before returning when the library does not pipeline requests or when all the
+   in-flight slots of the thread hold futures not waited for yet */
+extern int   liblock_exec_async(liblock_lock_t* lock, void* (*pending)(void*), void* val, liblock_future_t* future);
+extern void* liblock_wait(liblock_future_t* future);
+/* fire and forget: the result of the critical section is dropped */
+extern void  liblock_post(liblock_lock_t* lock, void* (*pending)(void*), void* val);
+
+/* execute pending only if the lock can be acquired at once (EBUSY otherwise) or before the absolute CLOCK_REALTIME
+   deadline (ETIMEDOUT otherwise), the result is stored in res. A request posted to a server or a combiner is
+   withdrawn if its critical section has not started. cna, shfl, cohort and saml do not queue a timed request: they
+   retry a trylock until the deadline, a timed request may thus starve behind queued ones under contention and
+   does not keep the fairness or the NUMA ordering of the lock */
+extern int   liblock_try_exec(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res);
+extern int   liblock_timed_exec(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res,
+																const struct timespec* deadline);
+
 extern int liblock_lock_init(const char* type, struct core* core, liblock_lock_t* lock, void* arg);
 extern int liblock_lock_destroy(liblock_lock_t* lock);
+/* the critical sections of pending may then be executed in batch by handler, must be called before the first request */
+extern void liblock_register_batch(void* (*pending)(void*), void (*handler)(void** vals, int nb));
+/* move the lock to the server of core without losing requests, -1 if the lock has no server */
+extern int liblock_migrate(liblock_lock_t* lock, struct core* core);
 #define liblock_unlock_in_cs(lock)               (lock)->lib->_unlock_in_cs(lock)
 #define liblock_relock_in_cs(lock)               (lock)->lib->_relock_in_cs(lock)
 
@@ -219,6 +342,21 @@ extern int liblock_cond_wait(liblock_cond_t* cond, liblock_lock_t* lock);
 extern int liblock_cond_timedwait(liblock_cond_t* cond, liblock_lock_t* lock, struct timespec* ts);
 extern int liblock_cond_destroy(liblock_cond_t* cond);
 
+/*
+ *  lock placement: a lock is placed by a stable name, the locks used together are grouped on the same server
+ *  (LIBLOCK_PLACEMENT loads a placement, LIBLOCK_PLACEMENT_OUTPUT profiles the run and saves a placement at exit,
+ *  LIBLOCK_PLACEMENT_PERIOD recomputes and applies the placement every period, in ms)
+ */
+extern int           liblock_placement_profiling;
+/* placed critical section running on the thread, the mini-thread contexts save and restore it when they switch */
+extern __thread struct placement_lock* liblock_placement_cur;
+extern struct core*  liblock_placement_core(const char* name, struct core* def);
+extern void          liblock_placement_register(liblock_lock_t* lock, const char* name);
+extern void*         liblock_placement_exec(liblock_lock_t* lock, void* (*pending)(void*), void* val);
+extern int           liblock_placement_compute(int nb_cores, struct core** cores);
+extern int           liblock_placement_save(const char* path);
+extern void          liblock_placement_apply();   /* migrates the registered locks to their computed core */
+
 extern void  liblock_auto_bind();         /* defines this function to automatically bind a thread */
 
 __END_DECLS
@@ -9,6 +9,7 @@
 /* -------------------------------------------------------------------------- */
 /* ########################################################################## */
 #include <signal.h>
+#include <sched.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
@@ -16,7 +17,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <ucontext.h>
 #include "liblock.h"
+#include "mini_context.h"
 
 #define DEFAULT    "saml"
 
@@ -222,6 +225,152 @@ void two_locks() {
 	liblock_lock_destroy(&lock2);
 }
 
+/*
+ * lock cohorting with two levels on any machine: the cohort lock is created on a synthetic topology of two LLCs of
+ * two SMT pairs, whose cores the threads then claim. The bounds are low so that the lock often leaves a cluster.
+ */
+#define COHORT_NB_CORES 8
+#define COHORT_NBREQS   2000
+#define COHORT_YIELD    8     /* a critical section in COHORT_YIELD yields, the other threads queue meanwhile */
+
+static struct topology  cohort_topology;
+static struct core_node cohort_node;
+static struct core      cohort_cores[COHORT_NB_CORES];
+static struct core*     cohort_node_cores[COHORT_NB_CORES];
+
+void* cohort_critical(void* arg) {
+	critical(arg);
+	if (!(shared % (42 * NBLOOPS * COHORT_YIELD)))
+		sched_yield();
+	return 0;
+}
+
+void* cohort_routine(void* arg) {
+	int i;
+
+	/* the first threads are spread over the SMT pairs and the LLCs */
+	self.running_core = &cohort_cores[(uintptr_t) arg * 3 % COHORT_NB_CORES];
+
+	__sync_sub_and_fetch(&started, 1);
+	while (started)
+		PAUSE();
+
+	for (i = 0; i < COHORT_NBREQS; i++)
+		liblock_exec(&lock, cohort_critical, arg);
+
+	return 0;
+}
+
+void test_cohort_levels() {
+	struct topology* real = topology;
+	pthread_t tid[nb_threads];
+	int i, r = 0;
+
+	printf("====== test cohort levels =====\n");
+
+	cohort_node = real->nodes[0];
+	cohort_node.cores = cohort_node_cores;
+	cohort_node.nb_cores = COHORT_NB_CORES;
+
+	for (i = 0; i < COHORT_NB_CORES; i++) {
+		cohort_cores[i] = real->cores[0];
+		cohort_cores[i].node = &cohort_node;
+		cohort_cores[i].core_id = i;
+		cohort_cores[i].clusters[LIBLOCK_LEVEL_SMT] = i / 2;
+		cohort_cores[i].clusters[LIBLOCK_LEVEL_LLC] = i / 4;
+		cohort_cores[i].clusters[LIBLOCK_LEVEL_NODE] = 0;
+		cohort_node_cores[i] = &cohort_cores[i];
+	}
+
+	cohort_topology = *real;
+	cohort_topology.nodes = &cohort_node;
+	cohort_topology.cores = cohort_cores;
+	cohort_topology.nb_nodes = 1;
+	cohort_topology.nb_cores = COHORT_NB_CORES;
+	cohort_topology.nb_clusters[LIBLOCK_LEVEL_SMT] = COHORT_NB_CORES / 2;
+	cohort_topology.nb_clusters[LIBLOCK_LEVEL_LLC] = COHORT_NB_CORES / 4;
+	cohort_topology.nb_clusters[LIBLOCK_LEVEL_NODE] = 1;
+
+	setenv("LIBLOCK_COHORT_BOUNDS", "2,4,0", 1);
+
+	topology = &cohort_topology;
+	liblock_lock_init("cohort", &cohort_cores[0], &lock, 0);
+	topology = real;
+
+	shared = 0;
+	started = nb_threads;
+
+	for (i = 0; i < nb_threads; i++)
+		liblock_thread_create_and_bind(&real->cores[i % real->nb_cores], 0,
+				&tid[i], 0, cohort_routine, (void*) (uintptr_t) i);
+
+	for (i = 0; i < nb_threads; i++)
+		pthread_join(tid[i], 0);
+
+	liblock_lock_destroy(&lock);
+
+	for (i = 0; i < nb_threads * COHORT_NBREQS * NBLOOPS; i++)
+		r += 42;
+
+	printf("result is: %d, should be: %d\n", shared, r);
+
+	if (r != shared)
+		printf("[WARNING]         invalid result %d, should be %d\n", shared,
+				r);
+}
+
+#define NBSWITCHES 1000000
+
+static struct mini_context ctx_main, ctx_peer;
+static ucontext_t          uctx_main, uctx_peer;
+
+static void ctx_peer_loop() {
+	for (;;)
+		liblock_context_switch(&ctx_peer, &ctx_main);
+}
+
+static void uctx_peer_loop() {
+	for (;;)
+		swapcontext(&uctx_peer, &uctx_main);
+}
+
+static double elapsed_ns(struct timeval* start, struct timeval* end) {
+	return 1e9 * (end->tv_sec - start->tv_sec) + 1e3 * (end->tv_usec - start->tv_usec);
+}
+
+/* cost of a mini-thread switch: liblock_context_switch against swapcontext */
+void test_context_switch() {
+	size_t size = 64 * 1024;
+	struct timeval start, end;
+	int i;
+
+	printf("====== test context switch =====\n");
+
+	liblock_context_make(&ctx_peer, malloc(size), size, ctx_peer_loop);
+
+	gettimeofday(&start, 0);
+	for (i = 0; i < NBSWITCHES; i++)
+		liblock_context_switch(&ctx_main, &ctx_peer);
+	gettimeofday(&end, 0);
+
+	printf("liblock_context_switch: %.1lf ns per switch\n",
+			elapsed_ns(&start, &end) / (2 * NBSWITCHES));
+
+	getcontext(&uctx_peer);
+	uctx_peer.uc_link = 0;
+	uctx_peer.uc_stack.ss_sp = malloc(size);
+	uctx_peer.uc_stack.ss_size = size;
+	makecontext(&uctx_peer, uctx_peer_loop, 0);
+
+	gettimeofday(&start, 0);
+	for (i = 0; i < NBSWITCHES; i++)
+		swapcontext(&uctx_main, &uctx_peer);
+	gettimeofday(&end, 0);
+
+	printf("swapcontext:            %.1lf ns per switch\n",
+			elapsed_ns(&start, &end) / (2 * NBSWITCHES));
+}
+
 int main(int argc, char** argv) {
 	struct sigaction sa;
 	struct timeval start, end;
@@ -229,6 +378,17 @@ int main(int argc, char** argv) {
 
 	nb_threads = _NB_THREADS;
 
+	if (argc > 1 && !strcmp(argv[1], "switch")) {
+		test_context_switch();
+		return 0;
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "cohort-levels")) {
+		nb_threads = argc > 2 ? atoi(argv[2]) : 4;
+		test_cohort_levels();
+		return 0;
+	}
+
 	if (argc > 1) {
 		liblock_name = argv[1];
 
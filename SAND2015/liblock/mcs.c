@@ -15,10 +15,22 @@
 #include <sys/mman.h>
 #include "liblock.h"
 #include "liblock-fatal.h"
+#include "clock.h"
+
+/*
+ * A timed waiter (liblock_timed_exec) that reaches its deadline abandons its node in the queue: it marks the node
+ * MCS_ABANDONED and takes a new one. The holder that finds an abandoned successor passes the lock over it and frees
+ * it, the grant is thus a CAS from MCS_WAIT to MCS_GRANTED.
+ */
+#define MCS_WAIT      0
+#define MCS_GRANTED   1
+#define MCS_ABANDONED 2
+
+#define MCS_NODE_SIZE r_align(sizeof(struct mcs_node), PAGE_SIZE)
 
 struct mcs_node {
 	struct mcs_node* volatile next;
-	int              volatile spin;
+	int              volatile spin;               /* MCS_WAIT, MCS_GRANTED or MCS_ABANDONED */
 	char             __pad[pad_to_cache_line(sizeof(void*) + sizeof(int))];
 };
 
@@ -43,7 +55,7 @@ static void lock_mcs(struct liblock_impl* impl) {
 	struct mcs_node *tail, *me = my_node;
 	
 	me->next = 0;
-	me->spin = 0;
+	me->spin = MCS_WAIT;
 
 	tail = __sync_lock_test_and_set(&impl->tail, me); //xchg(&impl->tail, me);
 	
@@ -66,25 +78,72 @@ static void lock_mcs(struct liblock_impl* impl) {
 	return;
 }
 
+/* a single attempt (deadline 0) enters only an empty queue */
+static int timedlock_mcs(struct liblock_impl* impl, uint64_t deadline) {
+	struct mcs_node *tail, *me = my_node;
+
+	me->next = 0;
+	me->spin = MCS_WAIT;
+
+	if(!deadline)
+		return !impl->tail && !__sync_val_compare_and_swap(&impl->tail, 0, me) ? 0 : EBUSY;
+
+	tail = __sync_lock_test_and_set(&impl->tail, me);
+
+	if(!tail)
+		return 0;
+
+	tail->next = me;
+
+	while(me->spin != MCS_GRANTED) {
+		if(liblock_clock_expired(deadline) && __sync_bool_compare_and_swap(&me->spin, MCS_WAIT, MCS_ABANDONED)) {
+			my_node = anon_mmap(MCS_NODE_SIZE);
+			return EBUSY;
+		}
+		PAUSE();
+	}
+
+	return 0;
+}
+
 static void unlock_mcs(struct liblock_impl* impl) {
-	struct mcs_node* me = my_node;
-	/* No successor yet? */
-	if (!me->next) {
-		/* Try to atomically unlock */
-		if (__sync_val_compare_and_swap(&impl->tail, me, 0) == me) 
-			return;
-	
-		/* Wait for successor to appear */
-		while(!me->next) 
-			PAUSE();
+	struct mcs_node *me = my_node, *next, *abandoned = 0;
+
+	for(;;) {
+		next = me->next;
+
+		/* No successor yet? */
+		if (!next) {
+			/* Try to atomically unlock */
+			if (__sync_val_compare_and_swap(&impl->tail, me, 0) != me) {
+				/* Wait for successor to appear */
+				while(!(next = me->next))
+					PAUSE();
+			}
+		}
+
+		if(me != my_node) {
+			me->next = abandoned;
+			abandoned = me;
+		}
+
+		/* Unlock next one, unless its waiter left */
+		if(!next || __sync_bool_compare_and_swap(&next->spin, MCS_WAIT, MCS_GRANTED))
+			break;
+
+		me = next;
 	}
 
-	/* Unlock next one */
-	me->next->spin = 1;	
+	/* the abandoned nodes are freed once the lock is passed */
+	while(abandoned) {
+		next = abandoned->next;
+		munmap(abandoned, MCS_NODE_SIZE);
+		abandoned = next;
+	}
 }
 
 static struct liblock_impl* do_liblock_init_lock(mcs)(liblock_lock_t* lock, struct core* core, pthread_mutexattr_t* attr) {
-	struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
 
 	impl->tail = 0;
 	pthread_mutex_init(&impl->posix_lock, 0);
@@ -110,6 +169,19 @@ static void* do_liblock_execute_operation(mcs)(liblock_lock_t* lock, void* (*pen
 	return res;
 }
 
+static int do_liblock_execute_timed(mcs)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+
+	if(timedlock_mcs(impl, deadline))
+		return EBUSY;
+
+	*res = pending(val);
+
+	unlock_mcs(impl);
+
+	return 0;
+}
+
 static void do_liblock_init_library(mcs)() {
 }
 
@@ -168,11 +240,11 @@ static int do_liblock_cond_destroy(mcs)(liblock_cond_t* cond) {
 }
 
 static void do_liblock_on_thread_start(mcs)(struct thread_descriptor* desc) {
-	my_node = anon_mmap(r_align(sizeof(struct mcs_node), PAGE_SIZE));
+	my_node = anon_mmap(MCS_NODE_SIZE);
 }
 
 static void do_liblock_on_thread_exit(mcs)(struct thread_descriptor* desc) {
-	munmap(my_node, r_align(sizeof(struct mcs_node), PAGE_SIZE));
+	munmap(my_node, MCS_NODE_SIZE);
 }
 
 static void do_liblock_unlock_in_cs(mcs)(liblock_lock_t* lock) {
@@ -186,5 +258,6 @@ static void do_liblock_relock_in_cs(mcs)(liblock_lock_t* lock) {
 static void do_liblock_declare_server(mcs)(struct core* core) {
 }
 
-liblock_declare(mcs);
+liblock_declare(mcs,
+		._execute_timed = do_liblock_execute_timed(mcs));
 
@@ -8,7 +8,6 @@
 /*       Gilles Muller <gilles.muller@lip6.fr>                                */
 /* -------------------------------------------------------------------------- */
 /* ########################################################################## */
-#include <papi.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -17,6 +16,7 @@
 #include <sys/mman.h>
 #include "liblock.h"
 #include "liblock-fatal.h"
+#include "clock.h"
 
 /* ########################################################################## */
 /* Based on the pseudo-code from :                                            */
@@ -63,7 +63,7 @@ __thread mcstp_qnode *volatile my_qnode = NULL;
 static int trylock_mcstp(struct liblock_impl* impl)
 {
     mcstp_qnode *pred;
-    long long start_time = PAPI_get_real_usec();
+    long long start_time = liblock_clock_us();
 
     /* Try to reclaim position in queue */
     if (my_qnode->status != TIMED_OUT || my_qnode->last_lock != impl ||
@@ -75,7 +75,7 @@ static int trylock_mcstp(struct liblock_impl* impl)
 
        if (!pred)
        { // lock was free
-           impl->cs_start_time = PAPI_get_real_usec();
+           impl->cs_start_time = liblock_clock_us();
            return 1;
        } else pred->next = my_qnode;
     }
@@ -84,12 +84,12 @@ static int trylock_mcstp(struct liblock_impl* impl)
     {
        if (my_qnode->status == AVAILABLE)
        {
-           impl->cs_start_time = PAPI_get_real_usec();
+           impl->cs_start_time = liblock_clock_us();
            return 1;
        }
        else if (my_qnode->status == FAILED)
        {
-           if (PAPI_get_real_usec() - impl->cs_start_time > MAX_CS_TIME)
+           if (liblock_clock_us() - impl->cs_start_time > MAX_CS_TIME)
               pthread_yield();
 
            my_qnode->last_lock = impl;
@@ -98,9 +98,9 @@ static int trylock_mcstp(struct liblock_impl* impl)
 
        while (my_qnode->status == WAITING)
        {
-           my_qnode->time = PAPI_get_real_usec();
+           my_qnode->time = liblock_clock_us();
 
-           if (PAPI_get_real_usec() - start_time <= PATIENCE)
+           if (liblock_clock_us() - start_time <= PATIENCE)
                continue;
            
            if (!__sync_bool_compare_and_swap(&my_qnode->status,
@@ -111,7 +111,7 @@ static int trylock_mcstp(struct liblock_impl* impl)
                break;
            }
 
-           if (PAPI_get_real_usec() - impl->cs_start_time > MAX_CS_TIME)
+           if (liblock_clock_us() - impl->cs_start_time > MAX_CS_TIME)
                pthread_yield();
 
 // !
@@ -121,6 +121,22 @@ static int trylock_mcstp(struct liblock_impl* impl)
     }
 }
 
+/* Enters only an empty queue, with a node that is not left in a queue. */
+static int trylock_empty_mcstp(struct liblock_impl* impl)
+{
+    if (impl->tail)
+        return 0;
+
+    my_qnode->status = WAITING;
+    my_qnode->next = 0;
+
+    if (!__sync_bool_compare_and_swap(&impl->tail, 0, my_qnode))
+        return 0;
+
+    impl->cs_start_time = liblock_clock_us();
+    return 1;
+}
+
 static void lock_mcstp(struct liblock_impl* impl)
 {
     while (!trylock_mcstp(impl))
@@ -156,7 +172,7 @@ static void unlock_mcstp(struct liblock_impl* impl)
         {
             long long succ_time = succ->time;
 
-            if ((PAPI_get_real_usec() - succ_time <= UPDATE_DELAY) &&
+            if ((liblock_clock_us() - succ_time <= UPDATE_DELAY) &&
                 __sync_bool_compare_and_swap(&succ->status, WAITING, AVAILABLE))
             {
                 for ( ; last && last != curr; last = last->next)
@@ -175,7 +191,7 @@ static struct liblock_impl* do_liblock_init_lock(mcstp)
                                  struct core* core,
                                  pthread_mutexattr_t* attr)
 {
-    struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
+    struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
 
     impl->tail = NULL;
     impl->cs_start_time = 0;
@@ -206,12 +222,33 @@ static void* do_liblock_execute_operation(mcstp)(liblock_lock_t* lock,
     return res;
 }
 
-static void do_liblock_init_library(mcstp)()
-{ 
-    if (PAPI_library_init(PAPI_VER_CURRENT) < 0)
-        fatal("PAPI_library_init failed");
+static int do_liblock_execute_timed(mcstp)(liblock_lock_t* lock,
+                                           void* (*pending)(void*),
+                                           void* val,
+                                           void** res,
+                                           uint64_t deadline)
+{
+    struct liblock_impl* impl = lock->impl;
+
+    /* A timed out node may still be in a queue, it is reclaimed by
+       trylock_mcstp, at the cost of at most PATIENCE. */
+    if (deadline || my_qnode->status == TIMED_OUT) {
+        while (!trylock_mcstp(impl))
+            if (liblock_clock_expired(deadline))
+                return EBUSY;
+    } else if (!trylock_empty_mcstp(impl))
+        return EBUSY;
+
+    *res = pending(val);
+
+    unlock_mcstp(impl);
+
+    return 0;
 }
 
+static void do_liblock_init_library(mcstp)()
+{}
+
 static void do_liblock_kill_library(mcstp)()
 {}
 
@@ -288,9 +325,6 @@ static void do_liblock_on_thread_start(mcstp)(struct thread_descriptor* desc)
     my_qnode->time = 0;
     my_qnode->status = INIT;
     my_qnode->next = NULL;
-
-    if (PAPI_thread_init(pthread_self) != PAPI_OK)
-        fatal("PAPI_thread_init failed");
 }
 
 static void do_liblock_on_thread_exit(mcstp)(struct thread_descriptor* desc)
@@ -311,5 +345,6 @@ static void do_liblock_relock_in_cs(mcstp)(liblock_lock_t* lock)
 static void do_liblock_declare_server(mcstp)(struct core* core)
 {}
 
-liblock_declare(mcstp);
+liblock_declare(mcstp,
+                ._execute_timed = do_liblock_execute_timed(mcstp));
 
@@ -0,0 +1,68 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdint.h>
+#include "mini_context.h"
+
+#ifndef __x86_64__
+#error "the mini context switch is only implemented for x86-64"
+#endif
+
+/*
+ * frame saved on the stack of a suspended context, from the stack pointer:
+ *   mxcsr (4 bytes), x87 control word (4 bytes), r15, r14, r13, r12, rbx, rbp, return address
+ */
+#define FRAME_WORDS 8
+
+asm(".text\n"
+		".globl liblock_context_switch\n"
+		".type liblock_context_switch, @function\n"
+		"liblock_context_switch:\n"
+		"\tpushq %rbp\n"
+		"\tpushq %rbx\n"
+		"\tpushq %r12\n"
+		"\tpushq %r13\n"
+		"\tpushq %r14\n"
+		"\tpushq %r15\n"
+		"\tsubq $8, %rsp\n"
+		"\tstmxcsr (%rsp)\n"
+		"\tfnstcw 4(%rsp)\n"
+		"\tmovq %rsp, (%rdi)\n"
+		"\tmovq %rsi, %rdi\n"
+		".globl liblock_context_set\n"
+		".type liblock_context_set, @function\n"
+		"liblock_context_set:\n"
+		"\tmovq (%rdi), %rsp\n"
+		"\tldmxcsr (%rsp)\n"
+		"\tfldcw 4(%rsp)\n"
+		"\taddq $8, %rsp\n"
+		"\tpopq %r15\n"
+		"\tpopq %r14\n"
+		"\tpopq %r13\n"
+		"\tpopq %r12\n"
+		"\tpopq %rbx\n"
+		"\tpopq %rbp\n"
+		"\tret\n"
+		".size liblock_context_switch, .-liblock_context_switch\n");
+
+void liblock_context_make(struct mini_context* ctx, void* stack, size_t size, void (*entry)()) {
+	uint64_t* sp = (uint64_t*)(((uintptr_t)stack + size) & -16);
+	int       i;
+
+	*--sp = 0;                               /* return address of entry, which must not return */
+	*--sp = (uint64_t)(uintptr_t)entry;      /* entry is reached with the alignment of a call */
+
+	for(i=0; i<FRAME_WORDS-2; i++)
+		*--sp = 0;                             /* rbp, rbx, r12 to r15 */
+
+	*--sp = 0x1f80 | ((uint64_t)0x37f << 32); /* default mxcsr and x87 control word */
+
+	ctx->sp = sp;
+}
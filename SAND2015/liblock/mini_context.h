@@ -0,0 +1,37 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#ifndef _MINI_CONTEXT_H_
+#define _MINI_CONTEXT_H_
+
+#include <stddef.h>
+#include <sys/cdefs.h>
+
+/*
+ * User-space context switch for x86-64: only the callee-saved registers, the
+ * stack pointer and the floating point control words are saved, on the stack of
+ * the context. Unlike swapcontext, the signal mask is not saved (no syscall).
+ */
+struct mini_context {
+	void* sp;          /* saved stack pointer */
+};
+
+__BEGIN_DECLS
+
+/* saves the running context in from and resumes to */
+extern void liblock_context_switch(struct mini_context* from, struct mini_context* to);
+/* resumes to, the running context is lost */
+extern void liblock_context_set(struct mini_context* to) __attribute__((noreturn));
+/* prepares ctx to run entry on the stack [stack, stack+size[, entry must not return */
+extern void liblock_context_make(struct mini_context* ctx, void* stack, size_t size, void (*entry)());
+
+__END_DECLS
+
+#endif
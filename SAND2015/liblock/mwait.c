@@ -12,6 +12,7 @@
 #include <errno.h>
 #include "liblock.h"
 #include "liblock-fatal.h"
+#include "clock.h"
 
 struct liblock_impl {
 	pthread_mutex_t       posix_lock;
@@ -20,7 +21,7 @@ struct liblock_impl {
 };
 
 static struct liblock_impl* do_liblock_init_lock(mwait)(liblock_lock_t* lock, struct core* server, pthread_mutexattr_t* attr) {
-	struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), server);
 
 	impl->lock = 0;
 	pthread_mutex_init(&impl->posix_lock, 0);
@@ -71,6 +72,23 @@ static void* do_liblock_execute_operation(mwait)(liblock_lock_t* lock, void* (*p
 	return res;
 }
 
+/* the lock is polled, mwait would not wake up at the deadline */
+static int do_liblock_execute_timed(mwait)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+
+	while(__sync_val_compare_and_swap(&impl->lock, 0, 1)) {
+		if(liblock_clock_expired(deadline))
+			return EBUSY;
+		PAUSE();
+	}
+
+	*res = pending(val);
+
+	release(impl);
+
+	return 0;
+}
+
 static void do_liblock_init_library(mwait)() {
 }
 
@@ -148,4 +166,5 @@ static void do_liblock_relock_in_cs(mwait)(liblock_lock_t* lock) {
 static void do_liblock_declare_server(mwait)(struct core* core) {
 }
 
-liblock_declare(mwait);
+liblock_declare(mwait,
+		._execute_timed = do_liblock_execute_timed(mwait));
@@ -0,0 +1,64 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#ifndef _NUMA_LOCK_H_
+#define _NUMA_LOCK_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "liblock.h"
+
+/*
+ * Common parts of the NUMA-aware queue locks (CNA and ShflLock). These locks keep a lock word of one or two words
+ * and no per-lock mutex: a condition wait takes one of the NUMA_LOCK_COND_STRIPES mutexes, chosen by the address
+ * of the condition, to close the window between the release of the lock and the wait. signal and broadcast take the
+ * same mutex, so they can not run between the release of the lock and the wait.
+ */
+#define NUMA_LOCK_COND_STRIPES 64
+
+static pthread_mutex_t numa_lock_cond_stripes[NUMA_LOCK_COND_STRIPES] = {
+	[0 ... NUMA_LOCK_COND_STRIPES-1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static inline pthread_mutex_t* numa_lock_cond_stripe(liblock_cond_t* cond) {
+	return &numa_lock_cond_stripes[((uintptr_t)cond / CACHE_LINE_SIZE) % NUMA_LOCK_COND_STRIPES];
+}
+
+static inline int numa_lock_cond_wake(liblock_cond_t* cond, int (*wake)(pthread_cond_t*)) {
+	pthread_mutex_t* stripe = numa_lock_cond_stripe(cond);
+	int res;
+
+	pthread_mutex_lock(stripe);
+	res = wake(&cond->impl.posix_cond);
+	pthread_mutex_unlock(stripe);
+
+	return res;
+}
+
+/* node of the calling thread, 0 for a thread that was never bound to a core */
+static inline int numa_lock_node_id() {
+	return self.running_core ? self.running_core->node->node_id : 0;
+}
+
+/* xorshift, used to bound the time a lock stays on the same node */
+static inline unsigned int numa_lock_random() {
+	static __thread unsigned int seed = 0;
+
+	if(!seed)
+		seed = (self.id + 1) * 2654435761u;
+
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	return seed;
+}
+
+#endif
@@ -0,0 +1,395 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "liblock.h"
+#include "park.h"
+
+#define PARK_STACK_SIZE      r_align(1024*1024, PAGE_SIZE)
+#define PARK_CACHED_STACKS   8                  /* stacks kept by a thread for the next critical sections */
+
+struct park_loop {
+	void                 (*loop)(void*);
+	void*                  arg;
+	void*                  stack;                /* of the running loop */
+	struct mini_context    context;
+	struct mini_context    exit;                 /* context of liblock_park_serve */
+};
+
+static __thread struct park_call* park_current = 0;     /* critical section running on the thread */
+static __thread struct park_loop* park_loop = 0;        /* server loop of the thread */
+static __thread void*             park_stacks = 0;      /* linked through the first word above the guard page */
+static __thread unsigned int      park_nb_stacks = 0;
+
+static inline long park_futex(int volatile* addr, int op, int val, const struct timespec* ts) {
+	return syscall(SYS_futex, addr, op, val, ts, 0, FUTEX_BITSET_MATCH_ANY);
+}
+
+static void* park_stack_get() {
+	void* stack = park_stacks;
+
+	if(stack) {
+		park_stacks = *(void**)(stack + PAGE_SIZE);
+		park_nb_stacks--;
+	} else {
+		stack = anon_mmap(PARK_STACK_SIZE);
+		mprotect(stack, PAGE_SIZE, PROT_NONE);
+	}
+
+	return stack;
+}
+
+static void park_stack_put(void* stack) {
+	if(park_nb_stacks == PARK_CACHED_STACKS)
+		munmap(stack, PARK_STACK_SIZE);
+	else {
+		*(void**)(stack + PAGE_SIZE) = park_stacks;
+		park_stacks = stack;
+		park_nb_stacks++;
+	}
+}
+
+void liblock_park_release_stacks() {
+	void* stack;
+
+	while((stack = park_stacks)) {
+		park_stacks = *(void**)(stack + PAGE_SIZE);
+		munmap(stack, PARK_STACK_SIZE);
+	}
+
+	park_nb_stacks = 0;
+}
+
+static void park_entry() {
+	struct park_call* call = park_current;
+
+	call->val = call->pending(call->val);
+	call->state = PARK_DONE;
+
+	liblock_context_set(call->back);
+}
+
+/* runs the critical section until it ends or parks */
+static void park_switch(struct park_call* call) {
+	struct park_call*      prev = park_current;
+	struct placement_lock* placement = liblock_placement_cur;
+	struct mini_context    back;
+
+	call->back = &back;
+	call->state = PARK_RUNNING;
+	park_current = call;
+
+	liblock_context_switch(&back, &call->context);
+
+	park_current = prev;
+	liblock_placement_cur = placement;
+
+	if(call->state == PARK_DONE)
+		park_stack_put(call->stack);
+}
+
+static void park_loop_entry() {
+	struct park_loop* loop = park_loop;
+
+	park_current = 0;
+	liblock_placement_cur = 0;
+	loop->loop(loop->arg);
+
+	liblock_context_set(&loop->exit);
+}
+
+void liblock_park_serve(void (*loop)(void*), void* arg) {
+	struct park_loop l;
+
+	l.loop = loop;
+	l.arg = arg;
+	l.stack = park_stack_get();
+	liblock_context_make(&l.context, l.stack, PARK_STACK_SIZE, park_loop_entry);
+
+	park_loop = &l;
+	liblock_context_switch(&l.exit, &l.context);
+	park_loop = 0;
+
+	park_stack_put(l.stack);
+}
+
+/* the critical section executed in place keeps the stack of the loop, the loop starts again on a new stack */
+static void park_detach(struct park_call* call) {
+	struct park_loop* loop = park_loop;
+
+	call->stack = loop->stack;
+	loop->stack = park_stack_get();
+	liblock_context_make(&loop->context, loop->stack, PARK_STACK_SIZE, park_loop_entry);
+
+	liblock_context_switch(&call->context, &loop->context);
+}
+
+/* called by the critical section, resumes once the owner submitted the call again */
+static void park_suspend(struct park_call* call, int state) {
+	call->state = state;
+	call->placement = liblock_placement_cur;
+
+	if(call->stack)
+		liblock_context_switch(&call->context, call->back);
+	else
+		park_detach(call);
+
+	liblock_placement_cur = call->placement;
+}
+
+/* parked critical section of lock running on the thread, 0 if the critical section of lock runs in place */
+static struct park_call* park_self(liblock_lock_t* lock) {
+	struct park_call* call = park_current;
+
+	return call && call->lock == lock ? call : 0;
+}
+
+void* liblock_park_run(void* arg) {
+	struct park_call* call = arg;
+
+	/* in place in a server loop, the call only gets a stack if it parks */
+	if(park_loop && !park_current) {
+		call->stack = 0;
+		park_current = call;
+
+		call->val = call->pending(call->val);
+
+		/* detached, possibly on another thread */
+		if(call->stack) {
+			call->state = PARK_DONE;
+			liblock_context_set(call->back);
+		}
+
+		park_current = 0;
+
+		return arg;
+	}
+
+	call->stack = park_stack_get();
+	liblock_context_make(&call->context, call->stack, PARK_STACK_SIZE, park_entry);
+	park_switch(call);
+
+	return arg;
+}
+
+static void park_cond_remove(liblock_cond_t* cond, struct park_call* call) {
+	struct park_call *last = cond->impl.data, *prev = last;
+
+	do {
+		if(prev->next == call) {
+			if(prev == call)
+				cond->impl.data = 0;
+			else {
+				prev->next = call->next;
+				if(last == call)
+					cond->impl.data = prev;
+			}
+			return;
+		}
+		prev = prev->next;
+	} while(prev != last);
+}
+
+/* executed under the lock */
+static void* park_resume(void* arg) {
+	struct park_call* call = arg;
+
+	if(call->state == PARK_WAITING && !call->woken) {
+		park_cond_remove(call->cond, call);
+		call->res = ETIMEDOUT;
+	}
+
+	park_switch(call);
+
+	return arg;
+}
+
+/* until the waiter is woken or its deadline is reached */
+static void park_sleep(struct park_call* call) {
+	while(!call->woken)
+		if(park_futex(&call->woken, FUTEX_WAIT_BITSET_PRIVATE | (call->deadline ? FUTEX_CLOCK_REALTIME : 0), 0,
+									call->deadline) && errno == ETIMEDOUT)
+			break;
+}
+
+/* owner side, the call was executed once */
+static void* park_finish(struct park_call* call, void* (*execute)(liblock_lock_t*, void* (*)(void*), void*)) {
+	for(;;) {
+		switch(call->state) {
+			case PARK_DONE:
+				return call->val;
+
+			case PARK_WAITING:
+				park_sleep(call);
+				break;
+
+			case PARK_RELEASED:
+				park_switch(call);
+				continue;
+		}
+
+		execute(call->lock, park_resume, call);
+	}
+}
+
+void* liblock_park_submit(liblock_lock_t* lock, void* (*execute)(liblock_lock_t*, void* (*)(void*), void*),
+												void* (*pending)(void*), void* val) {
+	struct park_call call;
+
+	call.pending = pending;
+	call.val = val;
+	call.state = PARK_DONE;
+	call.lock = lock;
+
+	execute(lock, liblock_park_run, &call);
+
+	return call.state == PARK_DONE ? call.val : park_finish(&call, execute);
+}
+
+int liblock_park_submit_timed(liblock_lock_t* lock, void* (*execute)(liblock_lock_t*, void* (*)(void*), void*),
+															int (*execute_timed)(liblock_lock_t*, void* (*)(void*), void*, void**, uint64_t),
+															void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct park_call call;
+	void*            ignored;
+
+	call.pending = pending;
+	call.val = val;
+	call.state = PARK_DONE;
+	call.lock = lock;
+
+	if(execute_timed(lock, liblock_park_run, &call, &ignored, deadline))
+		return EBUSY;
+
+	*res = call.state == PARK_DONE ? call.val : park_finish(&call, execute);
+
+	return 0;
+}
+
+int liblock_park_cond_init(liblock_cond_t* cond) {
+	cond->impl.data = 0;
+	return 0;
+}
+
+static void park_cond_enqueue(liblock_cond_t* cond, struct park_call* call, const struct timespec* ts) {
+	struct park_call* last = cond->impl.data;
+
+	if(last) {
+		call->next = last->next;
+		last->next = call;
+	} else
+		call->next = call;
+
+	cond->impl.data = call;
+
+	if(ts) {
+		call->ts = *ts;
+		call->deadline = &call->ts;
+	} else
+		call->deadline = 0;
+
+	call->cond = cond;
+	call->woken = 0;
+	call->res = 0;
+}
+
+int liblock_park_cond_timedwait(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) {
+	struct park_call* call = park_self(lock);
+	struct park_call  waiter;
+
+	if(call) {
+		park_cond_enqueue(cond, call, ts);
+		park_suspend(call, PARK_WAITING);
+		return call->res;
+	}
+
+	/* in place, the executor sleeps with the lock released */
+	park_cond_enqueue(cond, &waiter, ts);
+	lock->lib->_unlock_in_cs(lock);
+	park_sleep(&waiter);
+	lock->lib->_relock_in_cs(lock);
+
+	if(!waiter.woken) {
+		park_cond_remove(cond, &waiter);
+		waiter.res = ETIMEDOUT;
+	}
+
+	return waiter.res;
+}
+
+/* the owner of the call can not return before the signaling critical section ends */
+static void park_wake(struct park_call* call) {
+	call->woken = 1;
+	park_futex(&call->woken, FUTEX_WAKE_PRIVATE, 1, 0);
+}
+
+int liblock_park_cond_signal(liblock_cond_t* cond) {
+	struct park_call *last = cond->impl.data, *first;
+
+	if(last) {
+		first = last->next;
+		if(first == last)
+			cond->impl.data = 0;
+		else
+			last->next = first->next;
+		park_wake(first);
+	}
+
+	return 0;
+}
+
+int liblock_park_cond_broadcast(liblock_cond_t* cond) {
+	struct park_call *last = cond->impl.data, *cur, *next;
+
+	if(last) {
+		cond->impl.data = 0;
+		next = last->next;
+		do {
+			cur = next;
+			next = cur->next;
+			park_wake(cur);
+		} while(cur != last);
+	}
+
+	return 0;
+}
+
+int liblock_park_cond_destroy(liblock_cond_t* cond) {
+	return cond->impl.data ? EBUSY : 0;
+}
+
+int liblock_park_unlock_in_cs(liblock_lock_t* lock) {
+	struct park_call* call = park_self(lock);
+
+	if(!call) {
+		/* the next critical sections of the lock are parked */
+		lock->r0 = (void*)1;
+		return 0;
+	}
+
+	park_suspend(call, PARK_RELEASED);
+
+	return 1;
+}
+
+int liblock_park_relock_in_cs(liblock_lock_t* lock) {
+	struct park_call* call = park_self(lock);
+
+	if(!call)
+		return 0;
+
+	park_suspend(call, PARK_RELOCK);
+
+	return 1;
+}
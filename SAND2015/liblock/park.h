@@ -0,0 +1,115 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#ifndef _LIBLOCK_PARK_H_
+#define _LIBLOCK_PARK_H_
+
+#include <time.h>
+#include "liblock.h"
+#include "mini_context.h"
+
+/*
+ * Parking of the critical sections executed by another thread (combining and delegation locks without mini threads).
+ * The owner of a request submits liblock_park_run, which runs the critical section on a stack of its own. When the
+ * critical section waits on a condition or releases its lock, its context is saved in the call and the executor
+ * goes on with the next requests:
+ *   - a condition wait leaves the call in the list of the condition (cond->impl.data, circular, points to the last
+ *     waiter). signal and broadcast take the waiters off the list and wake their owner, they must be called in a
+ *     critical section of the lock: the list is only accessed with the lock held. The owner sleeps until it is woken
+ *     or until the deadline, then submits a request that resumes the critical section under the lock.
+ *   - after unlock_in_cs, the owner runs the critical section itself until relock_in_cs, then submits a request that
+ *     resumes it under the lock.
+ * A parked critical section may thus end on another thread than the one it started on.
+ *
+ * A stack per critical section is only worth it for the locks that wait: liblock_park_exec executes the critical
+ * sections in place, on the stack of the executor, until one of them waits or releases the lock. The lock is then
+ * marked (lock->r0, cleared by init_lock) and its next requests are parked. A critical section executed in place
+ * releases the lock with the unlock_in_cs of its backend, for which liblock_park_unlock_in_cs returns 0, and a
+ * condition wait then sleeps on the executor with the lock released. Until the lock is marked, a critical section
+ * that waits for a later critical section of the thread executing it thus blocks: the first wait should not depend
+ * on the executor.
+ *
+ * A server thread runs its loop with liblock_park_serve, on a stack of the thread, and executes the calls in place.
+ * A critical section that waits or releases the lock keeps that stack and the loop is called again on a new one: it
+ * must go on with the pass it was doing, from a state that it saved before calling the critical section.
+ *
+ * The batch handlers execute the calls in place: liblock_park_pending and liblock_park_val give the function and the
+ * argument slot of a request, a critical section executed in a batch can not be parked.
+ */
+#define PARK_DONE         0
+#define PARK_RUNNING      1
+#define PARK_WAITING      2                     /* in the list of a condition */
+#define PARK_RELEASED     3                     /* unlock_in_cs, the owner runs the critical section */
+#define PARK_RELOCK       4                     /* relock_in_cs, waits for the lock */
+
+struct park_call {
+	void*                (*pending)(void*);
+	void* volatile         val;                 /* argument, then result of the critical section */
+	int volatile           state;
+	int volatile           woken;               /* futex, set by signal or broadcast */
+	int                    res;                 /* result of the condition wait */
+	const struct timespec* deadline;            /* of the condition wait, CLOCK_REALTIME */
+	struct timespec        ts;
+	liblock_lock_t*        lock;
+	liblock_cond_t*        cond;
+	struct park_call*      next;                /* in the list of the condition */
+	struct mini_context    context;
+	struct mini_context*   back;                /* context of the executor */
+	struct placement_lock* placement;           /* liblock_placement_cur of the parked critical section */
+	void*                  stack;
+};
+
+extern void* liblock_park_run(void* arg);
+
+/* execute and execute_timed submit a request to the lock, as _execute_operation and _execute_timed */
+extern void* liblock_park_submit(liblock_lock_t* lock, void* (*execute)(liblock_lock_t*, void* (*)(void*), void*),
+																 void* (*pending)(void*), void* val);
+extern int   liblock_park_submit_timed(liblock_lock_t* lock, void* (*execute)(liblock_lock_t*, void* (*)(void*), void*),
+																			 int (*execute_timed)(liblock_lock_t*, void* (*)(void*), void*, void**, uint64_t),
+																			 void* (*pending)(void*), void* val, void** res, uint64_t deadline);
+
+extern int   liblock_park_cond_init(liblock_cond_t* cond);
+extern int   liblock_park_cond_timedwait(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts);
+extern int   liblock_park_cond_signal(liblock_cond_t* cond);
+extern int   liblock_park_cond_broadcast(liblock_cond_t* cond);
+extern int   liblock_park_cond_destroy(liblock_cond_t* cond);
+/* 0 if the critical section runs in place, the backend then releases or takes back the lock itself */
+extern int   liblock_park_unlock_in_cs(liblock_lock_t* lock);
+extern int   liblock_park_relock_in_cs(liblock_lock_t* lock);
+
+/* runs the server loop loop(arg), see above */
+extern void  liblock_park_serve(void (*loop)(void*), void* arg);
+
+/* frees the stacks kept by the calling thread */
+extern void  liblock_park_release_stacks();
+
+/* parks the critical sections only once the lock needs it */
+static inline void* liblock_park_exec(liblock_lock_t* lock, void* (*execute)(liblock_lock_t*, void* (*)(void*), void*),
+																			void* (*pending)(void*), void* val) {
+	return lock->r0 ? liblock_park_submit(lock, execute, pending, val) : execute(lock, pending, val);
+}
+
+static inline int liblock_park_timed(liblock_lock_t* lock, void* (*execute)(liblock_lock_t*, void* (*)(void*), void*),
+																		 int (*execute_timed)(liblock_lock_t*, void* (*)(void*), void*, void**, uint64_t),
+																		 void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	return lock->r0 ?
+		liblock_park_submit_timed(lock, execute, execute_timed, pending, val, res, deadline) :
+		execute_timed(lock, pending, val, res, deadline);
+}
+
+static inline void* (*liblock_park_pending(void* (*pending)(void*), void* val))(void*) {
+	return pending == liblock_park_run ? ((struct park_call*)val)->pending : pending;
+}
+
+static inline void* volatile* liblock_park_val(void* (*pending)(void*), void* volatile* val) {
+	return pending == liblock_park_run ? &((struct park_call*)*val)->val : val;
+}
+
+#endif
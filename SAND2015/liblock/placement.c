@@ -0,0 +1,451 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "liblock.h"
+#include "liblock-fatal.h"
+#include "clock.h"
+
+/*
+ * Placement of the locks on the server cores.
+ *
+ * A lock is known by a name that is stable from one run to the next. While profiling
+ * (LIBLOCK_PLACEMENT_OUTPUT), liblock_exec measures the time spent in the critical
+ * sections of each named lock and how often two locks are used together (nested
+ * critical sections or consecutive critical sections of the same thread). At exit, the
+ * locks that are used together are grouped and the groups are spread over the server
+ * cores, heaviest first, on the least loaded core. The assignment is written to a file
+ * that the next run loads with LIBLOCK_PLACEMENT.
+ *
+ * With LIBLOCK_PLACEMENT_PERIOD (in ms), the placement is also computed at run time: every
+ * period, a rebalancing thread computes it from the executions of the period, migrates
+ * the locks whose core changed and starts a new measurement window.
+ */
+#define MAX_PLACEMENT_LOCKS  256
+#define PLACEMENT_HASH       1024
+
+#define CO_ACCESS_RATIO      0.05  /* two locks are co-accessed above this fraction of their executions */
+#define SATURATION           0.9   /* do not group independent locks beyond this server load */
+
+struct placement_lock {
+	char*                        name;
+	liblock_lock_t*              lock;           /* 0 until liblock_placement_register */
+	int                          core_id;        /* current core */
+	int                          assigned;       /* core computed by liblock_placement_compute */
+	unsigned long long volatile  nb_exec;        /* updated inside the critical section */
+	unsigned long long volatile  cycles;         /* updated inside the critical section */
+	int                          group;          /* union-find parent */
+	double                       load;           /* fraction of the elapsed time spent in the critical sections */
+};
+
+struct placement_group {
+	int                          root;
+	double                       load;
+};
+
+struct placement_call {
+	void*                (*pending)(void*);
+	void*                  val;
+	struct placement_lock* pl;
+};
+
+struct saved_placement {
+	char* name;
+	int   core_id;
+};
+
+int                              liblock_placement_profiling = 0;
+
+static struct placement_lock     placement_locks[MAX_PLACEMENT_LOCKS];
+static int volatile              nb_placement_locks = 0;
+static struct placement_lock*    placement_hash[PLACEMENT_HASH];
+static unsigned int volatile     nested[MAX_PLACEMENT_LOCKS][MAX_PLACEMENT_LOCKS];      /* [outer][inner] */
+static unsigned int volatile     consecutive[MAX_PLACEMENT_LOCKS][MAX_PLACEMENT_LOCKS]; /* [previous][next] */
+static pthread_mutex_t           placement_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int                       placement_full = 0;     /* MAX_PLACEMENT_LOCKS reached, reported once */
+static unsigned long long        profiling_start;
+
+static struct saved_placement*   saved = 0;
+static int                       nb_saved = 0;
+
+static struct timespec           rebalance_period = { 0, 0 };
+static pthread_once_t            rebalance_once = PTHREAD_ONCE_INIT;
+
+static void start_rebalance();
+
+__thread struct placement_lock*  liblock_placement_cur = 0;   /* lock of the critical section executed by this thread */
+static __thread struct placement_lock* last_lock = 0;  /* lock of the last critical section requested by this thread */
+
+static inline unsigned int hash_lock(liblock_lock_t* lock) {
+	return ((uintptr_t)lock >> 4) % PLACEMENT_HASH;
+}
+
+static struct placement_lock* lookup_name(const char* name) {
+	int i;
+
+	for(i=0; i<nb_placement_locks; i++)
+		if(!strcmp(placement_locks[i].name, name))
+			return &placement_locks[i];
+
+	return 0;
+}
+
+static struct placement_lock* lookup_lock(liblock_lock_t* lock) {
+	unsigned int h = hash_lock(lock), i;
+
+	for(i=0; i<PLACEMENT_HASH; i++) {
+		struct placement_lock* pl = placement_hash[(h + i) % PLACEMENT_HASH];
+		if(!pl || pl->lock == lock)
+			return pl;
+	}
+
+	return 0;
+}
+
+struct core* liblock_placement_core(const char* name, struct core* def) {
+	struct placement_lock* pl;
+	struct core*           res = def;
+	int                    i;
+
+	for(i=0; i<nb_saved; i++)
+		if(!strcmp(saved[i].name, name) && saved[i].core_id < topology->nb_cores)
+			res = &topology->cores[saved[i].core_id];
+
+	pthread_mutex_lock(&placement_mutex);
+
+	if(!(pl = lookup_name(name))) {
+		/* past the table, a new lock is neither profiled nor migrated */
+		if(nb_placement_locks == MAX_PLACEMENT_LOCKS) {
+			if(!placement_full) {
+				placement_full = 1;
+				warning("too many placed locks (%d), '%s' and the next ones are not placed", MAX_PLACEMENT_LOCKS, name);
+			}
+			pthread_mutex_unlock(&placement_mutex);
+			return res;
+		}
+
+		pl = &placement_locks[nb_placement_locks];
+		pl->name = strdup(name);
+		pl->lock = 0;
+		pl->nb_exec = 0;
+		pl->cycles = 0;
+		nb_placement_locks++;
+	}
+
+	pl->core_id = res->core_id;
+	pl->assigned = res->core_id;
+
+	pthread_mutex_unlock(&placement_mutex);
+
+	return res;
+}
+
+void liblock_placement_register(liblock_lock_t* lock, const char* name) {
+	struct placement_lock* pl;
+	unsigned int           h = hash_lock(lock), i;
+
+	pthread_mutex_lock(&placement_mutex);
+
+	if(!(pl = lookup_name(name))) {
+		if(nb_placement_locks < MAX_PLACEMENT_LOCKS)
+			fatal("lock '%s' has no placement, use liblock_placement_core first", name);
+		pthread_mutex_unlock(&placement_mutex);
+		return;
+	}
+
+	pl->lock = lock;
+
+	for(i=0; i<PLACEMENT_HASH; i++)
+		if(!placement_hash[(h + i) % PLACEMENT_HASH] || placement_hash[(h + i) % PLACEMENT_HASH]->lock == lock) {
+			placement_hash[(h + i) % PLACEMENT_HASH] = pl;
+			break;
+		}
+
+	pthread_mutex_unlock(&placement_mutex);
+
+	if(rebalance_period.tv_sec || rebalance_period.tv_nsec)
+		pthread_once(&rebalance_once, start_rebalance);
+}
+
+static void* placement_trampoline(void* arg) {
+	struct placement_call*  call = arg;
+	struct placement_lock*  outer = liblock_placement_cur;
+	unsigned long long      start = liblock_clock_cycles();
+	void*                   res;
+
+	liblock_placement_cur = call->pl;
+	res = call->pending(call->val);
+	liblock_placement_cur = outer;
+
+	/* we own the lock, no need for atomic operations */
+	call->pl->cycles += liblock_clock_cycles_end() - start;
+	call->pl->nb_exec++;
+
+	return res;
+}
+
+void* liblock_placement_exec(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	struct placement_lock* pl = lookup_lock(lock);
+	struct placement_call  call;
+
+	if(!pl)
+		return lock->lib->_execute_operation(lock, pending, val);
+
+	if(liblock_placement_cur && liblock_placement_cur != pl)
+		__sync_fetch_and_add(&nested[liblock_placement_cur - placement_locks][pl - placement_locks], 1);
+	else if(last_lock && last_lock != pl)
+		__sync_fetch_and_add(&consecutive[last_lock - placement_locks][pl - placement_locks], 1);
+
+	last_lock = pl;
+
+	call.pending = pending;
+	call.val = val;
+	call.pl = pl;
+
+	return lock->lib->_execute_operation(lock, placement_trampoline, &call);
+}
+
+static int find_group(int i) {
+	while(placement_locks[i].group != i)
+		i = placement_locks[i].group = placement_locks[placement_locks[i].group].group;
+	return i;
+}
+
+static int cmp_load(const void* a, const void* b) {
+	double la = ((const struct placement_group*)a)->load, lb = ((const struct placement_group*)b)->load;
+	return la < lb ? 1 : la > lb ? -1 : 0;
+}
+
+int liblock_placement_compute(int nb_cores, struct core** cores) {
+	unsigned long long     elapsed = liblock_clock_cycles() - profiling_start;
+	struct placement_group groups[MAX_PLACEMENT_LOCKS];
+	double                 core_load[nb_cores];
+	int                    i, j, n = nb_placement_locks, nb_groups = 0;
+
+	if(!n || nb_cores < 1)
+		return -1;
+
+	if(!elapsed)
+		elapsed = 1;
+
+	for(i=0; i<n; i++) {
+		placement_locks[i].group = i;
+		placement_locks[i].load = (double)placement_locks[i].cycles / (double)elapsed;
+	}
+
+	/* group the co-accessed locks: nested ones always end up together, consecutive ones while the server is not saturated */
+	for(i=0; i<n; i++)
+		for(j=i+1; j<n; j++) {
+			unsigned long long m = placement_locks[i].nb_exec < placement_locks[j].nb_exec ?
+				placement_locks[i].nb_exec : placement_locks[j].nb_exec;
+			double             threshold = CO_ACCESS_RATIO * m;
+			unsigned int       n_nested = nested[i][j] + nested[j][i];
+			unsigned int       n_consecutive = consecutive[i][j] + consecutive[j][i];
+			int                gi = find_group(i), gj = find_group(j);
+
+			if(gi == gj)
+				continue;
+
+			if(!(n_nested && n_nested >= threshold) &&
+				 !(n_consecutive && n_consecutive >= threshold && placement_locks[gi].load + placement_locks[gj].load <= SATURATION))
+				continue;
+
+			placement_locks[gj].group = gi;
+			placement_locks[gi].load += placement_locks[gj].load;
+		}
+
+	for(i=0; i<n; i++)
+		if(find_group(i) == i) {
+			groups[nb_groups].root = i;
+			groups[nb_groups].load = placement_locks[i].load;
+			nb_groups++;
+		}
+
+	/* longest processing time first: heaviest group on the least loaded core */
+	qsort(groups, nb_groups, sizeof(struct placement_group), cmp_load);
+
+	for(i=0; i<nb_cores; i++)
+		core_load[i] = 0;
+
+	for(i=0; i<nb_groups; i++) {
+		int best = 0;
+
+		for(j=1; j<nb_cores; j++)
+			if(core_load[j] < core_load[best])
+				best = j;
+
+		core_load[best] += groups[i].load;
+
+		for(j=0; j<n; j++)
+			if(find_group(j) == groups[i].root)
+				placement_locks[j].assigned = cores[best]->core_id;
+	}
+
+	return 0;
+}
+
+int liblock_placement_save(const char* path) {
+	unsigned long long elapsed = liblock_clock_cycles() - profiling_start;
+	FILE*              f = fopen(path, "w");
+	int                i;
+
+	if(!f) {
+		warning("unable to write the lock placement in %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	fprintf(f, "# <lock name> <core> (<load> <executions>)\n");
+	for(i=0; i<nb_placement_locks; i++)
+		fprintf(f, "%s %d %.4f %llu\n", placement_locks[i].name, placement_locks[i].assigned,
+						(double)placement_locks[i].cycles / (double)(elapsed ? elapsed : 1), placement_locks[i].nb_exec);
+
+	fclose(f);
+
+	return 0;
+}
+
+void liblock_placement_apply() {
+	int i;
+
+	for(i=0; i<nb_placement_locks; i++) {
+		struct placement_lock* pl = &placement_locks[i];
+
+		if(pl->lock && pl->assigned != pl->core_id && !liblock_migrate(pl->lock, &topology->cores[pl->assigned]))
+			pl->core_id = pl->assigned;
+	}
+}
+
+/* the candidate cores are LIBLOCK_PLACEMENT_SERVERS or, by default, the cores used by the placed locks */
+static int candidate_cores(struct core** cores) {
+	const char*  servers = getenv("LIBLOCK_PLACEMENT_SERVERS");
+	int          nb_cores = 0, i, j;
+
+	if(servers) {
+		char* list = strdup(servers), *saveptr, *p;
+
+		for(p=strtok_r(list, ",", &saveptr); p; p=strtok_r(0, ",", &saveptr))
+			if(atoi(p) >= 0 && atoi(p) < topology->nb_cores)
+				cores[nb_cores++] = &topology->cores[atoi(p)];
+		free(list);
+	} else {
+		for(i=0; i<nb_placement_locks; i++) {
+			for(j=0; j<nb_cores && cores[j]->core_id != placement_locks[i].core_id; j++);
+			if(j == nb_cores)
+				cores[nb_cores++] = &topology->cores[placement_locks[i].core_id];
+		}
+	}
+
+	return nb_cores;
+}
+
+/* the counters are updated without synchronization, an execution that straddles the reset is counted in either window */
+static void new_window() {
+	int i;
+
+	for(i=0; i<nb_placement_locks; i++) {
+		placement_locks[i].nb_exec = 0;
+		placement_locks[i].cycles = 0;
+	}
+
+	memset((void*)nested, 0, sizeof(nested));
+	memset((void*)consecutive, 0, sizeof(consecutive));
+
+	profiling_start = liblock_clock_cycles();
+}
+
+/* liblock_migrate requests the retirement of the old implementation, this thread is a liblock client */
+static void* rebalance(void* arg) {
+	struct core* cores[topology->nb_cores];
+
+	for(;;) {
+		nanosleep(&rebalance_period, 0);
+
+		pthread_mutex_lock(&placement_mutex);
+
+		if(!liblock_placement_compute(candidate_cores(cores), cores))
+			liblock_placement_apply();
+
+		new_window();
+
+		pthread_mutex_unlock(&placement_mutex);
+	}
+
+	return 0;
+}
+
+static void start_rebalance() {
+	pthread_t      thread;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	liblock_thread_create(&thread, &attr, rebalance, 0);
+
+	pthread_attr_destroy(&attr);
+}
+
+static void load_placement(const char* path) {
+	FILE* f = fopen(path, "r");
+	char  line[1024], name[1024];
+	int   core_id;
+
+	if(!f) {
+		warning("unable to read the lock placement from %s: %s", path, strerror(errno));
+		return;
+	}
+
+	while(fgets(line, sizeof(line), f)) {
+		if(line[0] == '#' || sscanf(line, "%1023s %d", name, &core_id) != 2)
+			continue;
+		saved = realloc(saved, (nb_saved + 1)*sizeof(struct saved_placement));
+		saved[nb_saved].name = strdup(name);
+		saved[nb_saved].core_id = core_id;
+		nb_saved++;
+	}
+
+	fclose(f);
+}
+
+static void save_at_exit() {
+	struct core* cores[topology->nb_cores];
+
+	pthread_mutex_lock(&placement_mutex);
+	liblock_placement_compute(candidate_cores(cores), cores);
+	liblock_placement_save(getenv("LIBLOCK_PLACEMENT_OUTPUT"));
+	pthread_mutex_unlock(&placement_mutex);
+}
+
+__attribute__ ((constructor (102))) static void liblock_init_placement() {
+	const char* in = getenv("LIBLOCK_PLACEMENT");
+	const char* period = getenv("LIBLOCK_PLACEMENT_PERIOD");
+
+	if(in)
+		load_placement(in);
+
+	if(period && atoi(period) > 0) {
+		rebalance_period.tv_sec = atoi(period) / 1000;
+		rebalance_period.tv_nsec = (atoi(period) % 1000) * 1000000;
+		liblock_placement_profiling = 1;
+	}
+
+	if(getenv("LIBLOCK_PLACEMENT_OUTPUT")) {
+		liblock_placement_profiling = 1;
+		atexit(save_at_exit);
+	}
+
+	profiling_start = liblock_clock_cycles();
+}
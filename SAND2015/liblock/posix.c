@@ -13,13 +13,14 @@
 #include <errno.h>
 #include "liblock.h"
 #include "liblock-fatal.h"
+#include "clock.h"
 
 struct liblock_impl {
 	pthread_mutex_t posix_lock;
 };
 
 static struct liblock_impl* do_liblock_init_lock(posix)(liblock_lock_t* lock, struct core* server, pthread_mutexattr_t* attr) {
-	struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), server);
 	pthread_mutex_init(&impl->posix_lock, attr);
 	return impl;
 }
@@ -42,6 +43,34 @@ static void* do_liblock_execute_operation(posix)(liblock_lock_t* lock, void* (*p
 	return res;
 }
 
+static int do_liblock_execute_timed(posix)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+	int                  err;
+
+	if(deadline) {
+		/* back to the CLOCK_REALTIME of pthread_mutex_timedlock */
+		struct timespec ts;
+		uint64_t        now = liblock_clock_ns(), abs;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		abs = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec + (deadline > now ? deadline - now : 0);
+		ts.tv_sec = abs / 1000000000ULL;
+		ts.tv_nsec = abs % 1000000000ULL;
+
+		err = pthread_mutex_timedlock(&impl->posix_lock, &ts);
+	} else
+		err = pthread_mutex_trylock(&impl->posix_lock);
+
+	if(err)
+		return err;
+
+	*res = pending(val);
+
+	pthread_mutex_unlock(&impl->posix_lock);
+
+	return 0;
+}
+
 static void do_liblock_init_library(posix)() {
 }
 
@@ -98,4 +127,5 @@ static void do_liblock_relock_in_cs(posix)(liblock_lock_t* lock) {
 static void do_liblock_declare_server(posix)(struct core* core) {
 }
 
-liblock_declare(posix);
+liblock_declare(posix,
+		._execute_timed = do_liblock_execute_timed(posix));
@@ -12,24 +12,28 @@
 #include <sys/time.h>
 #include <string.h>
 #include <errno.h>
-#include <ucontext.h>
 #include <sys/mman.h>
 #include <stdarg.h>
 #include <numa.h>
 #include <assert.h>
 #include <linux/futex.h>
+#include <linux/membarrier.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <sys/mman.h>
+#include <fcntl.h>
 #include "liblock.h"
 #include "liblock-fatal.h"
 #include "fqueue.h"
+#include "mini_context.h"
+#include "timer_wheel.h"
+#include "clock.h"
 
 #define nop() asm volatile ("nop")
 
 //#define LOCK_PROFILER_FRIENDLY
 //#define MMM
-//#define EEE 0x80000002
+//#define EEE 0x80000002    /* PAPI event counted by the servers, link with -lpapi */
 
 #ifdef EEE
 
@@ -44,12 +48,21 @@
 /*
  *      constants
  */
-static const struct timespec manager_timeout = { 0, 50000000 };
+/* period of the liveness check of the manager: a servicing thread that did not loop during it may be blocked. The
+   period doubles at each check where a servicing thread looped, up to LIVENESS_MAX_US, and goes back to the base
+   period as soon as none did. A thread that blocks is seen by the second check at the latest, within 10 ms */
+#define LIVENESS_US       1000  /* default base period (LIBLOCK_RCL_LIVENESS_US) */
+#define LIVENESS_MAX_US   5000
+/* resolution of the timed waits */
+#define TICK_NS        1000000ULL
 
-#define PRIO_BACKUP    2
 #define PRIO_SERVICING 3
 #define PRIO_MANAGER   4
 
+#define RCL_SCHED_AUTO 0   /* real-time priorities when they are allowed */
+#define RCL_SCHED_FIFO 1   /* SCHED_FIFO */
+#define RCL_SCHED_USER 2   /* ordinary threads */
+
 #define SERVER_DOWN     0
 #define SERVER_STOPPING 1
 #define SERVER_STARTING 2
@@ -58,21 +71,51 @@ static const struct timespec manager_timeout = { 0, 50000000 };
 #define STACK_SIZE            r_align(1024*1024, PAGE_SIZE)
 #define MINI_STACK_SIZE       r_align(64*1024, PAGE_SIZE)
 
+#define ASYNC_SLOTS           4    /* asynchronous requests in flight per client and per server */
+
+/* client wait policies (LIBLOCK_RCL_WAIT) */
+#define WAIT_SPIN             0    /* PAUSE until the request is served */
+#define WAIT_YIELD            1    /* yield the processor until the request is served */
+#define WAIT_PARK             2    /* sleep on the request futex until the server wakes us */
+#define WAIT_ADAPTIVE         3    /* spin for a self-tuned budget, then yield, then park */
+
+#define WAIT_SPIN_NS          20000 /* default upper bound of the spinning phase (LIBLOCK_RCL_SPIN_NS) */
+#define WAIT_MIN_SPIN         64    /* lower bound of the self-tuned spin budget, in PAUSE */
+#define WAIT_YIELDS           16    /* number of yields before parking */
+
+/* state of a lock implementation, a migrated lock gets a new implementation on its new server */
+#define IMPL_STARTING         0    /* created by liblock_migrate, the old server still owns the lock */
+#define IMPL_ACTIVE           1
+#define IMPL_RETIRED          2    /* the lock has moved, the requests are forwarded to its new server */
+
+/* pending field of a timed request taken by a server, its client can no longer withdraw it */
+#define REQUEST_CLAIMED       ((void* (*)(void*))1)
+
 /*
  *  structures
  */
 struct request {
 	struct liblock_impl* volatile impl;            /* lock associated with the request */
 	void* volatile                val;             /* argument of the pending request */
-	void*              (*volatile pending)(void*); /* pending request or null if no pending request */
-	char                          pad[pad_to_cache_line(3*sizeof(void*))];
-};
+	void*              (*volatile pending)(void*); /* pending request or null if no pending request, tagged if timed */
+	int volatile                  parked;          /* futex, the client sleeps until the server clears it */
+	char volatile                 busy;            /* asynchronous slot reserved by its client */
+	char volatile                 detached;        /* asynchronous slot released by the server (liblock_post) */
+	char                          pad[2];
+	char                          payload[LIBLOCK_INLINE_SIZE]; /* inlined argument, val points to it (liblock_exec_inline) */
+} __attribute__((aligned (CACHE_LINE_SIZE)));
 
 struct liblock_impl {
-	struct request* volatile   cur_request;        /* current request, used to find it in wait, to update in server_loop to save 150 cycles */
+	/* read by the clients */
+	struct server*             server;             /* server of this implementation, never changes */
 	liblock_lock_t*            liblock_lock;
+	char                       pad0[pad_to_cache_line(2*sizeof(void*))];
+
+	/* private to the server core */
+	struct request* volatile   cur_request;        /* current request, used to find it in wait, to update in server_loop to save 150 cycles */
 	int volatile               locked;	           /* state of the lock */
-	char                       pad[pad_to_cache_line(sizeof(int) + 2*sizeof(void*))];
+	int volatile               state;              /* IMPL_STARTING, IMPL_ACTIVE or IMPL_RETIRED */
+	char                       pad1[pad_to_cache_line(2*sizeof(int) + sizeof(void*))];
 };
 
 struct native_thread {
@@ -80,23 +123,30 @@ struct native_thread {
 	struct mini_thread* volatile   mini_thread;     /* currently associated mini thread */
 	struct server*                 server;          /* server of the thread */
 	pthread_t                      tid;             /* thread id */
+	pid_t volatile                 ktid;            /* kernel thread id, 0 until the thread runs */
 	int                            is_servicing;    /* interrupted */
-	ucontext_t                     initial_context; /* initial context of the thread */
+	struct mini_context            initial_context; /* initial context of the thread */
 	void*                          stack;           /* pointer to the stack */
 	struct fqueue                  ll;              /* pointer to next node */
 	struct native_thread*          all_next;        /* next thread */
+	struct mini_thread* volatile   handoff;         /* mini thread switched out, published in handoff_to once its context is saved */
+	struct fqueue* volatile*       handoff_to;      /* ready list, prepared list or condition */
+	struct liblock_impl*           handoff_unlock;  /* lock released once handoff waits on its condition */
 };
 
 struct mini_thread {
-	ucontext_t                   context;       /* context of the mini thread */
+	struct mini_context          context;       /* context of the mini thread */
 	struct server*               server;        /* server of the mini thread, used for broadcast */
 	int volatile                 is_timed;      /* true if timed */
-	struct timespec              deadline;      /* deadline, only used when the mini-thread is in a timed wait */
+	struct timer_node            timer;         /* deadline, in the timer wheel of the server during a timed wait */
+	int volatile                 woken;         /* set by the first of the signal and the timeout */
 	liblock_cond_t* volatile     wait_on;       /* queue of the mini_thread */
 	int volatile                 wait_res;      /* result of the wait (timeout or not) */
 	struct fqueue                ll_ready;
-	struct fqueue                ll_timed;
+	struct fqueue                ll_timed;      /* link in the ready list after a timeout, ll_ready may still be in the condition */
 	struct fqueue                ll_all;
+	struct request*              released;      /* request of the critical section that released its lock (unlock_in_cs) */
+	struct placement_lock*       placement;     /* liblock_placement_cur of the suspended mini thread */
 	void*                        stack;
 };
 
@@ -120,7 +170,12 @@ struct server {
 	/* always shared (in read) in non blocked case */
 	struct core*                    core;                   /* core where the server run (read by client) */
 	struct request*                 requests;               /* the request array (read by client) */
-	char                            pad1[pad_to_cache_line(2*sizeof(void*))];
+	struct request*                 async_requests;         /* ASYNC_SLOTS requests per client (read by client) */
+	char                            pad1[pad_to_cache_line(3*sizeof(void*))];
+
+	/* written by the clients that post asynchronous requests */
+	int volatile                    nb_async;               /* number of pending asynchronous requests */
+	char                            pad_async[pad_to_cache_line(sizeof(int))];
 
 	/* used in blocked case, private */
 	struct fqueue* volatile         mini_thread_all;        /* list of all active mini threads               */
@@ -133,14 +188,18 @@ struct server {
 
 	/* not intensive shared accesses */
 	void                            (*volatile callback)(); /* callback called when the server is ready to handle request */
-	struct fqueue* volatile         mini_thread_timed;      /* sorted list of mini threads that have timeout */
+	struct timer_wheel*             wheel;                  /* deadlines of the timed waits, expired by the manager */
 	struct fqueue* volatile         mini_thread_ready;      /* list of active mini threads                   */
 	struct fqueue* volatile         mini_thread_prepared;   /* list of sleeping mini threads                 */
 	pthread_mutex_t                 lock_state;             /* lock for state transition */
 	pthread_cond_t                  cond_state;             /* condition to wait on state transition */
+	pthread_mutex_t                 wheel_lock;             /* protects the wheel */
 	int volatile                    nb_attached_locks;      /* number of locks attached to this server */
+	int                             sched_mode;             /* RCL_SCHED_FIFO or RCL_SCHED_USER once started */
+	unsigned long long              nb_created;             /* servicing threads created because the others were blocked */
+	unsigned long long              nb_reactivated;         /* sleeping servicing threads woken up because the others were blocked */
 
-	char                            pad3[pad_to_cache_line(4*sizeof(void*) + sizeof(int) + sizeof(pthread_mutex_t) + sizeof(pthread_cond_t))];
+	char                            pad3[pad_to_cache_line(4*sizeof(void*) + 2*sizeof(int) + 2*sizeof(unsigned long long) + 2*sizeof(pthread_mutex_t) + sizeof(pthread_cond_t))];
 #ifdef MMM
 	struct profiling                profiling;
 	char                            pad4[pad_to_cache_line(sizeof(struct profiling))];
@@ -150,6 +209,14 @@ struct server {
 static struct server**                servers = 0; /* array of server (one per core) */
 static struct liblock_impl            fake_impl;   /* fake lock always taken, used in wait to avoid a second call to the request */
 static __thread struct native_thread* volatile me; /* (local) pointer to the the native thread */
+static int                            wait_policy = WAIT_ADAPTIVE;
+static int                            wait_membarrier;  /* the parking clients fence the servers, see wakeup_client */
+static int                            sched_mode = RCL_SCHED_AUTO; /* default scheduling of the servers */
+static int                            print_stats = 0;   /* report the liveness interventions when a server stops */
+static long                           liveness_us = LIVENESS_US; /* base period of the liveness check */
+static int                            wait_max_spin;     /* calibrated number of PAUSE for the longest spinning phase */
+static __thread int                   wait_spin = -1;    /* self-tuned spin budget of the client */
+static pthread_mutex_t                migrate_lock = PTHREAD_MUTEX_INITIALIZER; /* serializes liblock_migrate */
 
 #ifdef MMM
 static unsigned int nb_client_threads = 0;
@@ -199,6 +266,140 @@ static inline void wakeup_manager(struct server* server) {
 	sys_futex(&server->wakeup, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
 }
 
+/*
+ *      client wait policy
+ */
+/* server side, only pays a syscall for the clients that are sleeping. The release of the request must be visible
+   before parked is read, the client sets parked before reading pending again. With membarrier, the parking client
+   issues the fence on behalf of the servers, which then only need a compiler barrier per request */
+static inline __attribute__((always_inline)) void wakeup_client(struct request* request) {
+	if(wait_policy < WAIT_PARK)
+		return;
+
+	if(wait_membarrier)
+		asm volatile("" ::: "memory");
+	else
+		__sync_synchronize();
+
+	if(request->parked) {
+		request->parked = 0;
+		sys_futex((int*)&request->parked, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+	}
+}
+
+static void park_client(struct request* req) {
+	while(req->pending) {
+		req->parked = 1;
+		if(wait_membarrier)
+			syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+		else
+			__sync_synchronize();
+		if(req->pending)
+			sys_futex((int*)&req->parked, FUTEX_WAIT_PRIVATE, 1, 0, 0, 0);
+	}
+	req->parked = 0;
+}
+
+static void wait_request(struct request* req) {
+	int n;
+
+	switch(wait_policy) {
+		case WAIT_SPIN:
+			while(req->pending)
+				PAUSE();
+			return;
+
+		case WAIT_YIELD:
+			while(req->pending)
+				pthread_yield();
+			return;
+
+		case WAIT_PARK:
+			park_client(req);
+			return;
+	}
+
+	if(wait_spin < 0)
+		wait_spin = wait_max_spin / 2;
+
+	/* the budget follows twice the observed waiting time and shrinks when spinning was useless */
+	for(n=0; n<wait_spin; n++) {
+		if(!req->pending) {
+			wait_spin += (2*n - wait_spin) / 8;
+			if(wait_spin > wait_max_spin)
+				wait_spin = wait_max_spin;
+			return;
+		}
+		PAUSE();
+	}
+
+	wait_spin -= wait_spin / 8;
+	if(wait_spin < WAIT_MIN_SPIN)
+		wait_spin = WAIT_MIN_SPIN;
+
+	for(n=0; n<WAIT_YIELDS; n++) {
+		if(!req->pending)
+			return;
+		pthread_yield();
+	}
+
+	park_client(req);
+}
+
+static void init_sched_mode() {
+	const char* env = getenv("LIBLOCK_RCL_SCHED");
+
+	print_stats = getenv("LIBLOCK_RCL_STATS") != 0;
+
+	if(getenv("LIBLOCK_RCL_LIVENESS_US") && atol(getenv("LIBLOCK_RCL_LIVENESS_US")) > 0)
+		liveness_us = atol(getenv("LIBLOCK_RCL_LIVENESS_US"));
+
+	if(!env || !strcmp(env, "auto"))
+		sched_mode = RCL_SCHED_AUTO;
+	else if(!strcmp(env, "fifo"))
+		sched_mode = RCL_SCHED_FIFO;
+	else if(!strcmp(env, "user"))
+		sched_mode = RCL_SCHED_USER;
+	else
+		fatal("unknown LIBLOCK_RCL_SCHED mode '%s' (fifo, user or auto)", env);
+}
+
+static void init_wait_policy() {
+	const char*     env = getenv("LIBLOCK_RCL_WAIT");
+	long            spin_ns = getenv("LIBLOCK_RCL_SPIN_NS") ? atol(getenv("LIBLOCK_RCL_SPIN_NS")) : WAIT_SPIN_NS;
+	struct timespec start, end;
+	long            ns;
+	int             i;
+
+	if(!env || !strcmp(env, "adaptive"))
+		wait_policy = WAIT_ADAPTIVE;
+	else if(!strcmp(env, "spin"))
+		wait_policy = WAIT_SPIN;
+	else if(!strcmp(env, "yield"))
+		wait_policy = WAIT_YIELD;
+	else if(!strcmp(env, "park"))
+		wait_policy = WAIT_PARK;
+	else
+		fatal("unknown LIBLOCK_RCL_WAIT policy '%s' (spin, yield, park or adaptive)", env);
+
+	if(wait_policy >= WAIT_PARK)
+		wait_membarrier = !syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0);
+
+	/* calibrate the cost of a PAUSE to express the spinning budget in iterations */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0; i<1000; i++)
+		PAUSE();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec)*1000000000L + end.tv_nsec - start.tv_nsec;
+	if(ns < 1)
+		ns = 1;
+
+	wait_max_spin = spin_ns * 1000 / ns;
+	if(wait_max_spin < WAIT_MIN_SPIN)
+		wait_max_spin = WAIT_MIN_SPIN;
+}
+
 /*
  *      time spec shortcuts
  */
@@ -235,6 +436,16 @@ static inline void wakeup_manager(struct server* server) {
 
 #define ts_print(ts) printf("%ld.%9.0ld", (ts)->tv_sec, (ts)->tv_nsec)
 
+/* ticks of the timer wheels, deadlines are rounded up to never expire early */
+#define ts_to_tick(ts)    (((uint64_t)(ts)->tv_sec*1000000000ULL + (ts)->tv_nsec) / TICK_NS)
+#define ts_to_tick_up(ts) (((uint64_t)(ts)->tv_sec*1000000000ULL + (ts)->tv_nsec + TICK_NS - 1) / TICK_NS)
+
+#define tick_to_ts(res, tick)																						\
+	({																																		\
+		(res)->tv_sec = (tick)*TICK_NS / 1000000000ULL;											\
+		(res)->tv_nsec = (tick)*TICK_NS % 1000000000ULL;										\
+	})
+
 #if 0
 #define lock_print(server, msg) rclprintf(server, msg)
 #else
@@ -248,15 +459,6 @@ static inline void wakeup_manager(struct server* server) {
 		})
 #define unlock_state(server) ({ lock_print(server, "state unlock"); pthread_mutex_unlock(&(server)->lock_state); })
 
-/*
- * scheduling
- */
-static __attribute__((always_inline)) inline void setprio(pthread_t thread_id, unsigned int prio) {
-	//printf("%d goes to prio %d\n", self.id, prio);
-//	if(pthread_setschedprio(thread_id, prio))
-//		fatal("unable to set priority: %s for %d", strerror(errno), self.id);
-}
-
 /*
  * atomic operations on a local core
  */
@@ -290,15 +492,51 @@ static inline __attribute__((always_inline)) int local_add_and_fetch(int volatil
  */
 /* commut from in to out */
 
-static int mini_thread_lt(struct fqueue* ln, struct fqueue* rn) {
-	struct mini_thread* l = ln->content, *r = rn->content;
-	return ts_lt(&l->deadline, &r->deadline);
+/*
+ * a switched out mini thread is published by the next mini thread, once its context is saved: another servicing
+ * thread of the core could otherwise resume it from a stale context if the switching thread is preempted
+ */
+static void handoff(struct mini_thread* mini_thread, struct fqueue* volatile* to, struct liblock_impl* unlock) {
+	me->handoff = mini_thread;
+	me->handoff_to = to;
+	me->handoff_unlock = unlock;
+}
+
+static void complete_handoff() {
+	struct mini_thread*  mini_thread = me->handoff;
+	struct liblock_impl* impl = me->handoff_unlock;
+	struct server*       server = mini_thread->server;
+
+	me->handoff = 0;
+
+	if(impl) {
+		/* condition wait: the timer is armed before a signal can see the mini thread, the signal cancels it */
+		if(mini_thread->is_timed) {
+			pthread_mutex_lock(&server->wheel_lock);
+			timer_wheel_add(server->wheel, &mini_thread->timer);
+			pthread_mutex_unlock(&server->wheel_lock);
+
+			if(mini_thread->timer.expires < ts_to_tick_up(&server->next_deadline))
+				wakeup_manager(server);
+		}
+
+		fqueue_enqueue(me->handoff_to, &mini_thread->ll_ready);
+		impl->locked = 0;
+	} else {
+		fqueue_enqueue(me->handoff_to, &mini_thread->ll_ready);
+		if(me->handoff_to == &server->mini_thread_ready)
+			__sync_fetch_and_add(&server->nb_ready_and_servicing, 1);
+	}
 }
 
 static inline __attribute__((always_inline)) void swap_mini_thread(struct mini_thread* in, struct mini_thread* out) {
 	//rclprintf(in->server, "switching from %p to %p", in, out);
+	in->placement = liblock_placement_cur;
+	liblock_placement_cur = out->placement;
 	me->mini_thread = out;
-	swapcontext(&in->context, &out->context);
+	liblock_context_switch(&in->context, &out->context);
+	if(me->handoff)
+		complete_handoff();
 }
 
 static struct mini_thread* allocate_mini_thread(struct server* server) {
@@ -311,16 +549,15 @@ static struct mini_thread* allocate_mini_thread(struct server* server) {
 
 	//rclprintf(server, "CREATE context %p with stack at %p and size %d", res, res->stack, STACK_SIZE);
 
-	getcontext(&res->context);
 	res->server = server;
-	res->context.uc_link = 0;
-	res->context.uc_stack.ss_sp = res->stack;
-	res->context.uc_stack.ss_size = STACK_SIZE;
 	res->ll_ready.content = res;
 	res->ll_timed.content = res;
+	res->timer.content    = res;
+	res->timer.prev       = 0;
 	res->ll_all.content   = res;
+	res->placement        = 0;
 
-	makecontext(&res->context, (void(*)())servicing_loop, 0);
+	liblock_context_make(&res->context, res->stack, STACK_SIZE, servicing_loop);
 
 	fqueue_enqueue(&server->mini_thread_all, &res->ll_all);
 
@@ -357,35 +594,55 @@ static struct mini_thread* get_or_allocate_mini_thread(struct server* server) {
 		return allocate_mini_thread(server);
 }
 
-static void insert_in_ready_and_remove_from_timed(struct fqueue* node) {
+/* called by the manager with the wheel lock, loses against a concurrent signal */
+static void expire_mini_thread(struct timer_node* node) {
 	struct mini_thread* mini_thread = node->content;
-	struct server* server = mini_thread->server;
-	//rclprintf(server, "++++      reinjecting mini thread: %p", mini_thread);
-	//ll_print("ready", &server->mini_thread_ready);
-	fqueue_remove(&server->mini_thread_timed, &mini_thread->ll_timed, 0);
-	fqueue_enqueue(&server->mini_thread_ready, &mini_thread->ll_ready);
-	__sync_fetch_and_add(&server->nb_ready_and_servicing, 1);
-	//rclprintf(server, "++++      reinjecting mini thread: %p done", mini_thread);
-	//ll_print("ready", &server->mini_thread_ready);
+	struct server*      server = mini_thread->server;
+
+	if(__sync_bool_compare_and_swap(&mini_thread->woken, 0, 1)) {
+		//rclprintf(server, "++++      reinjecting mini thread: %p", mini_thread);
+		mini_thread->wait_res = ETIMEDOUT;
+		fqueue_enqueue(&server->mini_thread_ready, &mini_thread->ll_timed);
+		__sync_fetch_and_add(&server->nb_ready_and_servicing, 1);
+	}
 }
 
 /*
  *   liblock API
  */
+/* acquire the lock from its server core, 0 if the lock has moved to another server */
+static int local_acquire(struct liblock_impl* impl) {
+	for(;;) {
+		while(local_val_compare_and_swap(int, &impl->locked, 0, 1)) { /* one of my thread own the lock */
+			me->timestamp = me->server->timestamp;
+			pthread_yield();                          /* give a chance to one of our thread to release the lock */
+		}
+
+		if(impl->state == IMPL_ACTIVE)
+			return 1;
+
+		impl->locked = 0;
+
+		if(impl->state == IMPL_RETIRED)
+			return 0;
+
+		me->timestamp = me->server->timestamp;
+		pthread_yield();                            /* the old server still owns the lock */
+	}
+}
+
 /* execute operation (client side) */
-static void* do_liblock_execute_operation(rcl)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
-	struct liblock_impl* impl = lock->impl;
-	struct server* server = lock->r0;
+static void* execute_on(liblock_lock_t* lock, struct liblock_impl* impl, void* (*pending)(void*), void* val) {
+	struct server* server = impl->server;
 
 	//rclprintf(server, "*** sending operation %p::%p for client %d - %p", pending, val, self.id, (void*)pthread_self());
 	if(me && self.running_core == server->core) {
 		void* res;
 
-		while(local_val_compare_and_swap(int, &impl->locked, 0, 1)) { /* one of my thread own the lock */
-			me->timestamp = server->timestamp;
-			pthread_yield();                          /* give a chance to one of our thread to release the lock */
-		}
+		if(!local_acquire(impl))
+			return execute_on(lock, lock->impl, pending, val);
 
+		impl->cur_request = 0;                      /* no request to hide in unlock_in_cs */
 		res = pending(val);
 		impl->locked = 0;                           /* I release the lock */
 
@@ -398,29 +655,154 @@ static void* do_liblock_execute_operation(rcl)(liblock_lock_t* lock, void* (*pen
 	req->val = val;
 	req->pending = pending;
 
-#if 0
-	int i=0;
+	wait_request(req);
 
-	for(i=0; i<500; i++) {
-		PAUSE();
-		
-		if(!req->pending)
-			return req->val;
-	}
+	return req->val;
+}
 
-	while(req->pending) {
-		pthread_yield();
+static void* do_liblock_execute_operation(rcl)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	return execute_on(lock, lock->impl, pending, val);
+}
+
+/* the request is withdrawn if the server has not claimed it at the deadline, or as soon as the lock is seen busy for
+   a single attempt */
+static int do_liblock_execute_timed(rcl)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+	struct server*       server = impl->server;
+	struct request*      req;
+
+	if(me && self.running_core == server->core) {
+		for(;;) {
+			if(!local_val_compare_and_swap(int, &impl->locked, 0, 1)) {
+				if(impl->state == IMPL_ACTIVE)
+					break;
+
+				impl->locked = 0;
+
+				if(impl->state == IMPL_RETIRED)
+					return do_liblock_execute_timed(rcl)(lock, pending, val, res, deadline);
+			}
+
+			if(liblock_clock_expired(deadline))
+				return EBUSY;
+
+			me->timestamp = me->server->timestamp;
+			pthread_yield();                          /* give a chance to one of our thread to release the lock */
+		}
+
+		impl->cur_request = 0;
+		*res = pending(val);
+		impl->locked = 0;
+
+		return 0;
 	}
-#else
+
+	req = &server->requests[self.id];
+
+	req->impl = impl;
+	req->val = val;
+	req->pending = pending = liblock_timed_tag(pending);
+
 	while(req->pending) {
-		pthread_yield();
-        //PAUSE();
+		if((deadline ? liblock_clock_expired(deadline) : impl->locked) && __sync_bool_compare_and_swap(&req->pending, pending, 0))
+			return EBUSY;
+		PAUSE();
 	}
-#endif
+
+	*res = req->val;
+
+	return 0;
+}
+
+/* the argument is copied in the request line, the server does not read the stack of the client */
+static void* do_liblock_execute_inline(rcl)(liblock_lock_t* lock, void* (*pending)(void*), void* ctx, size_t size) {
+	struct liblock_impl* impl = lock->impl;
+	struct server*       server = impl->server;
+	struct request*      req;
+
+	if((me && self.running_core == server->core) || size > LIBLOCK_INLINE_SIZE)
+		return execute_on(lock, impl, pending, ctx);
+
+	req = &server->requests[self.id];
+
+	memcpy(req->payload, ctx, size);
+	req->impl = impl;
+	req->val = req->payload;
+	req->pending = pending;
+
+	wait_request(req);
+
+	memcpy(ctx, req->payload, size);
 
 	return req->val;
 }
 
+static int execute_async_now(liblock_lock_t* lock, void* (*pending)(void*), void* val, liblock_future_t* future) {
+	void* res = do_liblock_execute_operation(rcl)(lock, pending, val);
+
+	if(future) {
+		future->slot = 0;
+		future->res = res;
+	}
+
+	return 0;
+}
+
+/* post an asynchronous request (client side), future is null for liblock_post */
+static int do_liblock_execute_async(rcl)(liblock_lock_t* lock, void* (*pending)(void*), void* val, liblock_future_t* future) {
+	struct liblock_impl* impl = lock->impl;
+	struct server* server = impl->server;
+	struct request *row, *req;
+	int i, detached;
+
+	if(me && self.running_core == server->core)
+		return execute_async_now(lock, pending, val, future);
+
+	row = &server->async_requests[self.id*ASYNC_SLOTS];
+
+	for(;;) {
+		for(i=0, detached=0; i<ASYNC_SLOTS && row[i].busy; i++)
+			detached |= row[i].detached;
+
+		if(i < ASYNC_SLOTS)
+			break;
+
+		/* only liblock_wait releases the slots of the futures, the server releases the detached ones */
+		if(!detached)
+			return execute_async_now(lock, pending, val, future);
+
+		pthread_yield();                            /* all my slots are in flight */
+	}
+
+	req = &row[i];
+
+	req->busy = 1;
+	req->detached = !future;
+	req->impl = impl;
+	req->val = val;
+
+	__sync_fetch_and_add(&server->nb_async, 1);
+
+	req->pending = pending;
+
+	if(future)
+		future->slot = req;
+
+	return 0;
+}
+
+static void* do_liblock_wait(rcl)(liblock_future_t* future) {
+	struct request* req = future->slot;
+
+	wait_request(req);
+
+	future->res = req->val;
+	future->slot = 0;
+	req->busy = 0;
+
+	return future->res;
+}
+
 __attribute__ ((noinline)) static int servicing_loop_slow_path(struct server* server, int time) {
 	struct mini_thread *next = get_ready_mini_thread(server), *cur;
 
@@ -428,8 +810,7 @@ __attribute__ ((noinline)) static int servicing_loop_slow_path(struct server* se
 		cur = me->mini_thread;
 		/* more than one ready mini threads, activate the next one and put the running one in the prepared list */
 		//rclprintf(server, "servicing-loop::elect mini-thread: %p (and %p goes to prepared)", next, cur);
-		fqueue_enqueue(&server->mini_thread_prepared, &cur->ll_ready);
-		//ll_print("prepared", &server->mini_thread_prepared);
+		handoff(cur, &server->mini_thread_prepared, 0);
 		swap_mini_thread(cur, next);
 		//rclprintf(server, "servicing-loop::mini-thread: %p is up", me->mini_thread);
 		time = 0;
@@ -472,9 +853,51 @@ __attribute__ ((noinline)) static int servicing_loop_slow_path(struct server* se
 void liblock_rcl_execute_op_for(liblock_lock_t* lock, size_t id) {}
 #endif
 
+/* a request that reached the old server of a migrated lock, executed as a client of its new server */
+__attribute__ ((noinline)) static void forward_request(struct request* request, struct liblock_impl* impl, void* (*pending)(void*)) {
+	request->val = do_liblock_execute_operation(rcl)(impl->liblock_lock, pending, request->val);
+}
+
+/* the next pending requests of the same function on the same lock are executed with one call to the batch handler */
+__attribute__ ((noinline)) static void execute_batch(struct server* server, struct request* request, void* (*pending)(void*),
+																										 void (*handler)(void**, int), unsigned int* ids, unsigned int nb_ids) {
+	struct request* batch[LIBLOCK_MAX_BATCH];
+	void*           vals[LIBLOCK_MAX_BATCH];
+	unsigned int    k;
+	int             n = 1, i;
+
+	batch[0] = request;
+	vals[0] = request->val;
+
+	for(k=0; k<nb_ids && n<LIBLOCK_MAX_BATCH; k++) {
+		struct request* cur = &server->requests[ids[k]];
+
+		if(cur->pending == pending && cur->impl == request->impl) {
+			batch[n] = cur;
+			vals[n++] = cur->val;
+		}
+	}
+
+	handler(vals, n);
+
+	request->val = vals[0];
+
+	for(i=1; i<n; i++) {
+		batch[i]->val = vals[i];
+		batch[i]->pending = 0;
+		wakeup_client(batch[i]);
+	}
+}
+
 static void servicing_loop() {
-	struct server* server = me->server;
-	void (*callback)() = server->callback;
+	struct server* server;
+	void (*callback)();
+
+	if(me->handoff)
+		complete_handoff();
+
+	server = me->server;
+	callback = server->callback;
 
 	if(callback && __sync_val_compare_and_swap(&server->callback, callback, 0) == callback) {
 		callback();
@@ -492,11 +915,16 @@ static void servicing_loop() {
 	//rclprintf(server, "::: start servicing loop %p", me->mini_thread);
 
 	do {
+		server = me->server;                            /* a mini thread that waited on a migrated lock moves to its new server */
 		me->timestamp = server->timestamp;
 		server->alive = 1;
 
-		struct request* request, *last;
+		struct request* request;
+		struct liblock_impl* owner;
 		void* (*pending)(void*);
+		void (*handler)(void**, int);
+		unsigned int* ids = liblock_active_ids.ids;
+		unsigned int  nb_ids = liblock_active_ids.nb, k;
 
 #ifdef MMM
 		yop = 0;
@@ -505,12 +933,22 @@ static void servicing_loop() {
 		profiling.nb_normal_path++;
 #endif
 
-		last = &server->requests[id_manager.first_free];
-		for(request=&server->requests[id_manager.first]; request<last; request++) {
+		for(k=0; k<nb_ids; k++) {
+			request = &server->requests[ids[k]];
 			pending = request->pending;
 
-			if(pending) {
-				struct liblock_impl* impl = request->impl;
+			if(pending && pending != REQUEST_CLAIMED) {
+				int                  timed = liblock_is_timed(pending);
+				struct liblock_impl* impl;
+
+				/* a withdrawn timed request may be replaced by a request on another lock, it is claimed before its lock is read */
+				if(timed) {
+					if(!__sync_bool_compare_and_swap(&request->pending, pending, REQUEST_CLAIMED))
+						continue;
+					pending = liblock_timed_untag(pending);
+				}
+
+				impl = request->impl;
 
 #ifdef LOCK_PROFILER_FRIENDLY
 				liblock_rcl_execute_op_for(impl->liblock_lock, ((uintptr_t)request - (uintptr_t)server->requests)/sizeof(struct request));
@@ -532,24 +970,84 @@ static void servicing_loop() {
 				}
 #endif
 
-				if(!local_val_compare_and_swap(int, &impl->locked, 0, 1)) {
-					impl->cur_request = request;
+				/* the implementation of another server: a request whose mini thread has moved with its lock */
+				if(impl->server == server && !local_val_compare_and_swap(int, &impl->locked, 0, 1)) {
+					if(impl->state != IMPL_ACTIVE) {
+						if(impl->state == IMPL_STARTING) {
+							impl->locked = 0;
+							if(timed)
+								request->pending = liblock_timed_tag(pending);
+							continue;
+						}
+						forward_request(request, impl, pending);
+					} else {
+						impl->cur_request = request;
+
+						//rclprintf(server, "executing request %p::%p", pending, request->val);
 
-					//rclprintf(server, "executing request %p::%p", pending, request->val);
+						if(liblock_nb_batch_handlers && (handler = liblock_batch_handler(pending)))
+							execute_batch(server, request, pending, handler, ids + k + 1, nb_ids - k - 1);
+						else
+							request->val = pending(request->val); 
 
-					request->val = pending(request->val); 
+						//rclprintf(server, "executing request %p::%p done", pending, request->val);
+					}
 
-					//rclprintf(server, "executing request %p::%p done", pending, request->val);
+					owner = request->impl;                /* read before the client can reuse the request */
 
 					request->pending = 0;
 
-					request->impl->locked = 0;
-				}
+					owner->locked = 0;
+
+					wakeup_client(request);
+
+					if(owner != impl)
+						goto moved;                       /* this mini thread now runs on the new server of the lock */
+				} else if(timed)
+					request->pending = liblock_timed_tag(pending); /* the client may withdraw it again */
 				
 				//zzz1++;
 			}
 		}
 
+		if(server->nb_async) {
+			for(k=0; k<nb_ids*ASYNC_SLOTS; k++) {
+				request = &server->async_requests[ids[k/ASYNC_SLOTS]*ASYNC_SLOTS + k%ASYNC_SLOTS];
+				pending = request->pending;
+
+				if(pending) {
+					struct liblock_impl* impl = request->impl;
+
+					if(impl->server == server && !local_val_compare_and_swap(int, &impl->locked, 0, 1)) {
+						if(impl->state != IMPL_ACTIVE) {
+							if(impl->state == IMPL_STARTING) {
+								impl->locked = 0;
+								continue;
+							}
+							forward_request(request, impl, pending);
+						} else {
+							impl->cur_request = request;
+							request->val = pending(request->val);
+						}
+
+						owner = request->impl;
+						request->pending = 0;
+						owner->locked = 0;
+
+						if(request->detached)
+							request->busy = 0;
+						else
+							wakeup_client(request);
+
+						__sync_fetch_and_sub(&server->nb_async, 1);
+
+						if(owner != impl)
+							goto moved;
+					}
+				}
+			}
+		}
+
 		//{ static int n=0; if(!(++n % 500000)) rclprintf(server, "servicing loop is running"); }		
 
 		if(server->nb_ready_and_servicing > 1) {
@@ -559,7 +1057,9 @@ static void servicing_loop() {
 #endif
 		}
 
-	} while(server->state >= SERVER_STARTING);
+	moved:
+		;
+	} while(me->server->state >= SERVER_STARTING);
 
 #ifdef MMM
 	__sync_fetch_and_add(&server->profiling.nb_false, profiling.nb_false);
@@ -569,7 +1069,7 @@ static void servicing_loop() {
 	__sync_fetch_and_add(&server->profiling.nb_slow_path, profiling.nb_slow_path);
 #endif
 
-	setcontext(&me->initial_context);
+	liblock_context_set(&me->initial_context);
 }
 
 /*
@@ -588,6 +1088,7 @@ static void* servicing_thread(void* arg) {
 	//rclprintf(server, "start: servicing thread %d", self.id);
 
 	me = native_thread;
+	me->ktid = syscall(SYS_gettid);
 	me->mini_thread = get_or_allocate_mini_thread(server);
 
 	local_fetch_and_add(&server->nb_free_threads, -1);
@@ -619,9 +1120,8 @@ static void* servicing_thread(void* arg) {
 
 #endif
 	liblock_on_server_thread_start("rcl", self.id);
-	getcontext(&me->initial_context);
 	if(server->state == SERVER_UP)
-		setcontext(&me->mini_thread->context);
+		liblock_context_switch(&me->initial_context, &me->mini_thread->context); /* back when the servicing loop ends */
 
 
 #ifdef EEE
@@ -656,6 +1156,7 @@ static void ensure_at_least_one_free_thread(struct server* server) {
 
 			if(node) {
 				elected = node->content;
+				server->nb_reactivated++;
 				//rclprintf(server, "REACTIVATING servicing thread %p", elected);
 			} else {
 				elected = liblock_allocate(sizeof(struct native_thread));
@@ -665,6 +1166,8 @@ static void ensure_at_least_one_free_thread(struct server* server) {
 				mprotect(elected->stack, PAGE_SIZE, PROT_NONE);
 				
 				elected->server = server;
+				elected->ktid = 0;
+				elected->handoff = 0;
 
 				elected->all_next = server->all_threads;
 				server->all_threads = elected;
@@ -686,11 +1189,14 @@ static void ensure_at_least_one_free_thread(struct server* server) {
 				param.sched_priority = PRIO_SERVICING;
 				pthread_attr_init(&attr);
 				
-				pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
-				pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
-				pthread_attr_setschedparam(&attr, &param);
+				if(server->sched_mode == RCL_SCHED_FIFO) {
+					pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+					pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+					pthread_attr_setschedparam(&attr, &param);
+				}
 				
 				//rclprintf(server, "launching the new servicing thread %p", elected);
+				server->nb_created++;
 				liblock_thread_create_and_bind(server->core, "rcl", &elected->tid, &attr, servicing_thread, elected);
 				//rclprintf(server, "launching of the servicing thread %p done", elected);
 			}
@@ -699,28 +1205,57 @@ static void ensure_at_least_one_free_thread(struct server* server) {
 	//rclprintf(server, "ensure done");
 }
 
-static void* backup_thread(void* arg) {
-	struct server* server = arg;
+/* the kernel reports the thread as sleeping (I/O, futex, page fault...) and not preempted */
+static int thread_sleeps(struct native_thread* thread) {
+	char path[64], buf[256], *p;
+	int  fd, n;
 
-	//rclprintf(server, "start: backup");
-	while(server->state >= SERVER_STARTING) {
-		//rclprintf(server, "+++ backup thread is running");
-		server->alive = 0;
-		wakeup_manager(server);
-	}
-	//rclprintf(server, "+++ quitting backup thread %p", pthread_self());
+	if(!thread->ktid)
+		return 0;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/stat", thread->ktid);
+
+	if((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if(n <= 0)
+		return 0;
+
+	buf[n] = 0;
+	p = strrchr(buf, ')');              /* the name of the thread may contain spaces */
+
+	return p && (p[2] == 'S' || p[2] == 'D');
+}
+
+/*
+ * called at each liveness period: the servicing threads stamp their loop with the timestamp of the server, a servicing
+ * thread with an old stamp did not loop since the last check. The manager only intervenes when none of them looped and
+ * one of them really sleeps in the kernel, a long critical section does not need another servicing thread
+ */
+static int servicing_blocked(struct server* server) {
+	struct native_thread* cur;
+
+	if(server->alive)
+		return 0;
+
+	for(cur=server->all_threads; cur; cur=cur->all_next)
+		if(cur->is_servicing == 1 && cur->timestamp != server->timestamp && thread_sleeps(cur))
+			return 1;
 
 	return 0;
 }
 
 static void* manager_thread(void* arg) {
-	pthread_t backup_tid;
 	struct server* server = arg;
 	struct native_thread* native_thread, *next;
 	struct sched_param param;
-	pthread_attr_t attr;
-	struct timespec now, deadline;
-	int done;
+	struct timespec now, deadline, next_expiry, period;
+	long period_us = liveness_us;
+	uint64_t next_tick;
+	int err;
 
 #ifdef MMM
 	server->profiling.nb_false = 0;
@@ -741,21 +1276,22 @@ static void* manager_thread(void* arg) {
 	lock_state(server);
 
 	/* make sure that we own the lock when going to FIFO scheduling */
-	param.sched_priority = PRIO_MANAGER;
+	if(server->sched_mode != RCL_SCHED_USER) {
+		param.sched_priority = PRIO_MANAGER;
 
-	if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == -1)
-		fatal("pthread_setschedparam: %s", strerror(errno));
-
-	param.sched_priority = PRIO_BACKUP;
-	pthread_attr_init(&attr);
-	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
-	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
-	pthread_attr_setschedparam(&attr, &param);
-
-	liblock_thread_create_and_bind(server->core, "rcl", &backup_tid, &attr, backup_thread, server);
+		if((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))) {
+			if(server->sched_mode == RCL_SCHED_FIFO)
+				fatal("pthread_setschedparam: %s", strerror(err));
+			server->sched_mode = RCL_SCHED_USER;
+		} else
+			server->sched_mode = RCL_SCHED_FIFO;
+	}
 
 	ensure_at_least_one_free_thread(server);
 
+	server->nb_created = 0;
+	server->nb_reactivated = 0;
+
 	server->state = SERVER_UP;
 
 	pthread_cond_broadcast(&server->cond_state);
@@ -770,64 +1306,41 @@ static void* manager_thread(void* arg) {
 		nb_wakeup++;
 #endif
 
-		if(!server->alive) {
+		if(servicing_blocked(server)) {
 			//rclprintf(server, "no more alive servicing threads");
 
 #ifdef MMM
 			nb_not_alive++;
 #endif
 			ensure_at_least_one_free_thread(server);
+		}
 
-			server->alive = 1;
-			done = 0;
+		/* a busy or idle server whose servicing threads keep looping is rarely preempted by the manager */
+		if(!server->alive)
+			period_us = liveness_us;
+		else if(period_us < LIVENESS_MAX_US)
+			period_us = period_us*2 < LIVENESS_MAX_US ? period_us*2 : LIVENESS_MAX_US;
 
-			while(!done) {
-				struct native_thread* cur = server->all_threads;
-				while(cur) {
-					if(cur->is_servicing) {
-						if(done || (cur->timestamp == cur->server->timestamp)) {
-							setprio(cur->tid, PRIO_BACKUP);
-							setprio(cur->tid, PRIO_SERVICING);
-						} else {
-							cur->timestamp = server->timestamp; /* set it here because could be in I/O */
-							done = 1;
-						}
-					}
-					cur = cur->all_next;
-				}
+		server->alive = 0;
+		server->timestamp++;
 
-				if(!done)
-					server->timestamp++;
-			}
-		} else
-			server->alive = 0;
+		period.tv_sec = period_us / 1000000;
+		period.tv_nsec = (period_us % 1000000) * 1000;
 
 		ts_gettimeofday(&now, 0);
-		ts_add(&deadline, &now, &manager_timeout);
+		ts_add(&deadline, &now, &period);
 
-		done = 0;
-
-		//printf("+++++++++++++++++++++++++++++++++++++\n");
 		//printf("++++      manager: current time: "); ts_print(&now); printf("\n");
-		//printf("++++      manager: initial deadline: "); ts_print(&deadline); printf("\n");
-		while(!done) {
-			struct fqueue* node = server->mini_thread_timed;
- 			if(node) {
-				struct mini_thread* cur = node->content;
-				//printf("++++      manager: find waiter: %p\n", cur);
-				if(ts_le(&cur->deadline, &now)) {
-					//printf("++++      manager: reinject expired deadline\n");
-					fqueue_remove((struct fqueue**)&cur->wait_on->impl.data, &cur->ll_ready, insert_in_ready_and_remove_from_timed);
-				} else {
-					struct timespec ddd = cur->deadline;
-					if(ts_lt(&ddd, &deadline)) {
-						//printf("++++      manager: change deadline to: "); ts_print(&deadline); printf("\n");
-						deadline = ddd;
-					}
-					done = 1;
-				}
-			} else
-				done = 1;
+		pthread_mutex_lock(&server->wheel_lock);
+		timer_wheel_advance(server->wheel, ts_to_tick(&now), expire_mini_thread);
+		next_tick = timer_wheel_next(server->wheel);
+		pthread_mutex_unlock(&server->wheel_lock);
+
+		/* a single sleep up to the next expiry of the wheel, the next cascade is included */
+		if(next_tick != WHEEL_NEVER) {
+			tick_to_ts(&next_expiry, next_tick);
+			if(ts_lt(&next_expiry, &deadline))
+				deadline = next_expiry;
 		}
 		//printf("++++      manager: next deadline: "); ts_print(&deadline); printf("\n");
 
@@ -853,11 +1366,6 @@ static void* manager_thread(void* arg) {
 		}
 	}
 	
-	//rclprintf(server, "waiting backup");
-
-	if(pthread_join(backup_tid, 0) != 0)
-		fatal("pthread_join");
-
 	//rclprintf(server, "waiting servicing threads");
 	
 	for(native_thread=server->all_threads; native_thread; native_thread=next) {
@@ -880,12 +1388,17 @@ static void* manager_thread(void* arg) {
 
 	//rclprintf(server, "quitting");
 
-	server->mini_thread_timed = 0;
+	ts_gettimeofday(&now, 0);
+	timer_wheel_init(server->wheel, ts_to_tick(&now));
 	server->mini_thread_ready = 0;
 	server->mini_thread_prepared = 0;
 
 	server->prepared_threads = 0;
 
+	if(print_stats)
+		fprintf(stdout, "--- rcl server of core %d: %llu servicing threads created, %llu reactivated\n",
+						server->core->core_id, server->nb_created, server->nb_reactivated);
+
 #ifdef MMM
 	fprintf(stdout, "--- manager of core %d\n", server->core->core_id);
 	fprintf(stdout, "    nb wakeup: %d\n", nb_wakeup);
@@ -967,23 +1480,30 @@ static int cond_signal(liblock_cond_t* cond) {
 	struct mini_thread*    mini_thread;
 	struct server*         server;
 
-	node = fqueue_dequeue((struct fqueue**)&cond->impl.data);
-
-	if(node) {
+	while((node = fqueue_dequeue((struct fqueue**)&cond->impl.data))) {
 		mini_thread = node->content;
+
+		/* the timeout already made it ready */
+		if(!__sync_bool_compare_and_swap(&mini_thread->woken, 0, 1))
+			continue;
+
 		server = mini_thread->server;
 
 		//rclprintf(server, "broadcast::dequeuing: %p", mini_thread);
 
-		if(mini_thread->is_timed)
-			fqueue_remove((struct fqueue**)&mini_thread->wait_on->impl.data, &mini_thread->ll_timed, 0);
+		if(mini_thread->is_timed) {
+			pthread_mutex_lock(&server->wheel_lock);
+			timer_wheel_cancel(server->wheel, &mini_thread->timer);
+			pthread_mutex_unlock(&server->wheel_lock);
+		}
 
 		fqueue_enqueue(&server->mini_thread_ready, node);
 		__sync_fetch_and_add(&server->nb_ready_and_servicing, 1);
 
 		return 1;
-	} else
-		return 0;
+	}
+
+	return 0;
 }
 
 static int do_liblock_cond_signal(rcl)(liblock_cond_t* cond) { 
@@ -996,6 +1516,19 @@ static int do_liblock_cond_broadcast(rcl)(liblock_cond_t* cond) {
 	return 0;
 }
 
+/* move the running mini thread to the server of a migrated lock, it resumes there */
+static void follow_lock(struct mini_thread* cur, struct server* target) {
+	struct server*      server = me->server;
+	struct mini_thread* next = get_or_allocate_mini_thread(server);
+
+	fqueue_remove(&server->mini_thread_all, &cur->ll_all, 0);
+	cur->server = target;
+	fqueue_enqueue(&target->mini_thread_all, &cur->ll_all);
+
+	handoff(cur, &target->mini_thread_ready, 0);
+	swap_mini_thread(cur, next);
+}
+
 static int do_liblock_cond_timedwait(rcl)(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) { 
 	struct liblock_impl* impl = lock->impl;
 	struct mini_thread*  cur = me->mini_thread;
@@ -1008,41 +1541,36 @@ static int do_liblock_cond_timedwait(rcl)(liblock_cond_t* cond, liblock_lock_t*
 	cur->is_timed = ts ? 1 : 0;
 	cur->wait_on = cond;
 	cur->wait_res = 0;
+	cur->woken = 0;
+
+	if(ts)
+		cur->timer.expires = ts_to_tick_up(ts);
 
 	/* first, don't re-execute the request */ 
 	request->impl = &fake_impl;
 
-	/* then, enqueue my request in cond  */
-	//rclprintf(cur->server, "cond:enqueuing: %p", cur);
-	fqueue_enqueue((struct fqueue**)&cond->impl.data, &cur->ll_ready);
-	//ll_print("cond->impl.data", (struct mini_thread_ll**)&cond->impl.data);
-
-	/* release the lock */
-	impl->locked = 0;
-
-	if(ts) {
-		//rclprintf(cur->server, "cond:timed: %p", cur);
-		cur->deadline = *ts;
-
-		fqueue_ordered_insert(&server->mini_thread_timed, &cur->ll_timed, mini_thread_lt);
-
-		if(ts_lt(ts, &server->next_deadline))
-			wakeup_manager(server);
-	}
-
+	/* then, jump to the next mini thread, which enqueues me in cond and releases the lock */
 	//rclprintf(cur->server, "swapping: me is %p", me);
-
-	/* and finally, jump to the next mini thread */
+	handoff(cur, (struct fqueue**)&cond->impl.data, impl);
 	swap_mini_thread(cur, next);
 	//rclprintf(server, "%p mini-thread is running (%d)", cur, impl->locked);
 
-	while(local_val_compare_and_swap(int, &impl->locked, 0, 1)) { /* one of my thread own the lock */
-		me->timestamp = me->server->timestamp;
-		pthread_yield();                          /* give a chance to one of our thread to release the lock */
+	/* after a timeout, ll_ready may still be linked in the condition */
+	if(cur->wait_res == ETIMEDOUT)
+		fqueue_remove((struct fqueue**)&cond->impl.data, &cur->ll_ready, 0);
+
+	/* the lock may have migrated during the wait, the critical section continues on its new server */
+	for(;;) {
+		impl = lock->impl;
+		if(impl->server != me->server)
+			follow_lock(cur, impl->server);
+		else if(local_acquire(impl))
+			break;
 	}
 
 	//rclprintf(cur->server, "relected: me continue %p", me);
 
+	impl->cur_request = request;
 	request->impl = impl;
 
 	return cur->wait_res;
@@ -1061,32 +1589,58 @@ static int do_liblock_cond_destroy(rcl)(liblock_cond_t* cond) {
 	return 0;
 }
 
+/* as in a wait, the request of the critical section is hidden from the servicing loop while the lock is released */
 static void do_liblock_unlock_in_cs(rcl)(liblock_lock_t* lock) {
-	fatal("implement me"); 
+	struct liblock_impl* impl = lock->impl;
+	struct request*      request = impl->cur_request;
+
+	me->mini_thread->released = request;
+	if(request)
+		request->impl = &fake_impl;
+
+	impl->locked = 0;
 }
 
 static void do_liblock_relock_in_cs(rcl)(liblock_lock_t* lock) {
-	fatal("implement me"); 
+	struct mini_thread*  cur = me->mini_thread;
+	struct request*      request = cur->released;
+	struct liblock_impl* impl;
+
+	/* the lock may have migrated meanwhile, the critical section continues on its new server */
+	for(;;) {
+		impl = lock->impl;
+		if(impl->server != me->server)
+			follow_lock(cur, impl->server);
+		else if(local_acquire(impl))
+			break;
+	}
+
+	cur->released = 0;
+	impl->cur_request = request;
+	if(request)
+		request->impl = impl;
 }
 
 static struct liblock_impl* do_liblock_init_lock(rcl)(liblock_lock_t* lock, struct core* core, pthread_mutexattr_t* attr) {
 	struct server* server = servers[core->core_id];
-	struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
 
 	lock->r0 = server;
 
+	impl->server = server;
 	impl->locked = 0;
+	impl->state = IMPL_ACTIVE;
 	impl->liblock_lock = lock;
 
 	__sync_fetch_and_add(&server->nb_attached_locks, 1);
 
-	liblock_reserve_core_for(core, "rcl");
+	liblock_reserve_core_for(core, lock->lib->lib_name);
 
 	return impl;
 }
 
 static int do_liblock_destroy_lock(rcl)(liblock_lock_t* lock) {
-	struct server* server = lock->r0;
+	struct server* server = lock->impl->server;
 	//rclprintf(impl->server, "destroying lock %p", lock);
 
 	int n = __sync_sub_and_fetch(&server->nb_attached_locks, 1);
@@ -1097,6 +1651,59 @@ static int do_liblock_destroy_lock(rcl)(liblock_lock_t* lock) {
 	return 0;
 }
 
+static void* retire_impl(void* arg) {
+	((struct liblock_impl*)arg)->state = IMPL_RETIRED;
+	return 0;
+}
+
+/*
+ * the lock gets a new implementation on the new server, the clients that still use the old one are forwarded.
+ * The old server retires its implementation in a critical section: the previous critical sections are over
+ * and the new server starts once it is done. The mini threads waiting on a condition follow the lock when they
+ * wake up. The old server stays up. Must not be called from a critical section of the lock.
+ */
+static int do_liblock_migrate(rcl)(liblock_lock_t* lock, struct core* core) {
+	struct server*       target = servers[core->core_id];
+	struct liblock_impl* old, *impl;
+
+	pthread_mutex_lock(&migrate_lock);
+
+	old = lock->impl;
+
+	if(old->server == target) {
+		pthread_mutex_unlock(&migrate_lock);
+		return 0;
+	}
+
+	liblock_reserve_core_for(core, lock->lib->lib_name);
+	__sync_fetch_and_add(&target->nb_attached_locks, 1);
+
+	impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
+	impl->server = target;
+	impl->liblock_lock = lock;
+	impl->locked = 0;
+	impl->state = IMPL_STARTING;
+
+	/* the new requests wait on the new server until the old one is drained */
+	lock->impl = impl;
+	lock->r0 = target;
+
+	execute_on(lock, old, retire_impl, old);
+
+	impl->state = IMPL_ACTIVE;
+
+	__sync_fetch_and_sub(&old->server->nb_attached_locks, 1);
+
+	pthread_mutex_unlock(&migrate_lock);
+
+	return 0;
+}
+
+/* rcl and rcl-user servers only differ by their scheduling */
+static int is_rcl_core(struct core* core) {
+	return core->server_type && (!strcmp(core->server_type, "rcl") || !strcmp(core->server_type, "rcl-user"));
+}
+
 static void do_liblock_run(rcl)(void (*callback)()) {
 	int i, n=0;
 
@@ -1104,7 +1711,7 @@ static void do_liblock_run(rcl)(void (*callback)()) {
 		fatal("servers are not managed by hand");
 
 	for(i=0; i<topology->nb_cores; i++) {
-		if(topology->cores[i].server_type && !strcmp(topology->cores[i].server_type, "rcl"))
+		if(is_rcl_core(&topology->cores[i]))
 			n++;
 	}
 
@@ -1113,7 +1720,7 @@ static void do_liblock_run(rcl)(void (*callback)()) {
 	
 	for(i=0; i<topology->nb_cores; i++) {
 		lock_state(servers[i]);
-		if(topology->cores[i].server_type && !strcmp(topology->cores[i].server_type, "rcl")) {
+		if(is_rcl_core(&topology->cores[i])) {
 			//rclprintf(servers[i], "++++ launching: %d from %d", i, sched_getcpu());
 			launch_server(servers[i], --n ? 0 : callback);
 			//rclprintf(servers[i], "++++ launched: %d from %d", i, sched_getcpu());
@@ -1132,7 +1739,17 @@ static void do_liblock_declare_server(rcl)(struct core* core) {
 	}
 }
 
+/* the servers stop scanning the asynchronous slots of the thread once its id is released */
 static void do_liblock_on_thread_exit(rcl)(struct thread_descriptor* desc) {
+	int i, k;
+
+	for(i=0; i<topology->nb_cores; i++) {
+		struct request* row = &servers[i]->async_requests[self.id*ASYNC_SLOTS];
+
+		for(k=0; k<ASYNC_SLOTS; k++)
+			while(row[k].pending)
+				pthread_yield();
+	}
 }
 
 static void do_liblock_on_thread_start(rcl)(struct thread_descriptor* desc) {
@@ -1141,7 +1758,17 @@ static void do_liblock_on_thread_start(rcl)(struct thread_descriptor* desc) {
 	//printf("rcl::thread on core: %d\n", self.id);
 
 	for(i=0; i<topology->nb_cores; i++) {
+		struct request* row = &servers[i]->async_requests[self.id*ASYNC_SLOTS];
+		int k;
+
 		servers[i]->requests[self.id].pending = 0;
+		servers[i]->requests[self.id].parked = 0;
+
+		for(k=0; k<ASYNC_SLOTS; k++) {
+			row[k].pending = 0;
+			row[k].busy = 0;
+			row[k].parked = 0;
+		}
 	}
 
 #ifdef MMM
@@ -1157,23 +1784,29 @@ static void force_shutdown() {
 }
 
 static void do_liblock_init_library(rcl)() {
+	struct timespec now;
 	int i;
 
 	servers = liblock_allocate(sizeof(struct server*) * topology->nb_cores);
 
 	fake_impl.locked = 1;
 
+	init_wait_policy();
+	init_sched_mode();
+
 	for(i=0; i<topology->nb_cores; i++) {
 		struct core* core = &topology->cores[i];
 		int          cid = core->core_id;
 		size_t       request_size = r_align(sizeof(struct request)*id_manager.last, PAGE_SIZE);
+		size_t       async_size   = r_align(sizeof(struct request)*id_manager.last*ASYNC_SLOTS, PAGE_SIZE);
 		size_t       server_size  = r_align(sizeof(struct server), PAGE_SIZE);
-		void*        ptr = anon_mmap_huge(request_size + server_size);
+		void*        ptr = anon_mmap_huge(request_size + async_size + server_size);
 
+		/* the request lines are polled by the server, place them on its node */
+		liblock_bind_mem(ptr, request_size + async_size + server_size, core->node);
         ((uint64_t *)ptr)[0] = 0; // To avoid a page fault later.
-		//liblock_bind_mem(ptr, request_size + server_size, core->node);
 
-		servers[cid] = ptr + request_size;
+		servers[cid] = ptr + request_size + async_size;
 		servers[cid]->core = core;
 
 		servers[cid]->state = SERVER_DOWN;
@@ -1181,9 +1814,10 @@ static void do_liblock_init_library(rcl)() {
 		servers[cid]->nb_free_threads = 0;
 		servers[cid]->nb_ready_and_servicing = 0;
 		servers[cid]->requests = ptr;
+		servers[cid]->async_requests = ptr + request_size;
+		servers[cid]->nb_async = 0;
 
 		servers[cid]->mini_thread_all = 0;
-		servers[cid]->mini_thread_timed = 0;
 		servers[cid]->mini_thread_ready = 0;
 		servers[cid]->mini_thread_prepared = 0;
 
@@ -1191,9 +1825,15 @@ static void do_liblock_init_library(rcl)() {
 		servers[cid]->prepared_threads = 0;
 
 		servers[cid]->timestamp = 1;
+		servers[cid]->sched_mode = sched_mode;
 
 		pthread_mutex_init(&servers[cid]->lock_state, 0);
 		pthread_cond_init(&servers[cid]->cond_state, 0);
+
+		servers[cid]->wheel = liblock_allocate(sizeof(struct timer_wheel));
+		ts_gettimeofday(&now, 0);
+		timer_wheel_init(servers[cid]->wheel, ts_to_tick(&now));
+		pthread_mutex_init(&servers[cid]->wheel_lock, 0);
 	}
 
 	atexit(force_shutdown);
@@ -1211,4 +1851,55 @@ static void do_liblock_kill_library(rcl)() {
 	fatal("implement me");
 }
 
-liblock_declare(rcl);
+liblock_declare(rcl,
+								._execute_async  = do_liblock_execute_async(rcl),
+								._wait           = do_liblock_wait(rcl),
+								._migrate        = do_liblock_migrate(rcl),
+								._execute_inline = do_liblock_execute_inline(rcl),
+								._execute_timed  = do_liblock_execute_timed(rcl));
+
+/*
+ * rcl-user: the same locks, the servers of the cores reserved for rcl-user run as ordinary threads even when the
+ * real-time priorities are allowed
+ */
+static void declare_server_user(struct core* core) {
+	servers[core->core_id]->sched_mode = RCL_SCHED_USER;
+	do_liblock_declare_server(rcl)(core);
+}
+
+/* the library and the threads are initialized by rcl */
+static void init_library_user() {
+}
+
+static void on_thread_user(struct thread_descriptor* desc) {
+}
+
+__attribute__ ((constructor (102))) static void rcl_user_constructor() {
+	static struct liblock_lib lib = {
+		.lib_name           = "rcl-user",
+		.on_thread_start    = on_thread_user,
+		.on_thread_exit     = on_thread_user,
+		.init_library       = init_library_user,
+		.kill_library       = do_liblock_kill_library(rcl),
+		.run                = do_liblock_run(rcl),
+		.declare_server     = declare_server_user,
+		.init_lock          = do_liblock_init_lock(rcl),
+		._execute_operation = do_liblock_execute_operation(rcl),
+		._cond_init         = do_liblock_cond_init(rcl),
+		._cond_wait         = do_liblock_cond_wait(rcl),
+		._cond_timedwait    = do_liblock_cond_timedwait(rcl),
+		._cond_signal       = do_liblock_cond_signal(rcl),
+		._cond_broadcast    = do_liblock_cond_broadcast(rcl),
+		._cond_destroy      = do_liblock_cond_destroy(rcl),
+		._unlock_in_cs      = do_liblock_unlock_in_cs(rcl),
+		._relock_in_cs      = do_liblock_relock_in_cs(rcl),
+		._destroy_lock      = do_liblock_destroy_lock(rcl),
+		._execute_async     = do_liblock_execute_async(rcl),
+		._wait              = do_liblock_wait(rcl),
+		._migrate           = do_liblock_migrate(rcl),
+		._execute_inline    = do_liblock_execute_inline(rcl),
+		._execute_timed     = do_liblock_execute_timed(rcl),
+	};
+
+	liblock_register("rcl-user", &lib);
+}
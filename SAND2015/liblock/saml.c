@@ -1,4 +1,6 @@
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/time.h>
 #include <string.h>
 #include <errno.h>
@@ -11,12 +13,13 @@
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <sys/mman.h>
+#include <dlfcn.h>
 #include "liblock.h"
 #include "liblock-fatal.h"
+#include "clock.h"
+#include "numa_lock.h"
 //#include "fqueue.h"
 
-#include <papi.h>
-
 /*
  *      constants
  */
@@ -26,39 +29,69 @@
 #define SERVER_DOWN     0
 #define SERVER_UP       1
 
-#define MAX_THREAD		256
-
 #define MAX_WAITING_TIME 100000
 #define MAX_SERVING_TIME MAX_WAITING_TIME
 
-int counter_bound = 1000;
-
-/*
- * Default SAML instance maximum number in evaluation
- */
-#define NB_POOLSIZE		20
+#define SAML_MODE_ADAPTIVE 0
+#define SAML_MODE_MCS      1 /* always code-based */
+#define SAML_MODE_SERVER   2 /* always migration, non-NUMA */
+#define SAML_MODE_NUMA     3 /* always migration, NUMA-aware */
 
 #define mb()    asm volatile("mfence":::"memory")
 #define likely(x) __builtin_expect(!!(x),1)
 #define unlikely(x) __builtin_expect(!!(x),0)
 
 /*
- * NODE topology definition
- * For a machine with four 10-core intel Xeon cpu
- * Can be detected automatically in do_liblock_init_lock(saml)
+ *  structures
  */
-#define NODE_NUM		4
-
-int node_distance[4][4] = { { 10, 20, 20, 20 }, { 20, 10, 20, 20 }, { 20, 20,
-		10, 20 }, { 20, 20, 20, 10 } };
 
 /*
- *  structures
+ * Thresholds of the adaptation, expressed in ratio r = delay between two critical sections / critical section
+ * length. The defaults were fitted on a 40-core Xeon, microbenchmark/calibrate_SANL.sh fits them for the host
+ * and writes a profile file loaded at startup (LIBLOCK_SAML_PROFILE, by default saml-<hostname>.profile in the
+ * directory of liblock.so, never in the working directory of the application).
  */
+struct saml_policy {
+	double spin_ratio;      /* above: vote for the code-based mode */
+	double nonspin_ratio;   /* under: withdraw the code-based vote */
+	double numa_ratio;      /* under: vote for the NUMA-aware migration */
+	double nonnuma_ratio;   /* above: withdraw the NUMA-aware vote */
+	double bound_ratio;     /* above (without code-based vote): double counter_bound */
+	double low_ratio;       /* under: the server stops as soon as it is idle */
+	double down_a;          /* server_down_threshold = down_a*r*r + down_b*r + down_c for 1 < r < spin_ratio */
+	double down_b;
+	double down_c;
+	int    down_low;        /* server_down_threshold for low_ratio <= r <= 1 */
+	int    down_high;       /* server_down_threshold for r >= spin_ratio */
+	int    spin_count;      /* consecutive observations needed to vote */
+	int    numa_count;
+	int    nonnuma_count;
+};
+
+static struct saml_policy policy = {
+	.spin_ratio    = 18,
+	.nonspin_ratio = 5,
+	.numa_ratio    = 1,
+	.nonnuma_ratio = 0.8,
+	.bound_ratio   = 15,
+	.low_ratio     = 0.2,
+	.down_a        = -3.2026,
+	.down_b        = 125,
+	.down_c        = -172.81,
+	.down_low      = 10,
+	.down_high     = 10000,
+	.spin_count    = 10,
+	.numa_count    = 5000,
+	.nonnuma_count = 10,
+};
+
+static int saml_mode = SAML_MODE_ADAPTIVE;
+static int print_stats = 0;
 struct request {
 	void* volatile val; /* argument of the pending request */
 	void* (* volatile pending)(void*); /* pending request or null if no pending request */
-	char pad[pad_to_cache_line(2 * sizeof(void*))];
+	char payload[LIBLOCK_INLINE_SIZE]; /* inlined argument, val points to it (liblock_exec_inline) */
+	char pad[pad_to_cache_line(2 * sizeof(void*) + LIBLOCK_INLINE_SIZE)];
 	int cond_wait;
 	char pad2[pad_to_cache_line(sizeof(int))];
 };
@@ -78,27 +111,29 @@ struct liblock_profile {
 	int nonspin_counter;
 	int nonnuma_counter;
 	int numa_counter;
+	int volatile spin_vote; /* the core votes for the code-based mode */
+	int volatile numa_vote; /* the core votes for the NUMA-aware migration */
+};
+
+/*
+ * A lock only keeps two cache lines. The profiles, the servers and their request arrays are allocated when a
+ * thread first finds the lock taken, a server and its requests when its core is first nominated.
+ */
+struct saml_cold {
+	struct liblock_profile* profile_datas; /* profiling data, one per core */
+	struct server* volatile* servers; /* one per core, 0 until the core is nominated */
+	int* node_lock; /* NUMA-aware signal to check if a near core is a server, one per node */
 };
 
 struct liblock_impl {
-	pthread_mutex_t glock;
-	char pad[pad_to_cache_line(sizeof(pthread_mutex_t))];
-	struct server** servers; /* request arrays */
-	char pad2[pad_to_cache_line(sizeof(struct server**))];
+	struct mcs_node* volatile tail; /* Combined code-based lock */
+	char pad[pad_to_cache_line(sizeof(void*))];
+	struct saml_cold* volatile cold; /* 0 while the lock is not contended */
 	int contention_num; /* Signal for sudden low contention */
 	int spin_global_vote;
 	int numa_global_vote;
-	struct liblock_profile* profile_datas; /* profiling data */
-	char pad3[pad_to_cache_line(
-			3 * sizeof(int) + sizeof(struct liblock_profile*))];
-	int spin_local_vote[MAX_THREAD];
-	int numa_local_vote[MAX_THREAD];
-	char pad4[pad_to_cache_line(2 * MAX_THREAD * sizeof(int))];
-	struct mcs_node* volatile tail; /* Combined code-based lock */
-	char pad5[pad_to_cache_line(sizeof(void*))];
-	int node_lock[NODE_NUM]; /* NUMA-aware signal to check if a near core is a server */
-	char pad6[pad_to_cache_line(NODE_NUM * sizeof(int))];
-
+	int volatile counter_bound; /* self-tuned bound of the code-based withdrawal */
+	char pad2[pad_to_cache_line(4 * sizeof(int) + sizeof(void*))];
 };
 
 struct server {
@@ -112,8 +147,7 @@ struct server {
 	char pad1[pad_to_cache_line(2 * sizeof(void*))];
 };
 
-static struct server*** servers_pool = 0; /* array of array of server (one per core) */
-static int servers_pool_index = 0;
+static struct server no_server = { .state = SERVER_DOWN }; /* lock->r0 before the first nomination */
 static int thread_num = 0; /* global thread number using SAML */
 
 __thread struct mcs_node* my_node_saml = 0;
@@ -180,142 +214,228 @@ static void unlock_mcs(struct liblock_impl* impl) {
  *   SAML API
  */
 static int is_near_node(int node1, int node2) {
-	if (node_distance[node1][node2] < 20) {
-		return 1;
+	return topology->distances[node1 * topology->nb_nodes + node2]
+			< 2 * topology->distances[node1 * topology->nb_nodes + node1];
+}
+
+/* a lost update only delays the tuning, the bound is not shared between locks */
+static void tune_counter_bound(struct liblock_impl* impl, int up) {
+	int bound = impl->counter_bound;
+
+	if (up ? bound < 10000000 : bound > 100)
+		__sync_bool_compare_and_swap(&impl->counter_bound, bound,
+				up ? bound * 2 : bound / 2);
+}
+
+static void profile_end(struct liblock_profile* profile) {
+	profile->cycles_e = liblock_clock_cycles_end();
+	profile->lib_exe =
+			(profile->lib_exe == 0) ?
+					(profile->cycles_e - profile->cycles_b) :
+					(profile->cycles_e - profile->cycles_b + profile->lib_exe)
+							/ 2;
+}
+
+/* no thread uses the lock anymore, in particular no server runs */
+static void free_cold(struct saml_cold* cold) {
+	size_t request_size = r_align(sizeof(struct request) * id_manager.last,
+			PAGE_SIZE);
+	size_t server_size = r_align(sizeof(struct server), PAGE_SIZE);
+	int i;
+
+	for (i = 0; i < topology->nb_cores; i++)
+		if (cold->servers[i])
+			munmap(cold->servers[i]->requests, request_size + server_size);
+
+	free((void*) cold->servers);
+	free(cold->profile_datas);
+	free(cold->node_lock);
+	free(cold);
+}
+
+/* the lock is contended for the first time */
+static struct saml_cold* make_cold(struct liblock_impl* impl) {
+	struct saml_cold* cold = liblock_allocate(sizeof(struct saml_cold));
+
+	cold->profile_datas = liblock_allocate(
+			sizeof(struct liblock_profile) * topology->nb_cores);
+	memset(cold->profile_datas, 0,
+			sizeof(struct liblock_profile) * topology->nb_cores);
+
+	cold->servers = liblock_allocate(sizeof(struct server*) * topology->nb_cores);
+	memset((void*) cold->servers, 0, sizeof(struct server*) * topology->nb_cores);
+
+	cold->node_lock = liblock_allocate(sizeof(int) * topology->nb_nodes);
+	memset(cold->node_lock, 0, sizeof(int) * topology->nb_nodes);
+
+	if (!__sync_bool_compare_and_swap(&impl->cold, 0, cold)) {
+		free_cold(cold);
+		cold = impl->cold;
 	}
-	return 0;
+
+	return cold;
 }
 
-static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
-		void* (*pending)(void*), void* val) {
+/* the server of the core, created on its first nomination (the caller holds the code-based lock) */
+static struct server* own_server(struct saml_cold* cold) {
+	struct core* core = self.running_core;
+	struct server* server = cold->servers[core->core_id];
+
+	if (!server) {
+		size_t request_size = r_align(
+				sizeof(struct request) * id_manager.last, PAGE_SIZE);
+		size_t server_size = r_align(sizeof(struct server), PAGE_SIZE);
+		void* ptr = anon_mmap(request_size + server_size);
+
+		liblock_bind_mem(ptr, request_size + server_size, core->node);
+
+		server = ptr + request_size;
+		server->core = core;
+		server->state = SERVER_DOWN;
+		server->requests = ptr;
+
+		cold->servers[core->core_id] = server;
+	}
+
+	return server;
+}
+
+/* size is the size of the argument copied in the request, 0 to pass val as is */
+static void* execute(liblock_lock_t* lock, void* (*pending)(void*), void* val,
+		size_t size) {
 	struct liblock_impl* impl = lock->impl;
-	int core_id = self.running_core->core_id;
+	struct saml_cold* cold = impl->cold;
+	struct liblock_profile* profile;
 	int server_down_threshold = 1;
 	double cs_ratio = 0;
 	double cs_ratio_1 = 0;
 
 	void* res;
 
+	/* Uncontended lock: no profiling */
+	if (!cold) {
+		if (!trylock_mcs(impl)) {
+			res = pending(val);
+			unlock_mcs(impl);
+			return res;
+		}
+		cold = make_cold(impl);
+	}
+
+	profile = &cold->profile_datas[self.running_core->core_id];
+
 	/* Collect execution info */
-	impl->profile_datas[core_id].cycles_b = PAPI_get_real_cyc();
+	profile->cycles_b = liblock_clock_cycles();
 
-	impl->profile_datas[core_id].lib_delay =
-			impl->profile_datas[core_id].cycles_b
-					- impl->profile_datas[core_id].cycles_e;
+	profile->lib_delay = profile->cycles_b - profile->cycles_e;
 
 	/* Compute server_down_threshold from server downgrading threshold adaptive function */
-	if (impl->profile_datas[core_id].lib_exe != 0) {
+	if (profile->lib_exe != 0) {
 		if (cs_ratio == 0) {
-			cs_ratio = impl->profile_datas[core_id].lib_exe * 1.0
-					/ impl->profile_datas[core_id].lib_delay;
+			cs_ratio = profile->lib_exe * 1.0 / profile->lib_delay;
 			cs_ratio_1 = (1 / cs_ratio + cs_ratio_1) / 2;
 		} else {
 			cs_ratio = (cs_ratio
-					+ impl->profile_datas[core_id].lib_exe * 1.0
-							/ impl->profile_datas[core_id].lib_delay) / 2;
+					+ profile->lib_exe * 1.0
+							/ profile->lib_delay) / 2;
 			cs_ratio_1 = (1 / cs_ratio + cs_ratio_1) / 2;
 		}
 
-		/* server downgrading threshold adaptive function for Xeon machine */
-		if (cs_ratio_1 > 1 && cs_ratio_1 < 18) {
-			server_down_threshold = -3.2026 * cs_ratio_1 * cs_ratio_1
-					+ 125 * cs_ratio_1 - 172.81;
+		/* server downgrading threshold adaptive function */
+		if (cs_ratio_1 > 1 && cs_ratio_1 < policy.spin_ratio) {
+			server_down_threshold = policy.down_a * cs_ratio_1 * cs_ratio_1
+					+ policy.down_b * cs_ratio_1 + policy.down_c;
 			if (server_down_threshold < 1)
 				server_down_threshold = 1;
-		} else if (cs_ratio_1 >= 18) {
-			server_down_threshold = 10000;
-		} else if (cs_ratio_1 <= 1 && cs_ratio_1 >= 0.2) {
-			server_down_threshold = 10;
+		} else if (cs_ratio_1 >= policy.spin_ratio) {
+			server_down_threshold = policy.down_high;
+		} else if (cs_ratio_1 <= 1 && cs_ratio_1 >= policy.low_ratio) {
+			server_down_threshold = policy.down_low;
 		} else {
 			server_down_threshold = 1;
 		}
 
-		if (impl->spin_local_vote[self.id] == 0) {
-			if (cs_ratio_1 >= 18) {
-				impl->profile_datas[core_id].spin_counter++;
-				if (impl->profile_datas[core_id].spin_counter > 10) {
-					impl->spin_local_vote[self.id] = 1;
-					__sync_fetch_and_add(&impl->spin_global_vote, 1);
+		if (profile->spin_vote == 0) {
+			if (cs_ratio_1 >= policy.spin_ratio) {
+				profile->spin_counter++;
+				if (profile->spin_counter
+						> policy.spin_count) {
+					if (__sync_bool_compare_and_swap(&profile->spin_vote, 0, 1))
+						__sync_fetch_and_add(&impl->spin_global_vote, 1);
 					mb();
-					impl->profile_datas[core_id].spin_counter = 0;
+					profile->spin_counter = 0;
 				}
 			} else {
-				if (impl->profile_datas[core_id].spin_counter > 0)
-					impl->profile_datas[core_id].spin_counter--;
+				if (profile->spin_counter > 0)
+					profile->spin_counter--;
 			}
 		} else {
-			if (cs_ratio_1 < 5) {
-				impl->profile_datas[core_id].nonspin_counter++;
-				if (impl->profile_datas[core_id].nonspin_counter
-						> counter_bound) {
-					impl->spin_local_vote[self.id] = 0;
-					__sync_fetch_and_add(&impl->spin_global_vote, -1);
+			if (cs_ratio_1 < policy.nonspin_ratio) {
+				profile->nonspin_counter++;
+				if (profile->nonspin_counter
+						> impl->counter_bound) {
+					if (__sync_bool_compare_and_swap(&profile->spin_vote, 1, 0))
+						__sync_fetch_and_add(&impl->spin_global_vote, -1);
 					mb();
-					impl->profile_datas[core_id].nonspin_counter = 0;
+					profile->nonspin_counter = 0;
 				}
 			} else {
-				if (impl->profile_datas[core_id].nonspin_counter > 0)
-					impl->profile_datas[core_id].nonspin_counter--;
+				if (profile->nonspin_counter > 0)
+					profile->nonspin_counter--;
 			}
 		}
 
 		/* tuning for counter_bound */
-		if ((cs_ratio_1 > 15 && impl->spin_local_vote[self.id] == 0)
-				|| (cs_ratio_1 > 5 && impl->spin_local_vote[self.id] == 1)) {
-			if (counter_bound < 10000000)
-				counter_bound *= 2;
-		} else {
-			if (counter_bound > 100)
-				counter_bound /= 2;
-		}
-
-		if (impl->numa_local_vote[self.id] == 1) {
-			if (cs_ratio_1 >= 0.8) {
-				impl->profile_datas[core_id].nonnuma_counter++;
-				if (impl->profile_datas[core_id].nonnuma_counter > 10) {
-					impl->numa_local_vote[self.id] = 0;
-					__sync_fetch_and_add(&impl->numa_global_vote, 1);
+		tune_counter_bound(impl,
+				(cs_ratio_1 > policy.bound_ratio
+						&& profile->spin_vote == 0)
+						|| (cs_ratio_1 > policy.nonspin_ratio
+								&& profile->spin_vote == 1));
+
+		if (profile->numa_vote == 1) {
+			if (cs_ratio_1 >= policy.nonnuma_ratio) {
+				profile->nonnuma_counter++;
+				if (profile->nonnuma_counter
+						> policy.nonnuma_count) {
+					if (__sync_bool_compare_and_swap(&profile->numa_vote, 1, 0))
+						__sync_fetch_and_add(&impl->numa_global_vote, 1);
 					mb();
-					impl->profile_datas[core_id].nonnuma_counter = 0;
+					profile->nonnuma_counter = 0;
 				}
 			} else {
-				if (impl->profile_datas[core_id].nonnuma_counter > 0)
-					impl->profile_datas[core_id].nonnuma_counter--;
+				if (profile->nonnuma_counter > 0)
+					profile->nonnuma_counter--;
 			}
 		} else {
-			if (cs_ratio_1 < 1) {
-				impl->profile_datas[core_id].numa_counter++;
-				if (impl->profile_datas[core_id].numa_counter > 5000) {
-					impl->numa_local_vote[self.id] = 1;
-					__sync_fetch_and_add(&impl->numa_global_vote, -1);
+			if (cs_ratio_1 < policy.numa_ratio) {
+				profile->numa_counter++;
+				if (profile->numa_counter
+						> policy.numa_count) {
+					if (__sync_bool_compare_and_swap(&profile->numa_vote, 0, 1))
+						__sync_fetch_and_add(&impl->numa_global_vote, -1);
 					mb();
-					impl->profile_datas[core_id].numa_counter = 0;
+					profile->numa_counter = 0;
 				}
 			} else {
-				if (impl->profile_datas[core_id].numa_counter > 0)
-					impl->profile_datas[core_id].numa_counter--;
+				if (profile->numa_counter > 0)
+					profile->numa_counter--;
 			}
 		}
 
 	}
 
 	/* Adaptation between code-based and migration modes */
-	if ((impl->spin_global_vote > (thread_num - 5) / 2)
-			|| (thread_num - 1) < 4) {
+	if (saml_mode == SAML_MODE_MCS
+			|| (saml_mode == SAML_MODE_ADAPTIVE
+					&& ((impl->spin_global_vote > (thread_num - 5) / 2)
+							|| (thread_num - 1) < 4))) {
 		lock_mcs(impl);
 
 		res = pending(val);
 
 		unlock_mcs(impl);
 
-		impl->profile_datas[core_id].cycles_e = PAPI_get_real_cyc();
-		impl->profile_datas[core_id].lib_exe =
-				(impl->profile_datas[core_id].lib_exe == 0) ?
-						(impl->profile_datas[core_id].cycles_e
-								- impl->profile_datas[core_id].cycles_b) :
-						(impl->profile_datas[core_id].cycles_e
-								- impl->profile_datas[core_id].cycles_b
-								+ impl->profile_datas[core_id].lib_exe) / 2;
+		profile_end(profile);
 		return res;
 	}
 
@@ -336,14 +456,7 @@ static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
 		unlock_mcs(impl);
 		__sync_fetch_and_add(&impl->contention_num, -1);
 
-		impl->profile_datas[core_id].cycles_e = PAPI_get_real_cyc();
-		impl->profile_datas[core_id].lib_exe =
-				(impl->profile_datas[core_id].lib_exe == 0) ?
-						(impl->profile_datas[core_id].cycles_e
-								- impl->profile_datas[core_id].cycles_b) :
-						(impl->profile_datas[core_id].cycles_e
-								- impl->profile_datas[core_id].cycles_b
-								+ impl->profile_datas[core_id].lib_exe) / 2;
+		profile_end(profile);
 		return res;
 	}
 
@@ -362,22 +475,15 @@ static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
 
 		reget_server2:
 
-		impl->profile_datas[core_id].cycles_e = PAPI_get_real_cyc();
-		impl->profile_datas[core_id].lib_exe =
-				(impl->profile_datas[core_id].lib_exe == 0) ?
-						(impl->profile_datas[core_id].cycles_e
-								- impl->profile_datas[core_id].cycles_b) :
-						(impl->profile_datas[core_id].cycles_e
-								- impl->profile_datas[core_id].cycles_b
-								+ impl->profile_datas[core_id].lib_exe) / 2;
+		profile_end(profile);
 
 		struct server* server;
 
 		/* Stop former server */
-		if (lock->r0 != impl->servers[self.running_core->core_id]) {
+		if (lock->r0 != own_server(cold)) {
 			server = lock->r0;
 			server->state = SERVER_DOWN;
-			lock->r0 = impl->servers[self.running_core->core_id];
+			lock->r0 = own_server(cold);
 			mb();
 		}
 
@@ -385,8 +491,9 @@ static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
 
 		server->state = SERVER_UP;
 
-		struct request* request, *last;
+		struct request* request;
 		void* (*pending_r)(void*);
+		unsigned int k;
 		pending_r = 0;
 		int req_num = 0;
 		int waiting_loop_num = 0;
@@ -394,10 +501,11 @@ static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
 
 		/* Iteratively serve requests of clients */
 		while (server->state == SERVER_UP) {
-			last = &server->requests[id_manager.first_free];
+			unsigned int* ids = liblock_active_ids.ids;
+			unsigned int nb_ids = liblock_active_ids.nb;
 
-			for (request = &server->requests[id_manager.first]; request < last;
-					request++) {
+			for (k = 0; k < nb_ids; k++) {
+				request = &server->requests[ids[k]];
 				pending_r = request->pending;
 
 				if (pending_r) {
@@ -440,22 +548,24 @@ static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
 		int self_node_id = self.running_core->node->node_id;
 		int server_node_id = 0;
 
-		while (impl->numa_local_vote[self.id]
-				&& (40 - impl->numa_global_vote) > (thread_num / 2)
+		while ((saml_mode == SAML_MODE_NUMA
+				|| (saml_mode == SAML_MODE_ADAPTIVE
+						&& profile->numa_vote
+						&& (topology->nb_cores - impl->numa_global_vote)
+								> (thread_num / 2)))
 				&& ((struct server*) lock->r0)->state == SERVER_UP
 				&& !is_near_node(
 						((struct server*) lock->r0)->core->node->node_id,
 						self_node_id)) {
-			server_node_id =
-					impl->node_lock[((struct server*) lock->r0)->core->node->node_id];
+			server_node_id = ((struct server*) lock->r0)->core->node->node_id;
 
 			client_wait_time++;
 			if (unlikely(client_wait_time > MAX_WAITING_TIME)) {
 				if (__sync_val_compare_and_swap(
-						&impl->node_lock[server_node_id], 0, 1) == 0) {
+						&cold->node_lock[server_node_id], 0, 1) == 0) {
 					self.isclient = 0;
 					lock_mcs(impl);
-					impl->node_lock[server_node_id] = 0;
+					cold->node_lock[server_node_id] = 0;
 					goto reget_server1;
 				} else {
 					client_wait_time = 0;
@@ -477,7 +587,11 @@ static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
 		server = lock->r0;
 		req = &(server->requests[self.id]);
 
-		req->val = val;
+		if (size) {
+			memcpy(req->payload, val, size);
+			req->val = req->payload;
+		} else
+			req->val = val;
 		req->pending = pending;
 
 		while (req->pending) {
@@ -495,6 +609,8 @@ static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
 								goto reget_server1;
 							} else {
 								__sync_fetch_and_add(&impl->contention_num, 1);
+								if (size)
+									memcpy(val, req->payload, size);
 								res = req->val;
 								goto reget_server2;
 							}
@@ -514,6 +630,8 @@ static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
 							goto reget_server1;
 						} else {
 							__sync_fetch_and_add(&impl->contention_num, 1);
+							if (size)
+								memcpy(val, req->payload, size);
 							res = req->val;
 
 							goto reget_server2;
@@ -530,91 +648,84 @@ static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
 		}
 		self.isclient = 1;
 
-		impl->profile_datas[core_id].cycles_e = PAPI_get_real_cyc();
-		impl->profile_datas[core_id].lib_exe =
-				(impl->profile_datas[core_id].lib_exe == 0) ?
-						(impl->profile_datas[core_id].cycles_e
-								- impl->profile_datas[core_id].cycles_b) :
-						(impl->profile_datas[core_id].cycles_e
-								- impl->profile_datas[core_id].cycles_b
-								+ impl->profile_datas[core_id].lib_exe) / 2;
+		profile_end(profile);
+		if (size)
+			memcpy(val, req->payload, size);
 		return req->val;
 	}
 }
 
-static void destroy_server(struct server* server) {
-	if (server->state == SERVER_UP) {
-		server->state = SERVER_DOWN;
-	}
-}
-
-static int do_liblock_cond_signal(saml)(liblock_cond_t* cond) {
-	return pthread_cond_signal(&cond->impl.posix_cond);
+static void* do_liblock_execute_operation(saml)(liblock_lock_t* lock,
+		void* (*pending)(void*), void* val) {
+	return execute(lock, pending, val, 0);
 }
 
-static int do_liblock_cond_broadcast(saml)(liblock_cond_t* cond) {
-	return pthread_cond_broadcast(&cond->impl.posix_cond);
+static void* do_liblock_execute_inline(saml)(liblock_lock_t* lock,
+		void* (*pending)(void*), void* ctx, size_t size) {
+	return execute(lock, pending, ctx, size <= LIBLOCK_INLINE_SIZE ? size : 0);
 }
 
-static int do_liblock_cond_timedwait(saml)(liblock_cond_t* cond,
-		liblock_lock_t* lock, const struct timespec* ts) {
+/* the servers hold the MCS lock while they execute, the request is never posted to them and is not profiled */
+static int do_liblock_execute_timed(saml)(liblock_lock_t* lock,
+		void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
 	struct liblock_impl* impl = lock->impl;
 
-	struct server* server = lock->r0;
-
-	pthread_mutex_lock(&impl->glock);
+	while (trylock_mcs(impl)) {
+		if (liblock_clock_expired(deadline))
+			return EBUSY;
+		PAUSE();
+	}
 
-	server->state = SERVER_DOWN;
+	*res = pending(val);
 
 	unlock_mcs(impl);
 
-	int res = pthread_cond_timedwait(&cond->impl.posix_cond, &impl->glock, ts);
-
-	pthread_mutex_unlock(&impl->glock);
-
-	lock_mcs(impl);
-
-	server->state = SERVER_UP;
+	return 0;
+}
 
-	if (lock->r0 != &impl->servers[self.running_core->core_id]) {
-		server = lock->r0;
-		server->state = SERVER_DOWN;
-		lock->r0 = impl->servers[self.running_core->core_id];
-		mb();
-	}
+static int do_liblock_cond_signal(saml)(liblock_cond_t* cond) {
+	return numa_lock_cond_wake(cond, pthread_cond_signal);
+}
 
-	return res;
+static int do_liblock_cond_broadcast(saml)(liblock_cond_t* cond) {
+	return numa_lock_cond_wake(cond, pthread_cond_broadcast);
 }
 
-static int do_liblock_cond_wait(saml)(liblock_cond_t* cond,
-		liblock_lock_t* lock) {
+/* the clients wait for a new nomination, the waiter is nominated again when its critical section ends */
+static int cond_timedwait(liblock_cond_t* cond, liblock_lock_t* lock,
+		const struct timespec* ts) {
 	struct liblock_impl* impl = lock->impl;
+	pthread_mutex_t* stripe = numa_lock_cond_stripe(cond);
+	int res;
 
-	struct server* server = lock->r0;
-
-	pthread_mutex_lock(&impl->glock);
+	pthread_mutex_lock(stripe);
 
-	server->state = SERVER_DOWN;
+	((struct server*) lock->r0)->state = SERVER_DOWN;
 
 	unlock_mcs(impl);
 
-	int res = pthread_cond_wait(&cond->impl.posix_cond, &impl->glock);
+	if (ts)
+		res = pthread_cond_timedwait(&cond->impl.posix_cond, stripe, ts);
+	else
+		res = pthread_cond_wait(&cond->impl.posix_cond, stripe);
 
-	pthread_mutex_unlock(&impl->glock);
+	pthread_mutex_unlock(stripe);
 
 	lock_mcs(impl);
 
-	server->state = SERVER_UP;
-
-	if (lock->r0 != &impl->servers[self.running_core->core_id]) {
-		server = lock->r0;
-		server->state = SERVER_DOWN;
-		lock->r0 = impl->servers[self.running_core->core_id];
-		mb();
-	}
 	return res;
 }
 
+static int do_liblock_cond_timedwait(saml)(liblock_cond_t* cond,
+		liblock_lock_t* lock, const struct timespec* ts) {
+	return cond_timedwait(cond, lock, ts);
+}
+
+static int do_liblock_cond_wait(saml)(liblock_cond_t* cond,
+		liblock_lock_t* lock) {
+	return cond_timedwait(cond, lock, 0);
+}
+
 static int do_liblock_cond_init(saml)(liblock_cond_t* cond) {
 	return cond->has_attr ?
 			pthread_cond_init(&cond->impl.posix_cond, &cond->attr) :
@@ -625,79 +736,59 @@ static int do_liblock_cond_destroy(saml)(liblock_cond_t* cond) {
 	return pthread_cond_destroy(&cond->impl.posix_cond);
 }
 
+/* as in a wait, a nominated server stops serving once the critical section is over */
 static void do_liblock_unlock_in_cs(saml)(liblock_lock_t* lock) {
-}
-
-static void do_liblock_relock_in_cs(saml)(liblock_lock_t* lock) {
-}
-
-static void liblock_init_lock_servers(struct liblock_impl* impl) {
-	int pool_index = __sync_fetch_and_add(&servers_pool_index, 1);
+	((struct server*) lock->r0)->state = SERVER_DOWN;
 
-	if (pool_index > NB_POOLSIZE) {
-		fatal("SAML instance number overflow");
-	}
-
-	impl->servers = servers_pool[pool_index];
+	unlock_mcs(lock->impl);
 }
 
-static void liblock_init_lock_profile_datas(struct liblock_impl* impl) {
-	int i;
-
-	impl->profile_datas = liblock_allocate(
-			sizeof(struct liblock_profile) * topology->nb_cores);
-
-	struct liblock_profile* init_datas = impl->profile_datas;
-
-	for (i = 0; i < topology->nb_cores; i++) {
-		init_datas[i].cycles_b = 0;
-		init_datas[i].cycles_e = 0;
-		init_datas[i].lib_delay = 0;
-		init_datas[i].lib_exe = 0;
-		init_datas[i].spin_counter = 0;
-		init_datas[i].nonspin_counter = 0;
-		init_datas[i].nonnuma_counter = 0;
-		init_datas[i].numa_counter = 0;
-	}
+static void do_liblock_relock_in_cs(saml)(liblock_lock_t* lock) {
+	lock_mcs(lock->impl);
 }
 
 static struct liblock_impl* do_liblock_init_lock(saml)(liblock_lock_t* lock,
 		struct core* core, pthread_mutexattr_t* attr) {
-	struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
-
-	liblock_init_lock_servers(impl);
-	struct server* server = impl->servers[core->core_id];
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
 
-	lock->r0 = server;
+	lock->r0 = &no_server;
 
-	liblock_init_lock_profile_datas(impl);
 	impl->tail = 0;
+	impl->cold = 0;
 	/* default non-NUMA migration mode */
 	impl->spin_global_vote = 0;
-	impl->numa_global_vote = 40;
+	impl->numa_global_vote = topology->nb_cores;
+	impl->counter_bound = 1000;
 
-	int i = 0;
-
-	for (; i < NODE_NUM; i++) {
-		impl->node_lock[i] = 0;
-	}
+	return impl;
+}
 
-	i = 0;
+/* average critical section length and delay seen by the threads, read by calibrate_SANL.sh */
+static void print_profile(struct saml_cold* cold) {
+	long exe = 0, delay = 0;
+	int i, n = 0;
 
-	for (; i < MAX_THREAD; i++) {
-		impl->spin_local_vote[i] = 0;
-		impl->numa_local_vote[i] = 0;
+	for (i = 0; i < topology->nb_cores; i++) {
+		if (cold->profile_datas[i].lib_exe) {
+			exe += cold->profile_datas[i].lib_exe;
+			delay += cold->profile_datas[i].lib_delay;
+			n++;
+		}
 	}
 
-	pthread_mutex_init(&impl->glock, NULL);
-
-	return impl;
+	if (n)
+		fprintf(stdout, "--- saml lib_exe %ld lib_delay %ld\n", exe / n,
+				delay / n);
 }
 
 static int do_liblock_destroy_lock(saml)(liblock_lock_t* lock) {
-	struct server* server = lock->r0;
+	struct saml_cold* cold = lock->impl->cold;
 
-	destroy_server(server);
+	if (cold) {
+		if (print_stats)
+			print_profile(cold);
+		free_cold(cold);
+	}
 
 	return 0;
 }
@@ -719,39 +810,82 @@ static void do_liblock_on_thread_start(saml)(struct thread_descriptor* desc) {
 	my_node_saml = anon_mmap(r_align(sizeof(struct mcs_node), PAGE_SIZE));
 }
 
-static void do_liblock_init_library(saml)() {
-	servers_pool = liblock_allocate(sizeof(struct server**) * NB_POOLSIZE);
-	int pool_i;
-	int i;
-	for (pool_i = 0; pool_i < NB_POOLSIZE; pool_i++) {
-		servers_pool[pool_i] = liblock_allocate(
-				sizeof(struct server*) * topology->nb_cores);
-
-		struct server** init_servers = servers_pool[pool_i];
-
-		for (i = 0; i < topology->nb_cores; i++) {
-			struct core* core = &topology->cores[i];
-			int cid = core->core_id;
-			size_t request_size = r_align(sizeof(struct request) * MAX_THREAD,
-					PAGE_SIZE);
-			size_t server_size = r_align(sizeof(struct server), PAGE_SIZE);
-			void* ptr = anon_mmap_huge(request_size + server_size);
+/* "key value" lines, # starts a comment, unknown keys are fatal */
+static void load_policy() {
+	const char* path = getenv("LIBLOCK_SAML_PROFILE");
+	const char* slash;
+	char        host[256], file[1024], buf[1024], key[64];
+	double      value;
+	FILE*       f;
+	Dl_info     info;
+
+	if (!path) {
+		if (gethostname(host, sizeof(host)))
+			return;
+		host[sizeof(host) - 1] = 0;
+		if (!dladdr((void*)load_policy, &info) || !info.dli_fname || !(slash = strrchr(info.dli_fname, '/')))
+			return;
+		snprintf(file, sizeof(file), "%.*s/saml-%s.profile", (int)(slash - info.dli_fname), info.dli_fname, host);
+		path = file;
+	}
 
-			memset(ptr, 0, request_size + server_size);
-			((uint64_t *) ptr)[0] = 0; // To avoid a page fault later.
+	if (!(f = fopen(path, "r"))) {
+		if (getenv("LIBLOCK_SAML_PROFILE"))
+			fatal("unable to open %s: %s", path, strerror(errno));
+		return;
+	}
 
-			init_servers[cid] = ptr + request_size;
-			init_servers[cid]->core = core;
+	while (fgets(buf, sizeof(buf), f)) {
+		if (sscanf(buf, "%63s %lf", key, &value) != 2 || key[0] == '#')
+			continue;
+#define saml_key(name) else if (!strcmp(key, #name)) policy.name = value
+		if (0)
+			;
+		saml_key(spin_ratio);
+		saml_key(nonspin_ratio);
+		saml_key(numa_ratio);
+		saml_key(nonnuma_ratio);
+		saml_key(bound_ratio);
+		saml_key(low_ratio);
+		saml_key(down_a);
+		saml_key(down_b);
+		saml_key(down_c);
+		saml_key(down_low);
+		saml_key(down_high);
+		saml_key(spin_count);
+		saml_key(numa_count);
+		saml_key(nonnuma_count);
+#undef saml_key
+		else
+			fatal("%s: unknown SAML parameter %s", path, key);
+	}
 
-			init_servers[cid]->state = SERVER_DOWN;
-			init_servers[cid]->requests = ptr;
-		}
+	fclose(f);
+}
 
-	}
+static void do_liblock_init_library(saml)() {
+	const char* mode = getenv("LIBLOCK_SAML_MODE");
+
+	if (!mode || !strcmp(mode, "adaptive"))
+		saml_mode = SAML_MODE_ADAPTIVE;
+	else if (!strcmp(mode, "mcs"))
+		saml_mode = SAML_MODE_MCS;
+	else if (!strcmp(mode, "server"))
+		saml_mode = SAML_MODE_SERVER;
+	else if (!strcmp(mode, "numa"))
+		saml_mode = SAML_MODE_NUMA;
+	else
+		fatal("unknown SAML mode: %s", mode);
+
+	print_stats = getenv("LIBLOCK_SAML_STATS") != 0;
+
+	load_policy();
 }
 
 static void do_liblock_kill_library(saml)() {
 	fatal("implement me");
 }
 
-liblock_declare(saml);
+liblock_declare(saml,
+		._execute_inline = do_liblock_execute_inline(saml),
+		._execute_timed = do_liblock_execute_timed(saml));
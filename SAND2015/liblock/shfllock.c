@@ -0,0 +1,256 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "liblock.h"
+#include "liblock-fatal.h"
+#include "numa_lock.h"
+#include "clock.h"
+
+/*
+ * Shuffle lock, see
+ * [1] Sanidhya Kashyap, Irina Calciu, Xiaohan Cheng, Changwoo Min, Taesoo Kim:
+ *     Scalable and practical locking with shuffling.
+ *     SOSP 2019: 586-599
+ *
+ * A test-and-set lock word in front of an MCS queue. A thread first tries to steal the lock word, then waits in the
+ * queue. The waiter at the head of the queue spins on the lock word and, while the owner is in its critical section,
+ * moves the waiters of its node just behind itself, so that the lock is then passed inside the node. A moved waiter
+ * carries a batch count, a head waiter whose batch reached SHFL_MAX_SHUFFLES does not shuffle to let the other nodes
+ * in. As only the head waiter shuffles, the queue has a single shuffler at a time.
+ */
+#define SHFL_MAX_SHUFFLES 1024
+
+#define SHFL_LOCKED       1
+#define SHFL_NO_STEALING  0x100                /* set while the queue is not empty */
+
+struct shfl_node {
+	struct shfl_node* volatile next;
+	int volatile               ready;
+	int                        node_id;
+	int                        batch;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct liblock_impl {
+	unsigned int volatile      glock;
+	struct shfl_node* volatile tail;
+};
+
+static void shuffle_waiters(struct liblock_impl* impl, struct shfl_node* me) {
+	struct shfl_node *prev = me, *last = me, *cur, *next;
+	int batch = me->batch;
+
+	if(!batch)
+		me->batch = ++batch;
+
+	if(batch >= SHFL_MAX_SHUFFLES)
+		return;
+
+	while(impl->glock & SHFL_LOCKED) {
+		cur = prev->next;
+		/* an enqueuer may be linking behind the tail */
+		if(!cur || cur == impl->tail)
+			break;
+
+		if(cur->node_id == me->node_id) {
+			if(prev == last) {
+				cur->batch = ++batch;
+				last = prev = cur;
+			} else {
+				if(!(next = cur->next))
+					break;
+				cur->batch = ++batch;
+				prev->next = next;
+				cur->next = last->next;
+				last->next = cur;
+				last = cur;
+			}
+		} else
+			prev = cur;
+	}
+}
+
+static void lock_shfl(struct liblock_impl* impl) {
+	struct shfl_node  me, *prev, *succ;
+	unsigned int      glock;
+
+	if(!impl->glock && __sync_bool_compare_and_swap(&impl->glock, 0, SHFL_LOCKED))
+		return;
+
+	me.next = 0;
+	me.ready = 0;
+	me.node_id = numa_lock_node_id();
+	me.batch = 0;
+
+	prev = __sync_lock_test_and_set(&impl->tail, &me);
+
+	if(prev) {
+		prev->next = &me;
+		while(!me.ready)
+			PAUSE();
+	} else
+		__sync_fetch_and_or(&impl->glock, SHFL_NO_STEALING);
+
+	/* head of the queue: wait for the owner and group the waiters of the node meanwhile */
+	for(;;) {
+		glock = impl->glock;
+		if(!(glock & SHFL_LOCKED)) {
+			if(__sync_bool_compare_and_swap(&impl->glock, glock, glock | SHFL_LOCKED))
+				break;
+		} else if(me.batch < SHFL_MAX_SHUFFLES) {
+			shuffle_waiters(impl, &me);
+			me.batch = SHFL_MAX_SHUFFLES;
+		} else
+			PAUSE();
+	}
+
+	/* leave the queue, the successor becomes the head */
+	if(!(succ = me.next)) {
+		if(__sync_val_compare_and_swap(&impl->tail, &me, 0) == &me) {
+			__sync_fetch_and_and(&impl->glock, ~SHFL_NO_STEALING);
+			return;
+		}
+		while(!(succ = me.next))
+			PAUSE();
+	}
+
+	succ->ready = 1;
+}
+
+/* steals the lock word, never enters the queue */
+static int trylock_shfl(struct liblock_impl* impl) {
+	return !impl->glock && __sync_bool_compare_and_swap(&impl->glock, 0, SHFL_LOCKED) ? 0 : EBUSY;
+}
+
+static void unlock_shfl(struct liblock_impl* impl) {
+	__sync_fetch_and_and(&impl->glock, ~SHFL_LOCKED);
+}
+
+static struct liblock_impl* do_liblock_init_lock(shfl)(liblock_lock_t* lock, struct core* core, pthread_mutexattr_t* attr) {
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), core);
+
+	impl->glock = 0;
+	impl->tail = 0;
+
+	return impl;
+}
+
+static int do_liblock_destroy_lock(shfl)(liblock_lock_t* lock) {
+	return 0;
+}
+
+static void* do_liblock_execute_operation(shfl)(liblock_lock_t* lock, void* (*pending)(void*), void* val) {
+	struct liblock_impl* impl = lock->impl;
+	void* res;
+
+	lock_shfl(impl);
+
+	res = pending(val);
+
+	unlock_shfl(impl);
+
+	return res;
+}
+
+static int do_liblock_execute_timed(shfl)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+
+	while(trylock_shfl(impl)) {
+		if(liblock_clock_expired(deadline))
+			return EBUSY;
+		PAUSE();
+	}
+
+	*res = pending(val);
+
+	unlock_shfl(impl);
+
+	return 0;
+}
+
+static void do_liblock_init_library(shfl)() {
+}
+
+static void do_liblock_kill_library(shfl)() {
+}
+
+static void do_liblock_run(shfl)(void (*callback)()) {
+	if(__sync_val_compare_and_swap(&liblock_start_server_threads_by_hand, 1, 0) != 1)
+		fatal("servers are not managed by hand");
+	if(callback)
+		callback();
+}
+
+static int do_liblock_cond_init(shfl)(liblock_cond_t* cond) {
+	return cond->has_attr ?
+		pthread_cond_init(&cond->impl.posix_cond, &cond->attr) :
+		pthread_cond_init(&cond->impl.posix_cond, 0);
+}
+
+static int cond_timedwait(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) {
+	struct liblock_impl* impl = lock->impl;
+	pthread_mutex_t*     stripe = numa_lock_cond_stripe(cond);
+	int res;
+
+	pthread_mutex_lock(stripe);
+
+	unlock_shfl(impl);
+	if(ts)
+		res = pthread_cond_timedwait(&cond->impl.posix_cond, stripe, ts);
+	else
+		res = pthread_cond_wait(&cond->impl.posix_cond, stripe);
+	pthread_mutex_unlock(stripe);
+
+	lock_shfl(impl);
+
+	return res;
+}
+
+static int do_liblock_cond_timedwait(shfl)(liblock_cond_t* cond, liblock_lock_t* lock, const struct timespec* ts) {
+	return cond_timedwait(cond, lock, ts);
+}
+
+static int do_liblock_cond_wait(shfl)(liblock_cond_t* cond, liblock_lock_t* lock) {
+	return cond_timedwait(cond, lock, 0);
+}
+
+static int do_liblock_cond_signal(shfl)(liblock_cond_t* cond) {
+	return numa_lock_cond_wake(cond, pthread_cond_signal);
+}
+
+static int do_liblock_cond_broadcast(shfl)(liblock_cond_t* cond) {
+	return numa_lock_cond_wake(cond, pthread_cond_broadcast);
+}
+
+static int do_liblock_cond_destroy(shfl)(liblock_cond_t* cond) {
+	return pthread_cond_destroy(&cond->impl.posix_cond);
+}
+
+static void do_liblock_on_thread_start(shfl)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_on_thread_exit(shfl)(struct thread_descriptor* desc) {
+}
+
+static void do_liblock_unlock_in_cs(shfl)(liblock_lock_t* lock) {
+	unlock_shfl(lock->impl);
+}
+
+static void do_liblock_relock_in_cs(shfl)(liblock_lock_t* lock) {
+	lock_shfl(lock->impl);
+}
+
+static void do_liblock_declare_server(shfl)(struct core* core) {
+}
+
+liblock_declare(shfl,
+		._execute_timed = do_liblock_execute_timed(shfl));
@@ -0,0 +1,193 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#ifndef _SYNCH_H_
+#define _SYNCH_H_
+
+#include "liblock.h"
+
+/*
+ * Common parts of the queue-based combining locks (CC-Synch, DSM-Synch and H-Synch), see
+ * [1] Panagiota Fatourou, Nikolaos D. Kallimanis:
+ *     Revisiting the combining synchronization technique.
+ *     PPoPP 2012: 257-266
+ *
+ * A node holds one request. The nodes move between the threads (CC-Synch) or stay with their thread (DSM-Synch), a
+ * thread takes one node from its free list per request in flight and gives one back once the request is completed.
+ *
+ * The critical sections run in place until the lock is parked, see park.h. The combiner records the node it executes
+ * in the lock (cur). If the critical section releases the lock, the combiner role is passed to the next node and the
+ * node stays pending. To take the lock back, the thread enqueues a node with SYNCH_LOCK_REQUEST: a combiner never
+ * executes such a node, it passes the combiner role to its owner, which records the node in cur, completes the
+ * critical section and combines from its lock node.
+ */
+#define SYNCH_MAX_COMBINE    256                          /* maximal number of requests executed by a combiner */
+#define SYNCH_LOCK_REQUEST   ((void* (*)(void*))1)
+
+struct synch_node {
+	void*              (*volatile pending)(void*);    /* request or SYNCH_LOCK_REQUEST */
+	void* volatile                val;                /* argument, then result of the request */
+	int volatile                  wait;
+	int volatile                  completed;
+	struct synch_node* volatile   next;
+	struct synch_node*            next_free;
+	char                          pad[pad_to_cache_line(2*sizeof(int) + 4*sizeof(void*))];
+};
+
+static __thread struct synch_node*  synch_free_nodes = 0;
+
+static inline struct synch_node* synch_node_get() {
+	struct synch_node* node = synch_free_nodes;
+
+	if(node)
+		synch_free_nodes = node->next_free;
+	else
+		node = liblock_allocate(sizeof(struct synch_node));
+
+	return node;
+}
+
+static inline void synch_node_put(struct synch_node* node) {
+	node->next_free = synch_free_nodes;
+	synch_free_nodes = node;
+}
+
+/*
+ *  CC-Synch queue, also used by the clusters of H-Synch
+ */
+struct synch_queue {
+	struct synch_node* volatile   tail;               /* dummy node of the next request */
+	char                          pad[pad_to_cache_line(sizeof(void*))];
+};
+
+static inline void synch_queue_init(struct synch_queue* queue) {
+	struct synch_node* dummy = liblock_allocate(sizeof(struct synch_node));
+
+	dummy->pending = 0;
+	dummy->next = 0;
+	dummy->wait = 0;
+	dummy->completed = 0;
+
+	queue->tail = dummy;
+}
+
+/* the queue is idle, its dummy node belongs to no thread */
+static inline void synch_queue_destroy(struct synch_queue* queue) {
+	free(queue->tail);
+}
+
+/* returns the node of the request once it is completed or once the thread is the combiner */
+static inline struct synch_node* synch_queue_enqueue(struct synch_queue* queue, void* (*pending)(void*), void* val) {
+	struct synch_node* next = synch_node_get(), *cur;
+
+	next->next = 0;
+	next->wait = 1;
+	next->completed = 0;
+
+	cur = __sync_lock_test_and_set(&queue->tail, next);
+	cur->val = val;
+	cur->pending = pending;
+	cur->next = next;
+
+	while(cur->wait)
+		PAUSE();
+
+	return cur;
+}
+
+/* enqueues the request only if the queue has no combiner, 0 otherwise */
+static inline struct synch_node* synch_queue_try_enqueue(struct synch_queue* queue, void* (*pending)(void*), void* val) {
+	struct synch_node* cur = queue->tail, *next;
+
+	if(cur->wait)
+		return 0;
+
+	next = synch_node_get();
+	next->next = 0;
+	next->wait = 1;
+	next->completed = 0;
+
+	if(!__sync_bool_compare_and_swap(&queue->tail, cur, next)) {
+		synch_node_put(next);
+		return 0;
+	}
+
+	cur->val = val;
+	cur->pending = pending;
+	cur->next = next;
+
+	/* cur may have been recycled as a dummy node since wait was read */
+	while(cur->wait)
+		PAUSE();
+
+	return cur;
+}
+
+/* a combiner that leaves without executing its node, the next node becomes the combiner */
+static inline void synch_queue_withdraw(struct synch_node* node) {
+	node->next->wait = 0;
+	synch_node_put(node);
+}
+
+/* the critical section of tmp took the lock back with the lock node *cur, the combiner goes on after that node */
+static inline struct synch_node* synch_resume(struct synch_node* volatile* cur, struct synch_node* tmp, void* val) {
+	struct synch_node* node = *cur, *next;
+
+	tmp->val = val;
+	tmp->completed = 1;
+	tmp->wait = 0;
+
+	next = node->next;
+	synch_node_put(node);
+
+	return next;
+}
+
+/* executes the requests from tmp, the node of the combiner, then passes the combiner role */
+static inline void synch_queue_combine(struct synch_node* volatile* cur, struct synch_node* tmp) {
+	struct synch_node*  next;
+	void*               val;
+	int                 counter = 0;
+
+	while((next = tmp->next) && tmp->pending != SYNCH_LOCK_REQUEST && counter++ < SYNCH_MAX_COMBINE) {
+		*cur = tmp;
+		val = tmp->pending(tmp->val);
+
+		if(*cur != tmp)
+			next = synch_resume(cur, tmp, val);
+		else {
+			tmp->val = val;
+			tmp->completed = 1;
+			tmp->wait = 0;
+		}
+
+		tmp = next;
+	}
+
+	tmp->wait = 0;
+}
+
+/* unlock_in_cs in place, the node being executed stays pending and its successor becomes the combiner */
+static inline void synch_queue_release(struct synch_node* volatile* cur) {
+	struct synch_node* node = *cur, *next = node->next;
+
+	if(node->pending == SYNCH_LOCK_REQUEST)
+		synch_node_put(node);
+
+	*cur = 0;
+	next->wait = 0;
+}
+
+/* relock_in_cs in place, returns the lock node once the thread is the combiner */
+static inline struct synch_node* synch_queue_acquire(struct synch_queue* queue) {
+	return synch_queue_enqueue(queue, SYNCH_LOCK_REQUEST, 0);
+}
+
+#endif
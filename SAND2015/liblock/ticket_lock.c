@@ -13,6 +13,7 @@
 #include "ticket_lock.h"
 #include "liblock.h"
 #include "liblock-fatal.h"
+#include "clock.h"
 
 struct liblock_impl {
 	pthread_mutex_t       posix_lock;
@@ -21,7 +22,7 @@ struct liblock_impl {
 };
 
 static struct liblock_impl* do_liblock_init_lock(ticklcok)(liblock_lock_t* lock, struct core* server, pthread_mutexattr_t* attr) {
-	struct liblock_impl* impl = liblock_allocate(sizeof(struct liblock_impl));
+	struct liblock_impl* impl = liblock_allocate_impl(sizeof(struct liblock_impl), server);
 
 	impl->lock.u = 0;
 	pthread_mutex_init(&impl->posix_lock, 0);
@@ -46,6 +47,22 @@ static void* do_liblock_execute_operation(ticklcok)(liblock_lock_t* lock, void*
 	return res;
 }
 
+static int do_liblock_execute_timed(ticklcok)(liblock_lock_t* lock, void* (*pending)(void*), void* val, void** res, uint64_t deadline) {
+	struct liblock_impl* impl = lock->impl;
+
+	while(ticket_trylock(&impl->lock)) {
+		if(liblock_clock_expired(deadline))
+			return EBUSY;
+		PAUSE();
+	}
+
+	*res = pending(val);
+
+	ticket_unlock(&impl->lock);
+
+	return 0;
+}
+
 static void do_liblock_init_library(ticklcok)() {
 }
 
@@ -119,5 +136,6 @@ static void do_liblock_relock_in_cs(ticklcok)(liblock_lock_t* lock) {
 static void do_liblock_declare_server(ticklcok)(struct core* core) {
 }
 
-liblock_declare(ticklcok);
+liblock_declare(ticklcok,
+		._execute_timed = do_liblock_execute_timed(ticklcok));
 
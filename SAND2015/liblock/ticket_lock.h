@@ -37,6 +37,17 @@ static void ticket_unlock(ticketlock *t)
 	t->s.ticket++;
 }
 
+static int ticket_trylock(ticketlock *t)
+{
+	unsigned short me = t->s.users;
+	unsigned cmp = ((unsigned) me << 16) + me;
+	unsigned cmpnew = ((unsigned) (unsigned short) (me + 1) << 16) + me;
+
+	if (cmpxchg_util(&t->u, cmp, cmpnew) == cmp) return 0;
+
+	return EBUSY;
+}
+
 
 
 #endif /* TICKET_LOCK_H_ */
@@ -0,0 +1,184 @@
+/* ########################################################################## */
+/* (C) UPMC, 2010-2011                                                        */
+/*     Authors:                                                               */
+/*       Jean-Pierre Lozi <jean-pierre.lozi@lip6.fr>                          */
+/*       Gaël Thomas <gael.thomas@lip6.fr>                                    */
+/*       Florian David <florian.david@lip6.fr>                                */
+/*       Julia Lawall <julia.lawall@lip6.fr>                                  */
+/*       Gilles Muller <gilles.muller@lip6.fr>                                */
+/* -------------------------------------------------------------------------- */
+/* ########################################################################## */
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots, the slots of level l
+ * cover WHEEL_SLOTS^l ticks. Insertion and cancellation are O(1), the nodes of a slot of level
+ * l are cascaded to the lower levels when the wheel reaches the slot. The wheel is not
+ * synchronized, the caller serializes the accesses.
+ */
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_LEVELS  4
+#define WHEEL_RANGE   ((uint64_t)1 << (WHEEL_BITS*WHEEL_LEVELS))  /* farther timers are parked in the last slot */
+#define WHEEL_NEVER   ((uint64_t)-1)
+
+struct timer_node {
+	struct timer_node* next;
+	struct timer_node* prev;     /* 0 when the node is not in the wheel */
+	uint64_t           expires;  /* tick of expiration */
+	void*              content;
+};
+
+struct timer_wheel {
+	uint64_t           now;                                 /* next tick to process */
+	unsigned int       count;                               /* number of nodes in the wheel */
+	uint64_t           occupied[WHEEL_LEVELS];              /* bitmap of the non empty slots */
+	struct timer_node  slots[WHEEL_LEVELS][WHEEL_SLOTS];    /* circular lists, the heads are sentinels */
+};
+
+static void timer_wheel_init(struct timer_wheel* wheel, uint64_t now) {
+	int l, s;
+
+	wheel->now = now;
+	wheel->count = 0;
+
+	for(l=0; l<WHEEL_LEVELS; l++) {
+		wheel->occupied[l] = 0;
+		for(s=0; s<WHEEL_SLOTS; s++)
+			wheel->slots[l][s].next = wheel->slots[l][s].prev = &wheel->slots[l][s];
+	}
+}
+
+static inline void timer_wheel_link(struct timer_wheel* wheel, struct timer_node* node) {
+	uint64_t           expires = node->expires < wheel->now ? wheel->now : node->expires;
+	int                level = 0, slot;
+	struct timer_node* head;
+
+	if(expires - wheel->now >= WHEEL_RANGE)
+		expires = wheel->now + WHEEL_RANGE - 1;
+
+	while(level < WHEEL_LEVELS - 1 && expires - wheel->now >= (uint64_t)1 << (WHEEL_BITS*(level + 1)))
+		level++;
+
+	slot = (expires >> (WHEEL_BITS*level)) & (WHEEL_SLOTS - 1);
+	head = &wheel->slots[level][slot];
+
+	node->next = head;
+	node->prev = head->prev;
+	head->prev->next = node;
+	head->prev = node;
+
+	wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static inline void timer_wheel_unlink(struct timer_wheel* wheel, struct timer_node* node) {
+	struct timer_node* next = node->next, *prev = node->prev;
+
+	prev->next = next;
+	next->prev = prev;
+	node->prev = 0;
+
+	/* the node was alone, next is the head of the slot */
+	if(prev == next) {
+		int index = next - &wheel->slots[0][0];
+		wheel->occupied[index / WHEEL_SLOTS] &= ~((uint64_t)1 << (index % WHEEL_SLOTS));
+	}
+}
+
+static inline void timer_wheel_add(struct timer_wheel* wheel, struct timer_node* node) {
+	timer_wheel_link(wheel, node);
+	wheel->count++;
+}
+
+/* no-op if the node has already expired */
+static inline void timer_wheel_cancel(struct timer_wheel* wheel, struct timer_node* node) {
+	if(node->prev) {
+		timer_wheel_unlink(wheel, node);
+		wheel->count--;
+	}
+}
+
+/* first tick t >= now where t is the start of the slot slot of the level level */
+static inline uint64_t timer_wheel_slot_start(uint64_t now, int level, int slot) {
+	int      shift = WHEEL_BITS*level;
+	uint64_t cur = now >> shift;
+	uint64_t t = (cur + ((slot - cur) & (WHEEL_SLOTS - 1))) << shift;
+
+	if(t < now)
+		t += (uint64_t)WHEEL_SLOTS << shift;
+
+	return t;
+}
+
+/* next tick where a node expires or where a slot is cascaded, WHEEL_NEVER if the wheel is empty */
+static uint64_t timer_wheel_next(struct timer_wheel* wheel) {
+	uint64_t res = WHEEL_NEVER;
+	int      level;
+
+	if(!wheel->count)
+		return WHEEL_NEVER;
+
+	for(level=0; level<WHEEL_LEVELS; level++) {
+		uint64_t bits = wheel->occupied[level];
+
+		while(bits) {
+			int      slot = __builtin_ctzll(bits);
+			uint64_t t = timer_wheel_slot_start(wheel->now, level, slot);
+
+			if(t < res)
+				res = t;
+
+			bits &= bits - 1;
+		}
+	}
+
+	return res;
+}
+
+static void timer_wheel_cascade(struct timer_wheel* wheel, int level, int slot) {
+	struct timer_node* head = &wheel->slots[level][slot];
+	struct timer_node* cur = head->next, *next;
+
+	head->next = head->prev = head;
+	wheel->occupied[level] &= ~((uint64_t)1 << slot);
+
+	for(; cur != head; cur=next) {
+		next = cur->next;
+		timer_wheel_link(wheel, cur);
+	}
+}
+
+/* processes the ticks up to now included, expire is called on every expired node once it is out of the wheel */
+static void timer_wheel_advance(struct timer_wheel* wheel, uint64_t now, void (*expire)(struct timer_node*)) {
+	while(wheel->now <= now) {
+		uint64_t           t = timer_wheel_next(wheel);
+		struct timer_node* head;
+		int                level;
+
+		if(t > now) {
+			wheel->now = now + 1;
+			return;
+		}
+
+		wheel->now = t;
+
+		for(level=1; level<WHEEL_LEVELS && !((t >> (WHEEL_BITS*(level - 1))) & (WHEEL_SLOTS - 1)); level++)
+			timer_wheel_cascade(wheel, level, (t >> (WHEEL_BITS*level)) & (WHEEL_SLOTS - 1));
+
+		head = &wheel->slots[0][t & (WHEEL_SLOTS - 1)];
+
+		while(head->next != head) {
+			struct timer_node* node = head->next;
+			timer_wheel_unlink(wheel, node);
+			wheel->count--;
+			expire(node);
+		}
+
+		wheel->now = t + 1;
+	}
+}
+
+#endif
@@ -7,10 +7,10 @@
 #include <unistd.h>
 #include <execinfo.h>
 #include <stdint.h>
-#include <papi.h>
 #include <stdarg.h>
 #include "backtrace-symbols.c"
 #include "liblock.h"
+#include "clock.h"
 
 #define conds 1
 
@@ -43,7 +43,7 @@
 
 #define S(_) #_
 
-#define get_cyc() PAPI_get_real_cyc()
+#define get_cyc() liblock_clock_cycles()
 
 #define PAGE_SIZE       4096
 #define CACHE_LINE_SIZE 64
@@ -155,8 +155,6 @@ static void init_thread() {
 
 	//echo("%lu %lu\n", (uintptr_t)&((struct lock_info*)0)->per_threads, sizeof(struct lock_info_thread));
 	check_id(thread_id);
-
-	PAPI_thread_init((unsigned long (*)(void))pthread_self);
 }
 
 static void init() {
@@ -183,9 +181,6 @@ static void init() {
 
 		real_pthread_mutex_init(&global_mutex, 0);
 
-		if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT)
-			echo("WARNING: PAPI_library_init failed.\n");
-
 		init_thread();
 
 		const char* str_event_id = getenv("LOCK_PROFILE_EVENT");
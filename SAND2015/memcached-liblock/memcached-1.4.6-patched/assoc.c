@@ -103,6 +103,18 @@ item *assoc_find(const char *key, const size_t nkey) {
     return ret;
 }
 
+/* returns the bucket of the key, used to prefetch the hash chains of batched lookups */
+item **assoc_bucket(const char *key, const size_t nkey) {
+    uint32_t hv = hash(key, nkey, 0);
+    unsigned int oldbucket;
+
+    if (expanding &&
+        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
+        return &old_hashtable[oldbucket];
+    else
+        return &primary_hashtable[hv & hashmask(hashpower)];
+}
+
 /* returns the address of the item pointer before the key.  if *item == 0,
    the item wasn't found */
 
@@ -1,6 +1,7 @@
 /* associative array */
 void assoc_init(void);
 item *assoc_find(const char *key, const size_t nkey);
+item **assoc_bucket(const char *key, const size_t nkey);
 int assoc_insert(item *item);
 void assoc_delete(const char *key, const size_t nkey);
 void do_assoc_move_next_bucket(void);
@@ -36,7 +36,8 @@ __attribute__ ((constructor (103))) static void liblock_splash() {
 	if(!liblock_lock_name)
 		liblock_lock_name = "rcl";
 
-	liblock_server_core_1 = topology->nodes[0].cores[0];
+	/* a placement computed by a profiling run (LIBLOCK_PLACEMENT) overrides the default core */
+	liblock_server_core_1 = liblock_placement_core(CACHE_LOCK_NAME, topology->nodes[0].cores[0]);
 
 	is_rcl = !strcmp(liblock_lock_name, "rcl") || !strcmp(liblock_lock_name, "multircl");
 
@@ -19,4 +19,7 @@ extern struct core* liblock_server_core_1;
 #define TYPE_EXPERIENCE (liblock_lock_name)
 #define DEFAULT_ARG     (liblock_server_core_1)
 
+/* name of cache_lock for the lock placement (LIBLOCK_PLACEMENT, LIBLOCK_PLACEMENT_OUTPUT) */
+#define CACHE_LOCK_NAME "memcached-cache"
+
 #endif
@@ -360,7 +360,7 @@ item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbyt
         },
     };
     
-    it =(item *)(uintptr_t)(liblock_execute_operation(&cache_lock, (void *)(uintptr_t)(&instance26), &function27));
+    it =(item *)(uintptr_t)(liblock_exec_ctx(&cache_lock, &function27, &instance26));
     }
     return it;
 }
@@ -380,6 +380,28 @@ void *function34(void *ctx32) {
     }
 }
 
+/*
+ * Batched item_get, executed by the lock server: the bucket and the first
+ * item of every hash chain are prefetched before the lookups.
+ */
+static void function34_batch(void **ctxs, int n) {
+    item **buckets[LIBLOCK_MAX_BATCH];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct input31 *in = &(((union instance33 *)ctxs[i])->input31);
+        buckets[i] = assoc_bucket(in->key, in->nkey);
+        __builtin_prefetch(buckets[i]);
+    }
+
+    for (i = 0; i < n; i++)
+        if (*buckets[i])
+            __builtin_prefetch(*buckets[i]);
+
+    for (i = 0; i < n; i++)
+        ctxs[i] = function34(ctxs[i]);
+}
+
 /*
  * Returns an item if it hasn't been marked as expired,
  * lazy-expiring as needed.
@@ -393,7 +415,7 @@ item *item_get(const char *key, const size_t nkey) {
         },
     };
     
-    it =(item *)(uintptr_t)(liblock_execute_operation(&cache_lock, (void *)(uintptr_t)(&instance33), &function34));
+    it =(item *)(uintptr_t)(liblock_exec_ctx(&cache_lock, &function34, &instance33));
     }
     return it;
 }
@@ -534,7 +556,7 @@ enum delta_result_type add_delta(conn *c, const char *key,
         },
     };
     
-    ret =(enum delta_result_type)(uintptr_t)(liblock_execute_operation(&cache_lock, (void *)(uintptr_t)(&instance68), &function69));
+    ret =(enum delta_result_type)(uintptr_t)(liblock_exec_ctx(&cache_lock, &function69, &instance68));
     }
     return ret;
 }
@@ -569,7 +591,7 @@ enum store_item_type store_item(item *it, int comm, conn* c) {
         },
     };
     
-    ret =(enum store_item_type)(uintptr_t)(liblock_execute_operation(&cache_lock, (void *)(uintptr_t)(&instance75), &function76));
+    ret =(enum store_item_type)(uintptr_t)(liblock_exec_ctx(&cache_lock, &function76, &instance75));
     }
     return ret;
 }
@@ -622,7 +644,7 @@ char *item_cachedump(unsigned int slabs_clsid, unsigned int limit, unsigned int
         },
     };
     
-    ret =(char *)(uintptr_t)(liblock_execute_operation(&cache_lock, (void *)(uintptr_t)(&instance89), &function90));
+    ret =(char *)(uintptr_t)(liblock_exec_ctx(&cache_lock, &function90, &instance89));
     }
     return ret;
 }
@@ -652,7 +674,7 @@ void  item_stats(ADD_STAT add_stats, void *c) {
         },
     };
     
-    liblock_execute_operation(&cache_lock, (void *)(uintptr_t)(&instance96), &function97); }
+    liblock_exec_ctx(&cache_lock, &function97, &instance96); }
 }
 
 union instance103 {struct input101{ADD_STAT add_stats;void *c;} input101;};
@@ -680,7 +702,7 @@ void  item_stats_sizes(ADD_STAT add_stats, void *c) {
         },
     };
     
-    liblock_execute_operation(&cache_lock, (void *)(uintptr_t)(&instance103), &function104); }
+    liblock_exec_ctx(&cache_lock, &function104, &instance103); }
 }
 
 /******************************* GLOBAL STATS ******************************/
@@ -801,6 +823,8 @@ void thread_init(int nthreads, struct event_base *main_base) {
     int         i;
 
     liblock_lock_init(TYPE_EXPERIENCE, DEFAULT_ARG, &cache_lock, NULL);
+    liblock_placement_register(&cache_lock, CACHE_LOCK_NAME);
+    liblock_register_batch(&function34, &function34_batch);
     pthread_mutex_init(&stats_lock, NULL);
 
     pthread_mutex_init(&init_lock, NULL);
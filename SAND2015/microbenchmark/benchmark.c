@@ -28,6 +28,7 @@
 
 #include "liblock-fatal.h"
 #include "liblock.h"
+#include "clock.h"
 
 /* ########################################################################## */
 /* Definitions                                                                */
@@ -324,7 +325,7 @@ void *server_main(void *thread_arguments_block);
 
 static struct core* get_core(unsigned int physical_core);
 
-inline void access_variables(volatile uint64_t *memory_area,
+static inline void access_variables(volatile uint64_t *memory_area,
 		int first_variable_number, int number_of_variables,
 		int randomized_accesses, int *permutations_array);
 inline int _rand(int next);
@@ -1452,7 +1453,7 @@ void *client_main(void *thread_arguments_block_pointer) {
 				&& measurement_type == MT_GLOBAL) {
 			/* If so, get the current cycle count. We could also use
 			 * PAPI_start with the TOT_CYC event. */
-			start_cycles = PAPI_get_real_cyc();
+			start_cycles = liblock_clock_cycles();
 		} else if (measurement_metric == MM_NUMBER_OF_EVENTS
 				&& client_core % NUMBER_OF_CORES_PER_DIE
 						== (NUMBER_OF_CORES_PER_DIE - 1)) {
@@ -1483,7 +1484,7 @@ void *client_main(void *thread_arguments_block_pointer) {
 			if (measurement_type == MT_LOCK_ACQUISITIONS
 					|| measurement_type == MT_CRITICAL_SECTIONS) {
 				if (measurement_metric == MM_NUMBER_OF_CYCLES) {
-					main_lock_acquisition_beginning = PAPI_get_real_cyc();
+					main_lock_acquisition_beginning = liblock_clock_cycles();
 				} else if (client_core % NUMBER_OF_CORES_PER_DIE
 						== (NUMBER_OF_CORES_PER_DIE - 1)) {
 					if (PAPI_read(event_set, &events_begin) != PAPI_OK)
@@ -1551,7 +1552,7 @@ void *client_main(void *thread_arguments_block_pointer) {
 			if (measurement_type == MT_LOCK_ACQUISITIONS
 					&& (!skip_first_cs || i > 0)) {
 				if (measurement_metric == MM_NUMBER_OF_CYCLES) {
-					main_lock_acquisition_end = PAPI_get_real_cyc();
+					main_lock_acquisition_end = liblock_clock_cycles_end();
 
 					total_latency += main_lock_acquisition_end
 							- main_lock_acquisition_beginning;
@@ -1600,7 +1601,7 @@ void *client_main(void *thread_arguments_block_pointer) {
 			if (measurement_type == MT_CRITICAL_SECTIONS
 					&& (!skip_first_cs || i > 0)) {
 				if (measurement_metric == MM_NUMBER_OF_CYCLES) {
-					main_lock_acquisition_end = PAPI_get_real_cyc();
+					main_lock_acquisition_end = liblock_clock_cycles_end();
 
 					total_latency += main_lock_acquisition_end
 							- main_lock_acquisition_beginning;
@@ -1623,15 +1624,15 @@ void *client_main(void *thread_arguments_block_pointer) {
 			 a small delay doesn't alter the results significantly. */
 			if (delay > 0) {
 				/* Delay */
-				cycles = PAPI_get_real_cyc();
-				while ((PAPI_get_real_cyc() - cycles) < delay)
+				cycles = liblock_clock_cycles();
+				while ((liblock_clock_cycles() - cycles) < delay)
 					;
 
 				/*
-				 cycles = PAPI_get_real_cyc();
+				 cycles = liblock_clock_cycles();
 				 random_delay = rand() % local_delay;
 
-				 while ((PAPI_get_real_cyc() - cycles) < random_delay)
+				 while ((liblock_clock_cycles() - cycles) < random_delay)
 				 ;
 				 */
 			}
@@ -1658,7 +1659,7 @@ void *client_main(void *thread_arguments_block_pointer) {
 				if (measurement_type == MT_LOCK_ACQUISITIONS
 						|| measurement_type == MT_CRITICAL_SECTIONS) {
 					if (measurement_metric == MM_NUMBER_OF_CYCLES) {
-						main_lock_acquisition_beginning = PAPI_get_real_cyc();
+						main_lock_acquisition_beginning = liblock_clock_cycles();
 					} else if (client_core % NUMBER_OF_CORES_PER_DIE
 							== (NUMBER_OF_CORES_PER_DIE - 1)) {
 						if (PAPI_read(event_set, &events_begin) != PAPI_OK)
@@ -1728,7 +1729,7 @@ void *client_main(void *thread_arguments_block_pointer) {
 				if (measurement_type == MT_LOCK_ACQUISITIONS
 						&& (!skip_first_cs || i > 0)) {
 					if (measurement_metric == MM_NUMBER_OF_CYCLES) {
-						main_lock_acquisition_end = PAPI_get_real_cyc();
+						main_lock_acquisition_end = liblock_clock_cycles_end();
 
 						total_latency += main_lock_acquisition_end
 								- main_lock_acquisition_beginning;
@@ -1768,7 +1769,7 @@ void *client_main(void *thread_arguments_block_pointer) {
 				if (measurement_type == MT_CRITICAL_SECTIONS
 						&& (!skip_first_cs || i > 0)) {
 					if (measurement_metric == MM_NUMBER_OF_CYCLES) {
-						main_lock_acquisition_end = PAPI_get_real_cyc();
+						main_lock_acquisition_end = liblock_clock_cycles_end();
 
 						total_latency += main_lock_acquisition_end
 								- main_lock_acquisition_beginning;
@@ -1783,14 +1784,14 @@ void *client_main(void *thread_arguments_block_pointer) {
 
 				if (delay > 0) {
 					/* Delay */
-					cycles = PAPI_get_real_cyc();
-					while ((PAPI_get_real_cyc() - cycles) < delay)
+					cycles = liblock_clock_cycles();
+					while ((liblock_clock_cycles() - cycles) < delay)
 						;
 
 					/*
-					 cycles = PAPI_get_real_cyc();
+					 cycles = liblock_clock_cycles();
 					 random_delay = rand() % delay;
-					 while ((PAPI_get_real_cyc() - cycles) < random_delay)
+					 while ((liblock_clock_cycles() - cycles) < random_delay)
 					 ;
 					 */
 				}
@@ -1811,7 +1812,7 @@ void *client_main(void *thread_arguments_block_pointer) {
 
 			if (measurement_type == MT_CRITICAL_SECTIONS) {
 				if (measurement_metric == MM_NUMBER_OF_CYCLES) {
-					main_lock_acquisition_beginning = PAPI_get_real_cyc();
+					main_lock_acquisition_beginning = liblock_clock_cycles();
 				} else if (client_core % NUMBER_OF_CORES_PER_DIE
 						== (NUMBER_OF_CORES_PER_DIE - 1)) {
 					if (PAPI_read(event_set, &events_begin) != PAPI_OK)
@@ -1832,7 +1833,7 @@ void *client_main(void *thread_arguments_block_pointer) {
 			if (measurement_type == MT_CRITICAL_SECTIONS
 					&& (!skip_first_cs || i > 0)) {
 				if (measurement_metric == MM_NUMBER_OF_CYCLES) {
-					main_lock_acquisition_end = PAPI_get_real_cyc();
+					main_lock_acquisition_end = liblock_clock_cycles_end();
 
 					total_latency += main_lock_acquisition_end
 							- main_lock_acquisition_beginning;
@@ -1847,8 +1848,8 @@ void *client_main(void *thread_arguments_block_pointer) {
 
 			if (delay > 0) {
 				/* Delay */
-				cycles = PAPI_get_real_cyc();
-				while ((PAPI_get_real_cyc() - cycles) < delay)
+				cycles = liblock_clock_cycles();
+				while ((liblock_clock_cycles() - cycles) < delay)
 					;
 			}
 		}
@@ -1893,7 +1894,7 @@ void *client_main(void *thread_arguments_block_pointer) {
 		if (measurement_metric == MM_NUMBER_OF_CYCLES) {
 			if (measurement_type == MT_GLOBAL) {
 				/* If so, get the current cycle count. */
-				end_cycles = PAPI_get_real_cyc();
+				end_cycles = liblock_clock_cycles_end();
 
 				if (measurement_unit != MU_TOTAL_CYCLES_MAX) {
 					/* We return the number of cycles per RPC. */
@@ -1964,10 +1965,6 @@ void *client_main(void *thread_arguments_block_pointer) {
 			liblock_lock_destroy(&g_liblock_lock);
 		}
 
-	if (fin_num == g_number_of_clients - 1 && g_liblock_name && strcmp(g_liblock_name, "saml") == 0){
-		liblock_unlock_in_cs(&g_liblock_lock);
-	}
-
 
 	return NULL;
 }
@@ -2087,7 +2084,7 @@ void *server_main(void *thread_arguments_block_pointer) {
 		/* ...and if we're county cycles... */
 		if (measurement_metric == MM_NUMBER_OF_CYCLES) {
 			/* ...we get the current cycle count. */
-			start_cycles = PAPI_get_real_cyc();
+			start_cycles = liblock_clock_cycles();
 		} else /* if (local_measurement_metric == MM_NUMBER_OF_EVENTS) */
 		{
 			/* We start the event counter. */
@@ -2170,7 +2167,7 @@ void *server_main(void *thread_arguments_block_pointer) {
 		for (j = 0; j < number_of_samples; j++) {
 			/* Same as before, except now we get cycle statistics for each
 			 sample. */
-			sample_start_cycles = PAPI_get_real_cyc();
+			sample_start_cycles = liblock_clock_cycles();
 
 			for (i = 0; i < number_of_iterations_per_sample_m1; i++) {
 				while (!(*null_rpc_global_sv))
@@ -2203,7 +2200,7 @@ void *server_main(void *thread_arguments_block_pointer) {
 
 			**null_rpc_global_sv = /* i + 1 */1;
 
-			sample_end_cycles = PAPI_get_real_cyc();
+			sample_end_cycles = liblock_clock_cycles_end();
 
 			/* We need to know which core was serviced last. */
 			g_multiple_samples_rpc_done_addrs[j] = *null_rpc_global_sv;
@@ -2273,7 +2270,7 @@ void *server_main(void *thread_arguments_block_pointer) {
 		/* Are we counting cycles? */
 		if (measurement_metric == MM_NUMBER_OF_CYCLES) {
 			/* If so, get the current cycle count. */
-			end_cycles = PAPI_get_real_cyc();
+			end_cycles = liblock_clock_cycles_end();
 
 			if (measurement_unit != MU_TOTAL_CYCLES_MAX) {
 				/* We return the number of cycles per RPC. */
@@ -2302,7 +2299,7 @@ void *server_main(void *thread_arguments_block_pointer) {
 }
 
 /* This function accesses one variable per cache line. */
-inline void access_variables(volatile uint64_t *memory_area,
+static inline void access_variables(volatile uint64_t *memory_area,
 		int first_variable_number, int number_of_variables, int access_order,
 		int *permutations_array) {
 	int k, random_number;
@@ -2338,7 +2335,7 @@ inline void access_variables(volatile uint64_t *memory_area,
 		break;
 
 	case AO_CUSTOM_RANDOM: {
-		random_number = (int) PAPI_get_real_cyc();
+		random_number = (int) liblock_clock_cycles();
 
 		for (k = 0; k < number_of_variables; k++) {
 			random_number = _rand(random_number);
@@ -0,0 +1,103 @@
+#!/bin/bash
+# Fits the SAML adaptation thresholds for this host and writes them in the
+# profile file loaded by the liblock (saml-<hostname>.profile next to
+# liblock.so by default).
+#
+# Same delay x critical section length sweep as profile_SANL_sim.sh, on a
+# subset of the points (DELAYS, LENGTHS), run with SAML forced in each mode.
+# For each point, r = delay / critical section length as measured by SAML.
+#   spin_ratio     smallest r above which the code-based mode always wins
+#   nonspin_ratio  smallest r (measured in code-based mode) where it wins
+#   numa_ratio     smallest r where the non-NUMA migration wins
+# The server downgrading polynomial fitted on the Xeon is rescaled so that it
+# spans ]1, spin_ratio[ as it spanned ]1, 18[.
+
+OUTPUT=${OUTPUT:-`dirname $0`/../liblock/saml-`hostname`.profile}
+CLIENTS=${CLIENTS:-$((`nproc` - 1))}
+RUNS=${RUNS:-3}
+DELAYS=${DELAYS:-"103 247 592 1414 3377 8065 19261 46000 109856 262352 626538 1496268"}
+LENGTHS=${LENGTHS:-"0 10 50 200 1000 10000"}
+
+run() {
+    sudo env LIBLOCK_SAML_MODE=$1 LIBLOCK_SAML_STATS=1 LIBLOCK_SAML_PROFILE=/dev/null \
+        ./benchmark -m -1 -n 20000 -d $2 -A 1 -c $CLIENTS -s 1 -u -g 1 -l 0 -W $3 -F saml -o -N -x custom_random > tmp
+    # throughput, then r
+    echo -n `grep -v lib_exe tmp | tr -d ',\n'` ""
+    grep lib_exe tmp | awk '{ print ($4 ? $6 / $4 : 0) }'
+}
+
+average() {
+    awk '{ t += $1; r += $2 } END { print t / NR, r / NR }'
+}
+
+for i in $DELAYS
+do
+    for k in $LENGTHS
+    do
+        echo -n "$i $k "
+        for m in mcs server numa
+        do
+            for j in `seq 1 $RUNS`
+            do
+                run $m $i $k
+            done | average | tr -d '\n'
+            echo -n " "
+        done
+        echo
+    done
+done > calibrate.dat
+
+rm -f tmp
+
+# calibrate.dat: delay length mcs r_mcs server r_server numa r_numa
+awk -v host=`hostname` '
+function max(a, b) { return a > b ? a : b }
+{
+    n++
+    mcs[n] = $3; r_mcs[n] = $4; srv[n] = $5; r_srv[n] = $6; numa[n] = $7
+}
+END {
+    spin = 18; nonspin = 5; numa_r = 1
+
+    # largest r (migration mode) where the migration still wins
+    last = 0
+    for (i = 1; i <= n; i++)
+        if (max(srv[i], numa[i]) >= mcs[i] && r_srv[i] > last)
+            last = r_srv[i]
+    # first r above it
+    best = -1
+    for (i = 1; i <= n; i++)
+        if (r_srv[i] > last && (best < 0 || r_srv[i] < best))
+            best = r_srv[i]
+    if (best > 1)
+        spin = best
+
+    best = -1
+    for (i = 1; i <= n; i++)
+        if (mcs[i] > max(srv[i], numa[i]) && (best < 0 || r_mcs[i] < best))
+            best = r_mcs[i]
+    # keep the hysteresis of the Xeon profile when the code-based mode never wins earlier
+    if (best > 0)
+        nonspin = best < spin ? best : spin * 5 / 18
+
+    best = -1
+    for (i = 1; i <= n; i++)
+        if (srv[i] >= numa[i] && (best < 0 || r_srv[i] < best))
+            best = r_srv[i]
+    if (best > 0)
+        numa_r = best
+
+    k = 18 / spin
+    printf "# SAML profile of %s, generated by calibrate_SANL.sh\n", host
+    printf "spin_ratio %f\n", spin
+    printf "nonspin_ratio %f\n", nonspin
+    printf "bound_ratio %f\n", spin * 15 / 18
+    printf "numa_ratio %f\n", numa_r
+    printf "nonnuma_ratio %f\n", numa_r * 0.8
+    printf "down_a %f\n", -3.2026 * k * k
+    printf "down_b %f\n", 125 * k
+    printf "down_c %f\n", -172.81
+}
+' calibrate.dat > $OUTPUT
+
+cat $OUTPUT
@@ -83,6 +83,21 @@ int liblock_find_free_cpu() {
 }
 /* -- EDIT */
 
+/* the locks are named in their order of allocation, which a test repeats from one run to the next */
+int liblock_phoenix_lock_init(liblock_lock_t* lock) {
+	static int cur_lock_id = 0;
+	char       name[32];
+	int        err;
+
+	sprintf(name, "phoenix-%d", __sync_fetch_and_add(&cur_lock_id, 1));
+
+	/* a placement computed by a profiling run (LIBLOCK_PLACEMENT) overrides server_core_1 */
+	if(!(err = liblock_lock_init(TYPE_NOINFO, liblock_placement_core(name, ARG_NOINFO), lock, NULL)))
+		liblock_placement_register(lock, name);
+
+	return err;
+}
+
 void start_core(struct core* core, const char* name) {
 
 	liblock_start_server_threads_by_hand = 1;
@@ -21,6 +21,8 @@ extern const char*  liblock_lock_name;
 
 extern struct core* get_server_core_1();
 extern struct core* get_server_core_2();
+/* liblock_lock_init with TYPE_NOINFO, the lock is named for the lock placement */
+extern int liblock_phoenix_lock_init(liblock_lock_t* lock);
 /* extern struct core* get_server_core_3(); */
 
 /* #define TYPE_POSIX      "posix" */
@@ -41,7 +41,7 @@ static mr_lock_t ptmutex_alloc(void)
     m = malloc(sizeof(liblock_lock_t));
     assert (m != NULL);
 
-    err = liblock_lock_init(TYPE_NOINFO, ARG_NOINFO, m, NULL);
+    err = liblock_phoenix_lock_init(m);
     assert (err == 0);
 
     return m;
@@ -238,7 +238,7 @@ void pthread_cov() {
    pthread_attr_t attr;
    pthread_t * tid;
    
-   liblock_lock_init(TYPE_NOINFO, ARG_NOINFO, &row_lock, NULL);
+   liblock_phoenix_lock_init(&row_lock);
    
    /* Thread must be scheduled systemwide */
    pthread_attr_init(&attr);